@@ -1,10 +1,12 @@
 #include <iostream>
 #include "opencv2/calib3d.hpp"
+#include "Profiler.h"
 
 using namespace std;
 using namespace cv;
 
 float calibrate_with_points(Size &imageSize, Mat &cameraMatrix, Mat &distCoeffs, vector<vector<Point2f>> &imagePoints) {
+	PROFILE_SCOPE(PROFILE_CALIBRATE);
 
 	Size boardSize(5, 4);
 	float squareSize = 44.3;
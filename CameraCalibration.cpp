@@ -3,6 +3,10 @@
 #include "ImagePreprocessing.h"
 #include "PatternSearch.h"
 #include "CalibrateCamera.h"
+#include "Profiler.h"
+#include "FrameQueue.h"
+#include "UndistortMaps.h"
+#include "SharpnessGate.h"
 
 using namespace cv;
 using namespace std;
@@ -12,9 +16,17 @@ using namespace std;
 //#define CALIBRATION_PS3_VIDEO     "/home/alonzo/Downloads/PS3_rings.avi"
 #define CALIBRATION_PS3_VIDEO     "calibration_videos/PS3_Rings.webm"
 
+/* Frames decoded ahead of the detection, FRAME_QUEUE_LATEST for a live camera */
+#define DECODE_BUFFERS 4
+#define DECODE_POLICY  FRAME_QUEUE_BLOCK
+
+/* Profile of the session, written when the video ends */
+#define PROFILE_TRACE_FILE      "calibration_trace.json"
+#define PROFILE_HISTOGRAM_FILE  "calibration_profile.csv"
+
 int main( int argc, char** argv ) {
-    long double execTime, prevCount, time;
-    execTime = prevCount = time = 0;
+    long double execTime, prevCount;
+    execTime = prevCount = 0;
     Mat original, frame, frame_gray, masked;
     Mat m_success_rate;
     Mat m_calibration;
@@ -25,6 +37,12 @@ int main( int argc, char** argv ) {
     int wait_key = 1;
     int original_wait_key = wait_key;
     int keep_per_frames = 2;
+    int segmentation_method = SEGMENTATION_LEGACY;
+    bool roi_tracking = true;
+    PatternTracker tracker;
+    DetectionWorkspace workspace;
+    SharpnessGate sharpness_gate(SHARPNESS_MIN);
+    long double segmentation_time = 0;
     Point mask_points[1][4];
     int n_frame = 1;
     int detected_points = 0;
@@ -110,13 +128,18 @@ int main( int argc, char** argv ) {
     resizeWindow(window_name, window_w, window_h);
     moveWindow(window_name, window_w * 2 + second_screen_offste, window_h + 40);
 
+    FrameQueue frame_queue(cap, DECODE_BUFFERS, DECODE_POLICY);
+    UndistortMaps undistort_maps;
+    Mat rview;
     while (1) {
         std::ostringstream fps, success_rate, rms_str;
         m_success_rate = Mat::zeros(Size(window_w * 3, 40), CV_8UC3);
 
         //cap.set(1, n_frame);
+        // The display is timed with the tick count, the profiler is compiled out with -DPROFILER=0
         prevCount = getTickCount() * 1.0000;
-        if (!cap.read(frame)) {
+        ProfileScope frame_scope(PROFILE_FRAME);
+        if (!frame_queue.read(frame)) {
             cout << "\n Cannot read the video file. \n";
             break;
         }
@@ -161,44 +184,54 @@ int main( int argc, char** argv ) {
         rms = 0.15688;
         */
         if (rms != -1) {
-            Mat rview, map1, map2;
-            initUndistortRectifyMap(cameraMatrix,
-                                    distCoeffs,
-                                    Mat(),
-                                    getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, 1, imageSize, 0),
-                                    imageSize,
-                                    CV_16SC2,
-                                    map1,
-                                    map2);
-
-            remap(frame, rview, map1, map2, INTER_LINEAR);
+            undistort_maps.update(cameraMatrix, distCoeffs, imageSize);
+            remap_tiled(frame, rview, undistort_maps);
             imshow("Result", frame);
-            frame = rview;
+            swap(frame, rview);
         }
 
         original = frame.clone();
         //imshow("Original", original);
 
-        clean_using_mask(frame, w, h, mask_points);
-        //imshow("Masked", frame);
         masked = frame.clone();
 
         cvtColor( frame, frame_gray, CV_BGR2GRAY );
-        adaptiveThreshold(frame_gray, thresh, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 41, 12);
-        segmentar(frame_gray, frame_gray, thresh, w, h);
-        imshow("Threshold", frame_gray);
+        if (roi_tracking) {
+            tracker.predict(pattern_points, w, h, mask_points);
+        }
+        // Sharpness of the tracked region, before the mask adds its own edges
+        Rect sharpness_roi(0, 0, h, w);
+        if (roi_tracking && tracker.locked) {
+            sharpness_roi = mask_bounds(mask_points, w, h);
+        }
+        bool sharp = sharpness_gate.accept(frame_gray, sharpness_roi);
+        clean_using_mask(frame_gray, mask_points);
+        if (!sharp) {
+            // Blurred frame, not searched, the tracker (when enabled) counts it as a frame without measurement
+            detected_points = 0;
+            if (roi_tracking) {
+                tracker.update(pattern_points, false, false);
+            }
+            imshow("Threshold", frame_gray);
+            imshow("Contours", frame_gray);
+        } else if (roi_tracking) {
+            detected_points = find_pattern_points_tracked(frame_gray, masked, original, w, h, mask_points, pattern_points, keep_per_frames, segmentation_method, tracker, workspace);
+            imshow("Threshold", frame_gray);
+            imshow("Contours", workspace.binary);
+        } else {
+            threshold_frame(frame_gray, thresh, w, h, segmentation_method);
+            imshow("Threshold", frame_gray);
 
-        detected_points = find_pattern_points(frame_gray, masked, original, w, h, mask_points, pattern_points, keep_per_frames);
+            detected_points = find_pattern_points(frame_gray, masked, original, w, h, mask_points, pattern_points, keep_per_frames);
 
-        imshow("Contours", frame_gray);
+            imshow("Contours", frame_gray);
+        }
         imshow("Elipses", masked);
 
         if (n_frame == stop_at_frame) {
             wait_key = 0;
         }
 
-        time += execTime;
-
         if (detected_points == 20) {
             success_frames ++;
             distance_prom += avgColinearDistance(pattern_points);
@@ -232,9 +265,12 @@ int main( int argc, char** argv ) {
             }
         }
         imshow("Calibration", m_calibration);
-        fps << std::fixed << std::setprecision(2) << execTime * 1000 << "ms" ;
+        frame_scope.stop();
         execTime = (getTickCount() * 1.0000 - prevCount) / (getTickFrequency() * 1.0000);
-        success_rate << "S. Rate: " << success_frames << "/" << n_frame <<  " = " << std::fixed << std::setprecision(2) << success_frames * 100.0 / n_frame  << "%";
+        fps << std::fixed << std::setprecision(2) << execTime * 1000 << "ms" ;
+        segmentation_time += execTime;
+        success_rate << (segmentation_method == SEGMENTATION_FUSED ? "Fused " : "Legacy ") << "S. Rate: " << success_frames << "/" << n_frame <<  " = " << std::fixed << std::setprecision(2) << success_frames * 100.0 / n_frame  << "% "
+                     << segmentation_time * 1000 / n_frame << "ms Reacq: " << tracker.reacquisitions << " Blur: " << sharpness_gate.rejected;
         putText(m_success_rate, success_rate.str(), cvPoint(10, 30), FONT_HERSHEY_PLAIN, 2, cvScalar(0, 255, 0), 1, CV_AA);
         putText(m_success_rate, fps.str(), cvPoint(window_w * 2.5, 30), FONT_HERSHEY_PLAIN, 2, cvScalar(0, 255, 0), 1, CV_AA);
 
@@ -257,6 +293,21 @@ int main( int argc, char** argv ) {
                 wait_key = 0;
             }
         }
+        if (t == 'r') {
+            roi_tracking = !roi_tracking;
+            tracker.clear();
+        }
+        if (t == 'b') {
+            // Switch between segmentation methods and restart the statistics to compare them
+            segmentation_method = segmentation_method == SEGMENTATION_FUSED ? SEGMENTATION_LEGACY : SEGMENTATION_FUSED;
+            segmentation_time = 0;
+            success_frames = 0;
+            distance_prom = 0.0;
+            n_frame = 0;
+            tracker.reacquisitions = 0;
+            tracker.tracked_frames = 0;
+            sharpness_gate.clear();
+        }
         /*if (t == 'c' && detected_points == 20) {
             cout << "Frame " << n_frame << endl;
             vector<Point2f> temp(20);
@@ -281,5 +332,11 @@ int main( int argc, char** argv ) {
         //    n_frame++; 
         //}
     }
+    cout << "Sharpness gate: " << sharpness_gate.rejected << " of " << sharpness_gate.checked << " frames rejected" << endl;
+    // The decoder thread records its own spans, the profile is read once it has finished
+    frame_queue.stop();
+    profiler_print_summary(cout);
+    profiler_write_trace(PROFILE_TRACE_FILE);
+    profiler_write_histograms(PROFILE_HISTOGRAM_FILE);
     return 0;
 }
\ No newline at end of file
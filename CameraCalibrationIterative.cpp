@@ -1,9 +1,18 @@
 #include <iostream>
 #include <iomanip>
+#include <memory>
 #include "ImagePreprocessing.h"
 #include "PatternSearch.h"
 #include "CalibrateCamera.h"
-#include "CalibrationUtils.h"
+#include "PlanarPose.h"
+#include "Profiler.h"
+#include "FrameQueue.h"
+#include "UndistortMaps.h"
+#include "CanonicalView.h"
+#include "DetectionCache.h"
+#include "FrameStore.h"
+#include "FrameFetch.h"
+#include "SharpnessGate.h"
 
 using namespace cv;
 using namespace std;
@@ -20,8 +29,26 @@ using namespace std;
 #define REFINE_FP_IDEAL 5
 #define REFINE_FP_INTERSECTION 6
 
-bool find_points_in_frame(Mat &frame, Mat &output, int w, int h, vector<PatternPoint> &pattern_points, bool debug);
-bool find_points_in_frame(Mat &frame, int w, int h, vector<PatternPoint> &pattern_points, bool debug);
+#define SEGMENTATION_METHOD SEGMENTATION_LEGACY
+/* Search the pattern downsampled 2^PYRAMID_LEVELS times and refine it at full resolution, for high resolution cameras */
+#define PYRAMID_LEVELS 0
+
+/* Points of the fronto parallel iterations: detected in the undistorted frame, or detected
+ * once in the distorted frame and undistorted alone */
+#define FP_UNDISTORT_IMAGE  0
+#define FP_UNDISTORT_POINTS 1
+#define FRONTO_PARALLEL_UNDISTORT FP_UNDISTORT_POINTS
+
+/* Frames decoded ahead of the frame selection */
+#define DECODE_BUFFERS 4
+
+/* Profile of the calibration, written at the end */
+#define PROFILE_TRACE_FILE      "calibration_trace.json"
+#define PROFILE_HISTOGRAM_FILE  "calibration_profile.csv"
+
+bool find_points_in_frame(Mat &frame, Mat &output, int w, int h, vector<PatternPoint> &pattern_points, bool debug, DetectionWorkspace &workspace);
+string detection_config();
+bool find_points_in_frame(Mat &frame, int w, int h, vector<PatternPoint> &pattern_points, bool debug, DetectionWorkspace &workspace);
 void refine_points_avg(vector<PatternPoint> &old_points, vector<Point2f>&new_points);
 void refine_points_blend(vector<PatternPoint> &old_points, vector<Point2f>&new_points);
 void refine_points_varicenter(vector<PatternPoint> &old_points, vector<Point2f>&new_points);
@@ -198,17 +225,16 @@ void refine_points_intersection(vector<Point2f>& new_points) {
 }
 
 /**
- * @brief Skip f frames using a simple for,
+ * @brief Skip f frames using a simple for, the frames are grabbed and not retrieved
  *
  * @param cap Videocapture reference
  * @param f number of frames to be skiped
  */
 void skip_frames(VideoCapture &cap, int f) {
-	Mat frame;
+	PROFILE_SCOPE(PROFILE_DECODE);
 	for (int i = 0; i < f; i++) {
-		cap >> frame;
+		cap.grab();
 	}
-	frame.release();
 }
 
 /**
@@ -221,9 +247,12 @@ void skip_frames(VideoCapture &cap, int f) {
  * @param frames    Vector of frame positions selected
  * @param n_rows    Number of rows to define quads areas
  * @param n_columns Number of cols to define quads areas
+ * @param cache     Points of the frames detected before, the new detections are saved in it
+ * @param gate      Sharpness test, the blurred frames are not searched nor selected
+ * @param store     Frames decoded before, read instead of cap if it is open
  * @return          True if was posible to found the required number of frames
  */
-bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames, vector<int> &frames, const int n_rows, const int n_columns, Mat &m_calibration, Mat &m_centroids, const Mat camera_matrix, const Mat dist_coeffs) {
+bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames, vector<int> &frames, const int n_rows, const int n_columns, Mat &m_calibration, Mat &m_centroids, const Mat camera_matrix, const Mat dist_coeffs, DetectionCache &cache, SharpnessGate &gate, const FrameStore &store) {
 	cap.set(CAP_PROP_POS_FRAMES, 1);
 	int width  = h;
 	int height = w;
@@ -253,6 +282,14 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
 		}
 	}
 	vector<Point2f> temp(20);
+	DetectionWorkspace workspace;
+	vector<PatternPoint> pattern_points;
+	// Orientation of the board in closed form, the calibration is read once
+	PlanarPoseSolver pose_solver;
+	bool gate_pose = !camera_matrix.empty() && !dist_coeffs.empty();
+	if (gate_pose) {
+		pose_solver.set_camera(camera_matrix, dist_coeffs);
+	}
 
 	int** quadBins = new int*[n_rows];
 	for (int y_block = 0; y_block < n_rows; ++y_block) {
@@ -270,13 +307,40 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
 		max_points++;
 	}
 
+	// Decode the next frames while the current one is searched, every frame in order.
+	// With a frame store nothing is decoded, the search reads the gray frame of the map
+	unique_ptr<FrameQueue> frame_queue;
+	if (!store.is_open()) {
+		frame_queue.reset(new FrameQueue(cap, DECODE_BUFFERS, FRAME_QUEUE_BLOCK));
+	}
+	Mat frame_view, frame_gray;
 	while (selected_frames < n_frames && max_points * n_columns * n_rows > selected_frames) {
-		vector<PatternPoint> pattern_points;
-
-		if (!cap.read(frame)) {
-			break;
+		if (store.is_open()) {
+			if (!store.read(f + 1, frame)) {
+				break;
+			}
+			frame_view = store.gray(f + 1);
+		} else {
+			if (!frame_queue->read(frame)) {
+				break;
+			}
+			frame_to_gray(frame, frame_gray);
+			frame_view = frame_gray;
 		}
-		if (find_points_in_frame(frame, frame, w, h, pattern_points, false)) {
+		// The blurred frames are rejected before the search
+		bool found = false;
+		if (gate.accept(frame_view)) {
+			if (cache.lookup(f + 1, pattern_points)) {
+				found = pattern_points.size() == 20;
+				for (int p = 0; p < pattern_points.size(); p++) {
+					circle(frame, pattern_points[p].to_point2f(), 3, Scalar(0, 255, 0), -1);
+				}
+			} else {
+				found = find_points_in_frame(frame_view, frame, w, h, pattern_points, false, workspace);
+				cache.store(f + 1, found ? pattern_points : vector<PatternPoint>());
+			}
+		}
+		if (found) {
 
 			int x_block = floor((pattern_points[7].x + pattern_points[12].x) / 2.0 / blockSize_x);
 			int y_block = floor((pattern_points[7].y + pattern_points[12].y) / 2.0 / blockSize_y);
@@ -297,12 +361,12 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
 					for (int i = 0; i < 20; i++) {
 						temp[i] = pattern_points[i].to_point2f();
 					}
-					if (!camera_matrix.empty() && !dist_coeffs.empty()) {
-						getEulerAngles(objectPoints, temp, camera_matrix, dist_coeffs, eulerAngles);
+					if (gate_pose) {
+						bool posed = pose_solver.euler_angles(objectPoints, temp, eulerAngles);
 						float yaw = eulerAngles[1];
 						float pitch = eulerAngles[0];
 						float roll = eulerAngles[2];
-						if (!(yaw > -20 && yaw < 20 && roll > -30 && roll < 30 && (pitch > 150 || pitch < -150))) {
+						if (!posed || !(yaw > -20 && yaw < 20 && roll > -30 && roll < 30 && (pitch > 150 || pitch < -150))) {
 							rejected = true;
 						}
 					}
@@ -311,7 +375,9 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
 
 						frames.push_back(f + 1);
 						selected_frames++;
-						skip_frames(cap, on_success_skip);
+						if (frame_queue) {
+							frame_queue->skip(on_success_skip);
+						}
 						f += on_success_skip;
 
 						quadBins[y_block][x_block] ++;
@@ -321,7 +387,9 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
 					}
 				}
 				else {
-					skip_frames(cap, on_overflow_skip);
+					if (frame_queue) {
+						frame_queue->skip(on_overflow_skip);
+					}
 					f += on_overflow_skip;
 				}
 			}
@@ -373,16 +441,19 @@ bool select_frames_process(VideoCapture &cap, int w, int h, const int n_frames,
  * @param frames    Vector of frame positions selected
  * @param n_rows    Number of rows to define quads areas
  * @param n_columns Number of cols to define quads areas
+ * @param cache     Points of the frames detected before, the new detections are saved in it
+ * @param gate      Sharpness test, the blurred frames are not searched nor selected
+ * @param store     Frames decoded before, read instead of cap if it is open
  * @return          True if was posible to found the required number of frames
  */
-bool select_frames(VideoCapture &cap, int w, int h, const int n_frames, vector<int> &frames, const int n_rows, const int n_columns, const Mat camera_matrix, const Mat dist_coeffs) {
+bool select_frames(VideoCapture &cap, int w, int h, const int n_frames, vector<int> &frames, const int n_rows, const int n_columns, const Mat camera_matrix, const Mat dist_coeffs, DetectionCache &cache, SharpnessGate &gate, const FrameStore &store) {
 	frames.clear();
 	int rows = n_rows;
 	int cols = n_columns;
 	int select_frames = n_frames;
 	Mat m_calibration = Mat::zeros(Size(h, w), CV_8UC3);
 	Mat m_centroids = Mat::zeros(Size(h, w), CV_8UC3);
-	while (!select_frames_process(cap, w, h, select_frames, frames, rows, cols, m_calibration, m_centroids, camera_matrix, dist_coeffs)) {
+	while (!select_frames_process(cap, w, h, select_frames, frames, rows, cols, m_calibration, m_centroids, camera_matrix, dist_coeffs, cache, gate, store)) {
 		rows --;
 		cols --;
 		select_frames = n_frames - frames.size();
@@ -420,50 +491,115 @@ void calibrate_camera(int w, int h, vector<vector<Point2f>> &set_points, Mat & c
  * @param h             Height of the frame
  * @param camera_matrix Camera matrix
  * @param dist_coeffs   Distortion coefficients
+ * @param maps          Maps of the previous call, rebuilt only if the calibration changed
  */
-void undistort_image(Mat & frame, int w, int h, const Mat camera_matrix, const Mat dist_coeffs) {
-	Mat rview, map1, map2;
-	Size imageSize(h, w);
-	initUndistortRectifyMap(camera_matrix,
-	                        dist_coeffs,
-	                        Mat(),
-	                        getOptimalNewCameraMatrix(camera_matrix, dist_coeffs, imageSize, 1, imageSize, 0),
-	                        imageSize,
-	                        CV_16SC2,
-	                        map1,
-	                        map2);
-
-	remap(frame, rview, map1, map2, INTER_LINEAR);
-	rview.copyTo(frame);
-	rview.release();
-	map1.release();
-	map2.release();
+void undistort_image(Mat & frame, int w, int h, const Mat camera_matrix, const Mat dist_coeffs, UndistortMaps &maps) {
+	Mat rview;
+	maps.update(camera_matrix, dist_coeffs, Size(h, w));
+	remap_tiled(frame, rview, maps);
+	swap(frame, rview);
 }
 
 /**
- * @brief Search pattern points of choosen frames and save the points in the set_points array
+ * @brief Decode the frames of the list in one forward pass without seeking, the decoder can not
+ * be shared between threads. With a frame store nothing is decoded
+ *
+ * @param cap           VideoCapture reference
+ * @param store         Frames decoded before, read instead of cap if it is open
+ * @param frames        Frame positions
+ * @param images        Decoded frames, in the same order
+ * @param views         With a store, return read only views of the map instead of copies in color
+ */
+void read_frames(VideoCapture & cap, const FrameStore &store, const vector<int> &frames, vector<Mat> &images, bool views) {
+	images.resize(frames.size());
+	if (store.is_open()) {
+		for (int f = 0; f < frames.size(); f++) {
+			if (views) {
+				images[f] = store.view(frames[f]);
+			} else if (!store.read(frames[f], images[f])) {
+				images[f].release();
+			}
+		}
+		return;
+	}
+	fetch_frames(cap, frames, [&images](int f, Mat & frame) {
+		images[f] = frame;
+	});
+}
+
+/**
+ * @brief Pattern points of the frames, the frames that are not in the cache are searched
+ * in parallel and saved in the cache
+ *
+ * @param cap           VideoCapture reference
+ * @param store         Frames decoded before, read instead of cap if it is open
+ * @param w             Width of the frame
+ * @param h             Height of the frame
+ * @param frames        Frame positions
+ * @param images        Decoded frames in the order of frames, empty to decode only the frames not cached
+ * @param pattern_points Points of every frame, empty if the pattern was not found
+ * @param cache         Points of the frames detected before
+ * @param pool          Threads of the search
+ * @param workspaces    Detection buffers of every thread
+ */
+void detect_frames_cached(VideoCapture & cap, const FrameStore &store, int w, int h, const vector<int> &frames, const vector<Mat> &images, vector<vector<PatternPoint>> &pattern_points, DetectionCache &cache, WorkStealingPool &pool, vector<DetectionWorkspace> &workspaces) {
+	vector<int> missing;
+	vector<Mat> missing_images;
+	vector<vector<PatternPoint>> detected;
+	pattern_points.resize(frames.size());
+	for (int f = 0; f < frames.size(); f++) {
+		if (!cache.lookup(frames[f], pattern_points[f])) {
+			missing.push_back(f);
+		}
+	}
+	if (missing.empty()) {
+		return;
+	}
+	if (images.size() == frames.size()) {
+		for (int i = 0; i < missing.size(); i++) {
+			missing_images.push_back(images[missing[i]]);
+		}
+	} else {
+		vector<int> missing_frames;
+		for (int i = 0; i < missing.size(); i++) {
+			missing_frames.push_back(frames[missing[i]]);
+		}
+		read_frames(cap, store, missing_frames, missing_images, true);
+	}
+	detect_pattern_batch(missing_images, w, h, SEGMENTATION_METHOD, PYRAMID_LEVELS, detected, pool, workspaces);
+	for (int i = 0; i < missing.size(); i++) {
+		pattern_points[missing[i]] = detected[i];
+		cache.store(frames[missing[i]], detected[i]);
+	}
+}
+
+/**
+ * @brief Search pattern points of choosen frames and save the points in the set_points array,
+ * the frames are searched in parallel, only the frames that are not in the cache are decoded
  *
  * @param cap           VideoCapture reference
  * @param w             Width of the frame
  * @param h             Height of the frame
  * @param set_points    Set of points to use in the camera calibration
+ * @param cache         Points of the frames detected before
+ * @param store         Frames decoded before, read instead of cap if it is open
  */
-void collect_points(VideoCapture & cap, int w, int h, const vector<int> &frames, vector<vector<Point2f>> &set_points) {
+void collect_points(VideoCapture & cap, int w, int h, const vector<int> &frames, vector<vector<Point2f>> &set_points, DetectionCache &cache, const FrameStore &store) {
 	set_points.clear();
-	Mat frame;
+	vector<Mat> no_images;
+	vector<vector<PatternPoint>> pattern_points;
+	WorkStealingPool pool;
+	vector<DetectionWorkspace> workspaces;
+	detect_frames_cached(cap, store, w, h, frames, no_images, pattern_points, cache, pool, workspaces);
 	for (int f = 0; f < frames.size(); f++) {
-		cap.set(CAP_PROP_POS_FRAMES, frames[f]);
-		cap.read(frame);
-		vector<PatternPoint> pattern_points;
-		if (find_points_in_frame(frame, frame, w, h, pattern_points, false)) {
+		if (pattern_points[f].size() == 20) {
 			vector<Point2f> temp(20);
 			for (int i = 0; i < 20; i++) {
-				temp[i] = pattern_points[i].to_point2f();
+				temp[i] = pattern_points[f][i].to_point2f();
 			}
 			set_points.push_back(temp);
 		}
 	}
-	frame.release();
 }
 
 /**
@@ -511,36 +647,160 @@ void distortPoints(const vector<Point2f> &xy, vector<Point2f> &uv, const Mat & c
 }
 
 /**
- * @brief Search pattern points in the undistorted image, find a homography
+ * @brief Points of one frame refined in the fronto parallel view
+ */
+struct FrontoParallelResult {
+	bool found;
+	vector<Point2f> points_distort;         // Refined points with distortion, used in the calibration
+	vector<Point2f> points_undistorted;     // Points of the frame without distortion, before the refinement
+	vector<Point2f> points_refined;         // Refined points without distortion
+};
+
+/**
+ * @brief Search pattern points in the undistorted frame, find a homography
  * to get a cannonical view, find patter points in the cannonical view and
- * refine points and save the points in the set_points array
- * @details [long description]
+ * refine the points. It only uses its arguments, so many frames can be refined at the same time.
+ * If the points of the distorted frame are given only these points are undistorted, the
+ * undistorted frame is not built
+ *
+ * @param frame         Video frame, the points are drawn over it
+ * @param w             Width of the frame
+ * @param h             Height of the frame
+ * @param points_real   Position of the points in the cannonical view
+ * @param original_points Points of the frame in the previous iteration, only drawn
+ * @param camera_matrix Camera matrix
+ * @param dist_coeffs   Distortion coefficients
+ * @param maps          Undistortion maps of camera_matrix and dist_coeffs with the same camera matrix,
+ *                      only used if frame_points are not given
+ * @param frame_points  Points detected in the distorted frame, empty to search them in the undistorted frame
+ * @param refine_type   Tipe of refinement in every iteration
+ * @param refine_fronto_parallel_type Tipe of refinement in the cannonical view
+ * @param workspace     Detection buffers of the thread
+ * @param view          Region of the cannonical view and its maps, of the thread
+ * @param result        Refined points
+ * @param input_undistorted Undistorted frame with the points drawn, empty if frame_points are given
+ * @param img_out       Cannonical view with the points drawn
+ */
+void refine_frame_fronto_parallel(Mat & frame, int w, int h, const vector<Point3f> &points_real, const vector<Point2f> &original_points, const Mat & camera_matrix, const Mat & dist_coeffs, const UndistortMaps &maps, const vector<PatternPoint> &frame_points, int refine_type, int refine_fronto_parallel_type, DetectionWorkspace &workspace, CanonicalView &view, FrontoParallelResult &result, Mat &input_undistorted, Mat &img_out) {
+	int n_points = 20;
+	vector<Point2f> temp(n_points);
+	vector<PatternPoint> points_undistorted;
+	vector<PatternPoint> points_fronto_parallel;
+
+	result.found = false;
+	if (frame_points.size() == n_points) {
+		vector<Point2f> points_distort(n_points);
+		for (int i = 0; i < n_points; i++) {
+			points_distort[i] = frame_points[i].to_point2f();
+		}
+		{
+			PROFILE_SCOPE(PROFILE_UNDISTORT);
+			undistortPoints(points_distort, temp, camera_matrix, dist_coeffs, Mat(), camera_matrix);
+		}
+		points_undistorted = frame_points;
+		for (int i = 0; i < n_points; i++) {
+			points_undistorted[i].x = temp[i].x;
+			points_undistorted[i].y = temp[i].y;
+		}
+	} else {
+		{
+			PROFILE_SCOPE(PROFILE_UNDISTORT);
+			remap(frame, input_undistorted, maps.map1, maps.map2, INTER_LINEAR);
+		}
+		if (!find_points_in_frame(input_undistorted, w, h, points_undistorted, false, workspace)) {
+			return;
+		}
+		for (int i = 0; i < n_points; i++) {
+			temp[i] = points_undistorted[i].to_point2f();
+		}
+	}
+
+	// The cannonical view samples the distorted frame once, through the inverse homography and the distortion
+	Mat inv_homography = cv::findHomography(points_real, temp);
+	view.render(frame, img_out, inv_homography, camera_matrix, dist_coeffs);
+	for (int p = 0; p < n_points && !input_undistorted.empty(); p++) {
+		circle(input_undistorted, points_undistorted[p].to_point2f(), 2, Scalar(0, 255, 0));
+	}
+	if (!find_points_in_frame(img_out, img_out, img_out.rows, img_out.cols, points_fronto_parallel, false, workspace)) {
+		return;
+	}
+	for (int p = 0; p < n_points; p++) {
+		circle(img_out, points_fronto_parallel[p].to_point2f(), 2, Scalar(0, 255, 0));
+	}
+
+	vector<Point2f> object_p_canonical;
+	for (int p = 0; p < 20; p++) {
+		object_p_canonical.push_back(view.to_canonical(points_fronto_parallel[p].to_point2f()));
+	}
+	if (refine_fronto_parallel_type == REFINE_FP_IDEAL) {
+		for (int p = 0; p < 20; p++) {
+			object_p_canonical[p] = Point2f((object_p_canonical[p].x + points_real[p].x) / 2.0,
+			                                (object_p_canonical[p].y + points_real[p].y) / 2.0);
+		}
+	} else if (refine_fronto_parallel_type == REFINE_FP_INTERSECTION) {
+		refine_points_intersection(object_p_canonical);
+	}
+	vector<Point2f> &new_points2D = result.points_refined;
+	vector<Point2f> &new_points2D_distort = result.points_distort;
+	new_points2D.resize(n_points);
+	new_points2D_distort.resize(n_points);
+
+	//cout << "FParallel error " << avgColinearDistance(points_fronto_parallel) << endl;
+	perspectiveTransform(object_p_canonical, new_points2D, inv_homography);
+	for (int p = 0; p < n_points; p++) {
+		if (!input_undistorted.empty()) {
+			circle(input_undistorted, new_points2D[p], 2, Scalar(0, 0, 255));
+		}
+		circle(frame, new_points2D[p], 2, Scalar(0, 255, 0));
+	}
+
+	refine_points(points_undistorted, new_points2D, refine_type);
+
+	distortPoints(new_points2D, new_points2D_distort, camera_matrix, dist_coeffs);
+	for (int p = 0; p < original_points.size(); p++) {
+		circle(frame, original_points[p], 2, Scalar(0, 0, 255));
+	}
+	for (int p = 0; p < n_points; p++) {
+		circle(frame, new_points2D_distort[p], 2, Scalar(255, 0, 0));
+	}
+	result.points_undistorted = temp;
+	result.found = true;
+}
+
+/**
+ * @brief Refine the pattern points of the choosen frames in the fronto parallel view and
+ * save the points in the set_points array. The frames are decoded in order and refined in
+ * parallel, the windows show the last frame refined
  *
  * @param cap           VideoCapture reference
  * @param w             Width of the frame
  * @param h             Height of the frame
  * @param set_points    Set of points to use in the camera calibration
+ * @param frame_points  Points of the distorted frames in the order of frames, with FP_UNDISTORT_POINTS
+ *                      they are detected in the first call and kept for the next iterations
+ * @param cache         Points of the frames detected before
+ * @param store         Frames decoded before, read instead of cap if it is open
  * @param camera_matrix Camera matrix
  * @param dist_coeffs   Distortion coefficients
  * @param refine_type   Tipe of refinement in every iteration
  */
-void collect_points_fronto_parallel(VideoCapture & cap, int w, int h, const vector<int> &frames, vector<vector<Point2f>> &original_set_points, vector<vector<Point2f>> &set_points, const Mat & camera_matrix, const Mat & dist_coeffs, int refine_type, int refine_fronto_parallel_type) {
-	Size imageSize(h, w);
+void collect_points_fronto_parallel(VideoCapture & cap, int w, int h, const vector<int> &frames, vector<vector<Point2f>> &original_set_points, vector<vector<Point2f>> &set_points, vector<vector<PatternPoint>> &frame_points, DetectionCache &cache, const FrameStore &store, const Mat & camera_matrix, const Mat & dist_coeffs, int refine_type, int refine_fronto_parallel_type) {
 	Size boardSize(5, 4);
-	int n_points = 20;
 	float desp_w = h * 0.2;
 	float desp_h = w * 0.2;
 	float squareSize = w / 5.5;
-	Mat frame;
-	Mat map1, map2;
-	Mat input_undistorted;
 	vector<Point3f> points_real;
-	vector<Point2f> temp(n_points);
-	vector<Point2f> temp2(n_points);
 	vector<vector<Point2f>> start_set_points;
 	vector<vector<Point2f>> new_set_points;
-	vector<PatternPoint> points_undistorted;
-	vector<PatternPoint> points_fronto_parallel;
+	vector<Mat> images;
+	vector<FrontoParallelResult> results(frames.size());
+	WorkStealingPool pool;
+	vector<DetectionWorkspace> workspaces(pool.n_threads);
+	vector<CanonicalView> views(pool.n_threads);
+	mutex view_lock;
+	int view_frame = -1;
+	Mat view_undistorted, view_fronto_parallel, view_distort;
+	UndistortMaps maps;
 
 	for ( int i = 0; i < boardSize.height; i++ ) {
 		for ( int j = 0; j < boardSize.width; j++ ) {
@@ -550,105 +810,89 @@ void collect_points_fronto_parallel(VideoCapture & cap, int w, int h, const vect
 	}
 
 	set_points.clear();
-
-	for (int f = 0; f < frames.size(); f++) {
-		points_undistorted.clear();
-		points_fronto_parallel.clear();
-		cap.set(1, frames[f]);
-		cap.read(frame);
-
-		// ONLY FOR VISUALIZATION PURPOSES
-		initUndistortRectifyMap(camera_matrix,
-		                        dist_coeffs,
-		                        Mat(),
-		                        getOptimalNewCameraMatrix(camera_matrix, dist_coeffs, imageSize, 1, imageSize, 0),
-		                        imageSize,
-		                        CV_16SC2,
-		                        map1,
-		                        map2);
-		remap(frame, input_undistorted, map1, map2, INTER_LINEAR);
-		map1.release();
-		map2.release();
-		imshow("Undistort", input_undistorted);
-
-		undistort(frame, input_undistorted, camera_matrix, dist_coeffs);
-		if (!find_points_in_frame(input_undistorted, w, h, points_undistorted, false)) {
-			continue;
+	// The frames are drawn, so they are copies of the store
+	read_frames(cap, store, frames, images, false);
+	// The maps are built once for all the frames, the workers only read them. Undistorting
+	// the points does not use them
+	if (FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_IMAGE) {
+		maps.update(camera_matrix, dist_coeffs, Size(h, w), UNDISTORT_KEEP_CAMERA);
+	}
+	for (int t = 0; t < views.size(); t++) {
+		views[t].set_region(points_real, squareSize * CANONICAL_MARGIN);
+	}
+	if (FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_POINTS && frame_points.size() != frames.size()) {
+		detect_frames_cached(cap, store, w, h, frames, images, frame_points, cache, pool, workspaces);
+	}
+	pool.run(frames.size(), [&](int f, int worker) {
+		Mat input_undistorted, img_out;
+		vector<Point2f> no_points;
+		vector<PatternPoint> no_pattern_points;
+		const vector<Point2f> &original_points = f < original_set_points.size() ? original_set_points[f] : no_points;
+		if (FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_POINTS && frame_points[f].size() != 20) {
+			results[f].found = false;
+			return;
 		}
-		for (int i = 0; i < n_points; i++) {
-			temp[i] = points_undistorted[i].to_point2f();
+		const vector<PatternPoint> &points = FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_POINTS ? frame_points[f] : no_pattern_points;
+		refine_frame_fronto_parallel(images[f], w, h, points_real, original_points, camera_matrix, dist_coeffs, maps, points, refine_type, refine_fronto_parallel_type, workspaces[worker], views[worker], results[f], input_undistorted, img_out);
+		if (results[f].found) {
+			lock_guard<mutex> guard(view_lock);
+			if (f > view_frame) {
+				view_frame = f;
+				view_undistorted = input_undistorted;
+				view_fronto_parallel = img_out;
+				view_distort = images[f];
+			}
 		}
+	});
 
-		Mat homography = cv::findHomography(temp, points_real);
-		Mat inv_homography = cv::findHomography(points_real, temp);
-		Mat img_in = input_undistorted.clone();
-		Mat img_out = input_undistorted.clone();
-		cv::warpPerspective(img_in, img_out, homography, imageSize);
-		for (int p = 0; p < n_points; p++) {
-			circle(input_undistorted, points_undistorted[p].to_point2f(), 2, Scalar(0, 255, 0));
+	for (int f = 0; f < frames.size(); f++) {
+		if (results[f].found) {
+			set_points.push_back(results[f].points_distort);
+			start_set_points.push_back(results[f].points_undistorted);
+			new_set_points.push_back(results[f].points_refined);
 		}
-		if (find_points_in_frame(img_out, img_out, w, h, points_fronto_parallel, false)) {
-			for (int p = 0; p < n_points; p++) {
-				circle(img_out, points_fronto_parallel[p].to_point2f(), 2, Scalar(0, 255, 0));
-			}
-
-			vector<Point2f> object_p_canonical;
-			if (refine_fronto_parallel_type == REFINE_FP_IDEAL) {
-				for (int p = 0; p < 20; p++) {
-					object_p_canonical.push_back(Point2f((points_fronto_parallel[p].x + points_real[p].x) / 2.0,
-					                                     (points_fronto_parallel[p].y + points_real[p].y) / 2.0));
-				}
-			} else if (refine_fronto_parallel_type == REFINE_FP_INTERSECTION) {
-				for (int p = 0; p < 20; p++) {
-					object_p_canonical.push_back(points_fronto_parallel[p].to_point2f());
-				}
-				refine_points_intersection(object_p_canonical);
-			} else {
-				for (int p = 0; p < 20; p++) {
-					object_p_canonical.push_back(points_fronto_parallel[p].to_point2f());
-				}
-			}
-			vector<Point2f> new_points2D(n_points);
-
-			vector<Point2f> new_points2D_distort(n_points);
-			//cout << "FParallel error " << avgColinearDistance(points_fronto_parallel) << endl;
-			perspectiveTransform(object_p_canonical, new_points2D, inv_homography);
-			for (int p = 0; p < n_points; p++) {
-				circle(input_undistorted, new_points2D[p], 2, Scalar(0, 0, 255));
-				circle(frame, new_points2D[p], 2, Scalar(0, 255, 0));
-			}
-
-			refine_points(points_undistorted, new_points2D, refine_type);
-
-			distortPoints(new_points2D, new_points2D_distort, camera_matrix, dist_coeffs);
-			for (int p = 0; p < n_points; p++) {
-				circle(frame, original_set_points[f][p], 2, Scalar(0, 0, 255));
-			}
-			for (int p = 0; p < n_points; p++) {
-				circle(frame, new_points2D_distort[p], 2, Scalar(255, 0, 0));
-			}
-			set_points.push_back(new_points2D_distort);
-
-			for (int i = 0; i < n_points; i++) {
-				temp2[i] = points_undistorted[i].to_point2f();
-			}
-			start_set_points.push_back(temp2);
-			new_set_points.push_back(new_points2D);
-
-			imshow("FrontoParallel", img_out);
-			imshow("Reproject", input_undistorted);
-			imshow("Distort", frame);
+	}
+	if (view_frame != -1) {
+		if (!view_undistorted.empty()) {
+			imshow("Undistort", view_undistorted);
+			imshow("Reproject", view_undistorted);
 		}
-		img_in.release();
-		img_out.release();
-		homography.release();
-		inv_homography.release();
+		imshow("FrontoParallel", view_fronto_parallel);
+		imshow("Distort", view_distort);
 		waitKey(1);
 	}
 	cout << "\t" << avgColinearDistance(start_set_points);
 	cout << "\t" << avgColinearDistance(new_set_points) << endl;
 }
 
+/**
+ * @brief Find patter points in the frame without drawing anything
+ *
+ * @param frame             Video frame
+ * @param w                 Width of the frame
+ * @param h                 Height of the frame
+ * @param pattern_points    Pattern points found in the frame
+ * @param workspace         Buffers reused between frames, workspace.detection can be drawn with draw_pattern_detection
+ * @return                  True if we found all the 20 points
+ */
+bool detect_points_in_frame(Mat & frame, int w, int h, vector<PatternPoint> &pattern_points, DetectionWorkspace &workspace) {
+	return detect_pattern_in_frame_pyramid(frame, w, h, pattern_points, SEGMENTATION_METHOD, PYRAMID_LEVELS, workspace);
+}
+
+/**
+ * @brief Configuration of the detection saved with the DetectionCache, the cached points
+ * are discarded if any value changes
+ *
+ * @return Configuration of the detector as text
+ */
+string detection_config() {
+	DetectionWorkspace workspace;
+	return "rings segmentation " + to_string(SEGMENTATION_METHOD) +
+	       " pyramid " + to_string(PYRAMID_LEVELS) +
+	       " candidates " + to_string(workspace.candidate_method) +
+	       " axis_ratio " + to_string(ELLIPSE_MIN_AXIS_RATIO);
+}
+
 /**
  * @brief Find patter points in the frame
  *
@@ -658,40 +902,36 @@ void collect_points_fronto_parallel(VideoCapture & cap, int w, int h, const vect
  * @param h                 Height of the frame
  * @param pattern_points    Pattern points found in the frame
  * @param debug             If debug in enabled show the step by step process of detection
+ * @param workspace         Buffers reused between frames
  * @return                  True if we found all the 20 points
  */
-bool find_points_in_frame(Mat & frame, Mat & output, int w, int h, vector<PatternPoint> &pattern_points, bool debug) {
-	//clean_using_mask(frame, w, h, mask_points);
-	Mat masked, frame_gray, thresh;
-	Point mask_points[1][4];
-	masked = frame.clone();
-	cvtColor( frame, frame_gray, CV_BGR2GRAY );
-	adaptiveThreshold(frame_gray, thresh, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 41, 12);
-	segmentar(frame_gray, frame_gray, thresh, w, h);
-	if (debug) imshow("FrameGray", frame_gray);
-	int keep_per_frames = 2;
-	int detected_points = find_pattern_points(frame_gray, masked, output, w, h, mask_points, pattern_points, keep_per_frames);
+bool find_points_in_frame(Mat & frame, Mat & output, int w, int h, vector<PatternPoint> &pattern_points, bool debug, DetectionWorkspace &workspace) {
+	Mat masked, binary;
+	if (debug) masked = frame.clone();
+	bool found = detect_points_in_frame(frame, w, h, pattern_points, workspace);
+	draw_pattern_detection(binary, masked, output, workspace.detection);
 	if (debug) imshow("Masked", masked);
 	if (debug) imshow("Original", output);
-	masked.release();
-	frame_gray.release();
-	thresh.release();
-	return detected_points == 20;
+	return found;
 }
 
 /**
- * @brief Find patter points in the frame
+ * @brief Find patter points in the frame, nothing is drawn unless debug is enabled
  *
  * @param frame             Video frame
  * @param w                 Width of the frame
  * @param h                 Height of the frame
  * @param pattern_points    Pattern points found in the frame
  * @param debug             If debug in enabled show the step by step process of detection
+ * @param workspace         Buffers reused between frames
  * @return                  True if we found all the 20 points
  */
-bool find_points_in_frame(Mat & frame, int w, int h, vector<PatternPoint> &pattern_points, bool debug) {
-	Mat output = frame.clone();
-	return find_points_in_frame(frame, output, w, h, pattern_points, debug);
+bool find_points_in_frame(Mat & frame, int w, int h, vector<PatternPoint> &pattern_points, bool debug, DetectionWorkspace &workspace) {
+	if (debug) {
+		Mat output = frame.clone();
+		return find_points_in_frame(frame, output, w, h, pattern_points, debug, workspace);
+	}
+	return detect_points_in_frame(frame, w, h, pattern_points, workspace);
 }
 
 /**
@@ -741,8 +981,9 @@ int main( int argc, char** argv ) {
 	for (int i = 0; i < num_color_palette; i++) {
 		color_palette[i] = Scalar(rng.uniform(0, 255), rng.uniform(0, 255), rng.uniform(0, 255));
 	}
-	//VideoCapture cap(CALIBRATION_LIFECAM_VIDEO);
-	VideoCapture cap(CALIBRATION_PS3_VIDEO);
+	//string video_path = CALIBRATION_LIFECAM_VIDEO;
+	string video_path = CALIBRATION_PS3_VIDEO;
+	VideoCapture cap(video_path);
 
 	if ( !cap.isOpened() ) {
 		cout << "Cannot open the video file. \n";
@@ -753,6 +994,16 @@ int main( int argc, char** argv ) {
 	cap.read(frame);
 	int w = frame.rows;
 	int h = frame.cols;
+	// Frames of the video decoded before by DecodeVideo, if they exist and are the frames of the video
+	FrameStore frame_store;
+	if (frame_store.open(frame_store_path(video_path))) {
+		if (frame_store.matches(cap, Size(h, w))) {
+			cout << "Reading " << frame_store.size() << " frames from " << frame_store_path(video_path) << endl;
+		} else {
+			cout << frame_store_path(video_path) << " is not a store of this video, decoding it" << endl;
+			frame_store.close();
+		}
+	}
 	int n_rows = 3;
 	int n_columns = 4;
 
@@ -763,22 +1014,33 @@ int main( int argc, char** argv ) {
 	window_setup();
 
 	// To find initial calibration
-	select_frames(cap, w, h, frames_to_select, frames, n_rows, n_columns, camera_matrix, dist_coeffs);
-	collect_points(cap, w, h, frames, original_set_points);
+	// Detections of the previous runs over the same video, any frame is searched only once
+	DetectionCache detection_cache(video_path, detection_config());
+	// Blurred frames are skipped by the selection
+	SharpnessGate sharpness_gate(SHARPNESS_MIN);
+	select_frames(cap, w, h, frames_to_select, frames, n_rows, n_columns, camera_matrix, dist_coeffs, detection_cache, sharpness_gate, frame_store);
+	collect_points(cap, w, h, frames, original_set_points, detection_cache, frame_store);
 	calibrate_camera(w, h, original_set_points, camera_matrix, dist_coeffs);
 
 	// Use initial calibration to reject frames with high rotation
-	select_frames(cap, w, h, frames_to_select, frames, n_rows, n_columns, camera_matrix, dist_coeffs);
+	select_frames(cap, w, h, frames_to_select, frames, n_rows, n_columns, camera_matrix, dist_coeffs, detection_cache, sharpness_gate, frame_store);
 	//load_frames(frames_to_select, frames);
-	collect_points(cap, w, h, frames, original_set_points);
+	collect_points(cap, w, h, frames, original_set_points, detection_cache, frame_store);
+	detection_cache.save();
 	calibrate_camera(w, h, original_set_points, camera_matrix, dist_coeffs);
 
 	int n_iterations = 6;
+	vector<vector<PatternPoint>> frame_points;
 	for (int i = 0; i < n_iterations; i++) {
-		collect_points_fronto_parallel(cap, w, h, frames, original_set_points, set_points, camera_matrix, dist_coeffs, REFINE_VARICENTER, REFINE_FP_INTERSECTION);
+		collect_points_fronto_parallel(cap, w, h, frames, original_set_points, set_points, frame_points, detection_cache, frame_store, camera_matrix, dist_coeffs, REFINE_VARICENTER, REFINE_FP_INTERSECTION);
 		calibrate_camera(w, h, set_points, camera_matrix, dist_coeffs);
 	}
 	cout << endl;
+	cout << "Detection cache: " << detection_cache.hits << " hits, " << detection_cache.misses << " misses" << endl;
+	cout << "Sharpness gate: " << sharpness_gate.rejected << " of " << sharpness_gate.checked << " frames rejected" << endl;
+	profiler_print_summary(cout);
+	profiler_write_trace(PROFILE_TRACE_FILE);
+	profiler_write_histograms(PROFILE_HISTOGRAM_FILE);
 	waitKey(0);
 	return 0;
 }
\ No newline at end of file
@@ -221,7 +221,7 @@ int main( int argc, char** argv ) {
         original = frame.clone();
         //imshow("Original", original);
 
-        clean_using_mask(frame, w, h, mask_points);
+        clean_using_mask(frame, mask_points);
         //imshow("Masked", frame);
         masked = frame.clone();
 
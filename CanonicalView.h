@@ -0,0 +1,152 @@
+#pragma once
+#include <cmath>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "Profiler.h"
+
+using namespace cv;
+using namespace std;
+
+/* Border of the canonical region around the control points, in spacings of the grid */
+#define CANONICAL_MARGIN 1.0
+/* Pixels of the canonical view per unit of the canonical coordinates */
+#define CANONICAL_SCALE  1.0
+
+/**
+ * @details Fronto parallel view of the board rendered straight from the distorted frame.
+ * Every pixel of the view goes through the inverse homography, the distortion model and
+ * the camera matrix in one lookup map, so the frame is sampled once instead of being
+ * undistorted and then warped. Only the region of the board is rendered, at `scale`
+ * pixels per canonical unit
+ */
+struct CanonicalView {
+    Point2f origin;                     // Canonical coordinates of the pixel (0, 0)
+    float scale;                        // Pixels per canonical unit
+    Size size;                          // Size of the view
+    Mat map_x;                          // CV_32FC1 columns of the distorted frame
+    Mat map_y;                          // CV_32FC1 rows of the distorted frame
+
+    CanonicalView() : scale(1) {}
+
+    /**
+     * @details Region of the view, the bounding box of the canonical points plus a margin
+     *
+     * @param points Canonical positions of the control points
+     * @param margin Border around the points in canonical units
+     * @param scale Pixels per canonical unit
+     */
+    void set_region(const vector<Point3f> &points, float margin, float scale = CANONICAL_SCALE) {
+        float min_x = points[0].x, max_x = points[0].x;
+        float min_y = points[0].y, max_y = points[0].y;
+        for (size_t p = 1; p < points.size(); p++) {
+            min_x = min(min_x, points[p].x);
+            max_x = max(max_x, points[p].x);
+            min_y = min(min_y, points[p].y);
+            max_y = max(max_y, points[p].y);
+        }
+        this->scale = scale;
+        origin = Point2f(min_x - margin, min_y - margin);
+        size = Size((int)ceil((max_x - min_x + 2 * margin) * scale),
+                    (int)ceil((max_y - min_y + 2 * margin) * scale));
+    }
+
+    /**
+     * @details Pixel of the view to canonical coordinates
+     */
+    Point2f to_canonical(const Point2f &pixel) const {
+        return Point2f(origin.x + pixel.x / scale, origin.y + pixel.y / scale);
+    }
+
+    /**
+     * @details Canonical coordinates to pixel of the view
+     */
+    Point2f to_pixel(const Point2f &canonical) const {
+        return Point2f((canonical.x - origin.x) * scale, (canonical.y - origin.y) * scale);
+    }
+
+    /**
+     * @details Build the lookup maps of a frame. The homography goes from the canonical
+     * coordinates to the undistorted image of camera_matrix, as the one computed over
+     * points undistorted with the same camera matrix
+     *
+     * @param homography Canonical coordinates to undistorted pixels
+     * @param camera_matrix Camera matrix
+     * @param dist_coeffs Distortion coefficients k1 k2 p1 p2 k3, as in distortPoints
+     */
+    void build(const Mat &homography, const Mat &camera_matrix, const Mat &dist_coeffs) {
+        double fx = camera_matrix.at<double>(0, 0);
+        double skew = camera_matrix.at<double>(0, 1);
+        double fy = camera_matrix.at<double>(1, 1);
+        double cx = camera_matrix.at<double>(0, 2);
+        double cy = camera_matrix.at<double>(1, 2);
+        double k1 = dist_coeffs.at<double>(0, 0);
+        double k2 = dist_coeffs.at<double>(0, 1);
+        double p1 = dist_coeffs.at<double>(0, 2);
+        double p2 = dist_coeffs.at<double>(0, 3);
+        double k3 = dist_coeffs.at<double>(0, 4);
+
+        /* Pixel of the view -> canonical -> undistorted pixel -> normalized coordinates,
+         * composed in a single matrix M = K^-1 * H * S */
+        double s[9] = {1 / scale, 0, origin.x, 0, 1 / scale, origin.y, 0, 0, 1};
+        double k_inv[9] = {1 / fx, -skew / (fx * fy), (skew * cy - cx * fy) / (fx * fy),
+                           0, 1 / fy, -cy / fy,
+                           0, 0, 1
+                          };
+        double hs[9], m[9];
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                hs[r * 3 + c] = homography.at<double>(r, 0) * s[c] + homography.at<double>(r, 1) * s[3 + c] + homography.at<double>(r, 2) * s[6 + c];
+            }
+        }
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                m[r * 3 + c] = k_inv[r * 3] * hs[c] + k_inv[r * 3 + 1] * hs[3 + c] + k_inv[r * 3 + 2] * hs[6 + c];
+            }
+        }
+
+        map_x.create(size, CV_32FC1);
+        map_y.create(size, CV_32FC1);
+        for (int v = 0; v < size.height; v++) {
+            float *row_x = map_x.ptr<float>(v);
+            float *row_y = map_y.ptr<float>(v);
+            /* Along a row the homogeneous coordinates grow linearly */
+            double a0 = m[1] * v + m[2], b0 = m[4] * v + m[5], c0 = m[7] * v + m[8];
+            for (int u = 0; u < size.width; u++) {
+                double iz = 1 / (c0 + m[6] * u);
+                double x = (a0 + m[0] * u) * iz;
+                double y = (b0 + m[3] * u) * iz;
+                double r2 = x * x + y * y;
+                double radial = 1 + r2 * (k1 + r2 * (k2 + r2 * k3));
+                double xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+                double yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+                row_x[u] = (float)(fx * xd + skew * yd + cx);
+                row_y[u] = (float)(fy * yd + cy);
+            }
+        }
+    }
+
+    /**
+     * @details Render the view of a distorted frame with the maps of the last build
+     *
+     * @param frame Distorted frame
+     * @param view Output of size `size`, it can not be frame
+     * @param interpolation Interpolation of remap
+     */
+    void render(const Mat &frame, Mat &view, int interpolation = INTER_LINEAR) const {
+        remap(frame, view, map_x, map_y, interpolation, BORDER_CONSTANT);
+    }
+
+    /**
+     * @details Build the maps and render the view of a frame
+     *
+     * @param frame Distorted frame
+     * @param view Output of size `size`, it can not be frame
+     * @param homography Canonical coordinates to undistorted pixels
+     * @param camera_matrix Camera matrix
+     * @param dist_coeffs Distortion coefficients
+     */
+    void render(const Mat &frame, Mat &view, const Mat &homography, const Mat &camera_matrix, const Mat &dist_coeffs) {
+        PROFILE_SCOPE(PROFILE_UNDISTORT);
+        build(homography, camera_matrix, dist_coeffs);
+        render(frame, view);
+    }
+};
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cstring>
+#include "FrameStore.h"
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Decode a calibration video once into a frame store, the calibration programs
+ * read <video>.frames instead of decoding the video when the file exists.
+ *
+ * Usage: DecodeVideo <video> [--bgr] [output]
+ */
+int main( int argc, char** argv ) {
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <video> [--bgr] [output]" << endl;
+        return -1;
+    }
+    string video_path = argv[1];
+    int planes = FRAME_STORE_GRAY;
+    string output = frame_store_path(video_path);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--bgr") == 0) {
+            planes |= FRAME_STORE_BGR;
+        } else {
+            output = argv[i];
+        }
+    }
+
+    VideoCapture cap(video_path);
+    if ( !cap.isOpened() ) {
+        cout << "Cannot open the video file. \n";
+        return -1;
+    }
+    int count = write_frame_store(cap, output, planes);
+    if (count < 0) {
+        cout << "Cannot write " << output << endl;
+        return -1;
+    }
+
+    FrameStore store;
+    if (!store.open(output)) {
+        cout << "Cannot map " << output << endl;
+        return -1;
+    }
+    Size size = store.frame_size();
+    cout << output << ": " << count << " frames of " << size.width << "x" << size.height
+         << (store.has_bgr() ? " gray and BGR" : " gray") << endl;
+    return 0;
+}
@@ -0,0 +1,232 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+using namespace cv;
+using namespace std;
+
+#include "PatternPoint.h"
+
+/* Version of the file format, older files are discarded */
+#define DETECTION_CACHE_VERSION 1
+/* Directory of the cache files, one file per video content */
+#define DETECTION_CACHE_DIR "."
+
+/**
+ * @details FNV-1a hash of a block of bytes
+ *
+ * @param data Bytes
+ * @param size Number of bytes
+ * @param hash Hash of the previous blocks
+ * @return Hash including the block
+ */
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @details Hash of the content of a file, 0 if it can not be read
+ */
+uint64_t file_content_hash(const string &path) {
+    ifstream file(path.c_str(), ios::binary);
+    if (!file) {
+        return 0;
+    }
+    vector<char> block(1 << 20);
+    uint64_t hash = fnv1a(0, 0);
+    while (file) {
+        file.read(block.data(), block.size());
+        hash = fnv1a(block.data(), file.gcount(), hash);
+    }
+    return hash;
+}
+
+/**
+ * @details Pattern points of the frames of a video, saved to a binary file so the frame
+ * selection, the collection of points and the next runs do not detect a frame again.
+ * The file is named after the hash of the video content and stores the hash of the
+ * detector configuration, a file of another configuration is discarded. Frames where
+ * the pattern was not found are stored too, with no points.
+ *
+ * File: "DETC", version, video hash, config hash, number of frames, and for every
+ * frame its index, the number of points and x, y, radio of every point
+ */
+class DetectionCache {
+public:
+    int hits;                           // Lookups found in the cache
+    int misses;                         // Lookups not found in the cache
+
+    DetectionCache() : hits(0), misses(0), video_hash(0), config_hash(0), dirty(false) {}
+
+    /**
+     * @param video_path Video file, the cache is disabled if it can not be read (cameras)
+     * @param config Detector configuration, any change detects the frames again
+     */
+    DetectionCache(const string &video_path, const string &config) : hits(0), misses(0), dirty(false) {
+        open(video_path, config);
+    }
+
+    ~DetectionCache() {
+        save();
+    }
+
+    /**
+     * @details Load the cache of a video, the frames of the previous video are saved first
+     *
+     * @param video_path Video file, the cache is disabled if it can not be read (cameras)
+     * @param config Detector configuration, any change detects the frames again
+     * @return true if a cache file of the video and the configuration was loaded
+     */
+    bool open(const string &video_path, const string &config) {
+        save();
+        frames.clear();
+        video_hash = file_content_hash(video_path);
+        config_hash = fnv1a(config.data(), config.size());
+        path.clear();
+        if (video_hash == 0) {
+            return false;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "/detections_%016llx.bin", (unsigned long long)video_hash);
+        path = string(DETECTION_CACHE_DIR) + name;
+        return load();
+    }
+
+    /**
+     * @details False if the video could not be hashed, nothing is cached
+     */
+    bool enabled() const {
+        return !path.empty();
+    }
+
+    /**
+     * @details Points of a frame detected before
+     *
+     * @param frame Position of the frame in the video
+     * @param points Points of the frame, empty if the pattern was not found
+     * @return false if the frame was never detected
+     */
+    bool lookup(int frame, vector<PatternPoint> &points) {
+        map<int, vector<PatternPoint> >::const_iterator it = frames.find(frame);
+        if (it == frames.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        points = it->second;
+        return true;
+    }
+
+    /**
+     * @details Save the points of a frame
+     *
+     * @param frame Position of the frame in the video
+     * @param points Points found, empty if the pattern was not found
+     */
+    void store(int frame, const vector<PatternPoint> &points) {
+        if (!enabled()) {
+            return;
+        }
+        frames[frame] = points;
+        dirty = true;
+    }
+
+    /**
+     * @details Write the file if frames were stored since the last save
+     *
+     * @return false if the file could not be written
+     */
+    bool save() {
+        if (!dirty || !enabled()) {
+            return true;
+        }
+        /* Written aside and renamed, an interrupted run never leaves a broken file */
+        string temp_path = path + ".tmp";
+        ofstream file(temp_path.c_str(), ios::binary);
+        if (!file) {
+            return false;
+        }
+        uint32_t version = DETECTION_CACHE_VERSION;
+        uint32_t count = frames.size();
+        file.write("DETC", 4);
+        write(file, version);
+        write(file, video_hash);
+        write(file, config_hash);
+        write(file, count);
+        for (map<int, vector<PatternPoint> >::const_iterator it = frames.begin(); it != frames.end(); ++it) {
+            int32_t frame = it->first;
+            uint16_t n_points = it->second.size();
+            write(file, frame);
+            write(file, n_points);
+            for (int p = 0; p < n_points; p++) {
+                const PatternPoint &point = it->second[p];
+                float values[3] = {point.x, point.y, point.radio};
+                file.write((const char *)values, sizeof(values));
+            }
+        }
+        file.close();
+        if (!file || rename(temp_path.c_str(), path.c_str()) != 0) {
+            remove(temp_path.c_str());
+            return false;
+        }
+        dirty = false;
+        return true;
+    }
+
+private:
+    string path;                        // Cache file, empty if disabled
+    uint64_t video_hash;
+    uint64_t config_hash;
+    map<int, vector<PatternPoint> > frames;
+    bool dirty;                         // Frames stored and not saved
+
+    template<typename T>
+    static void write(ofstream &file, const T &value) {
+        file.write((const char *)&value, sizeof(T));
+    }
+
+    template<typename T>
+    static bool read(ifstream &file, T &value) {
+        return (bool)file.read((char *)&value, sizeof(T));
+    }
+
+    bool load() {
+        ifstream file(path.c_str(), ios::binary);
+        char magic[4];
+        uint32_t version, count;
+        uint64_t file_video_hash, file_config_hash;
+        if (!file.read(magic, 4) || string(magic, 4) != "DETC" || !read(file, version) || version != DETECTION_CACHE_VERSION ||
+                !read(file, file_video_hash) || !read(file, file_config_hash) || !read(file, count) ||
+                file_video_hash != video_hash || file_config_hash != config_hash) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t frame;
+            uint16_t n_points;
+            if (!read(file, frame) || !read(file, n_points)) {
+                frames.clear();
+                return false;
+            }
+            vector<PatternPoint> &points = frames[frame];
+            points.resize(n_points);
+            for (int p = 0; p < n_points; p++) {
+                float values[3];
+                if (!file.read((char *)values, sizeof(values))) {
+                    frames.clear();
+                    return false;
+                }
+                points[p] = PatternPoint(values[0], values[1], values[2], -1);
+            }
+        }
+        return true;
+    }
+};
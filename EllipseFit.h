@@ -0,0 +1,413 @@
+#pragma once
+#include "opencv2/imgproc/imgproc.hpp"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+/* Ellipses with the minor axis shorter than this fraction of the major axis are rejected */
+#define ELLIPSE_MIN_AXIS_RATIO 0.1
+
+/**
+ * @details Contours to fit in one call, the points of all of them are stored one after
+ * another in a flat buffer. Reused between frames
+ */
+struct EllipseBatch {
+    vector<Point> points;               // Points of every contour, one after another
+    vector<int> offsets;                // Contour i uses points [offsets[i], offsets[i + 1])
+    vector<RotatedRect> ellipses;       // Ellipse of every contour
+    vector<char> valid;                 // 0 when the contour is not an ellipse
+
+    void clear() {
+        points.clear();
+        offsets.assign(1, 0);
+        ellipses.clear();
+        valid.clear();
+    }
+
+    /**
+     * @details Add a contour to the batch
+     *
+     * @param contour Contour points
+     */
+    void add(const vector<Point> &contour) {
+        points.insert(points.end(), contour.begin(), contour.end());
+        offsets.push_back(points.size());
+    }
+
+    int size() const {
+        return offsets.size() - 1;
+    }
+};
+
+/**
+ * @details Scatter moments of the conic design matrix, sums of u^i v^j with i + j <= 4
+ * over the normalized points
+ */
+struct ConicMoments {
+    double xxxx, xxxy, xxyy, xyyy, yyyy;
+    double xxx, xxy, xyy, yyy;
+    double xx, xy, yy;
+    double x, y, n;
+};
+
+#if defined(__AVX2__)
+static inline double horizontal_sum(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+#elif defined(__SSE4_1__)
+static inline double horizontal_sum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+#endif
+
+/**
+ * @details Accumulate the conic moments of a contour, the points are moved to
+ * (p - center) * scale before the products to keep the sums well conditioned
+ *
+ * @param points Contour points
+ * @param n Number of points
+ * @param cx Center x
+ * @param cy Center y
+ * @param scale Scale factor
+ * @param m Moments output
+ */
+void conic_moments(const Point *points, int n, double cx, double cy, double scale, ConicMoments &m) {
+    memset(&m, 0, sizeof(m));
+    const int *xy = (const int *)points;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i v_split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256d v_cx = _mm256_set1_pd(cx);
+    const __m256d v_cy = _mm256_set1_pd(cy);
+    const __m256d v_scale = _mm256_set1_pd(scale);
+    __m256d xxxx = _mm256_setzero_pd(), xxxy = _mm256_setzero_pd(), xxyy = _mm256_setzero_pd();
+    __m256d xyyy = _mm256_setzero_pd(), yyyy = _mm256_setzero_pd();
+    __m256d xxx = _mm256_setzero_pd(), xxy = _mm256_setzero_pd(), xyy = _mm256_setzero_pd(), yyy = _mm256_setzero_pd();
+    __m256d xx = _mm256_setzero_pd(), xy2 = _mm256_setzero_pd(), yy = _mm256_setzero_pd();
+    __m256d sx = _mm256_setzero_pd(), sy = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256i p = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(xy + 2 * i)), v_split);
+        __m256d u = _mm256_mul_pd(_mm256_sub_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(p)), v_cx), v_scale);
+        __m256d v = _mm256_mul_pd(_mm256_sub_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(p, 1)), v_cy), v_scale);
+        __m256d uu = _mm256_mul_pd(u, u);
+        __m256d uv = _mm256_mul_pd(u, v);
+        __m256d vv = _mm256_mul_pd(v, v);
+        xxxx = _mm256_add_pd(xxxx, _mm256_mul_pd(uu, uu));
+        xxxy = _mm256_add_pd(xxxy, _mm256_mul_pd(uu, uv));
+        xxyy = _mm256_add_pd(xxyy, _mm256_mul_pd(uu, vv));
+        xyyy = _mm256_add_pd(xyyy, _mm256_mul_pd(uv, vv));
+        yyyy = _mm256_add_pd(yyyy, _mm256_mul_pd(vv, vv));
+        xxx = _mm256_add_pd(xxx, _mm256_mul_pd(uu, u));
+        xxy = _mm256_add_pd(xxy, _mm256_mul_pd(uu, v));
+        xyy = _mm256_add_pd(xyy, _mm256_mul_pd(u, vv));
+        yyy = _mm256_add_pd(yyy, _mm256_mul_pd(vv, v));
+        xx = _mm256_add_pd(xx, uu);
+        xy2 = _mm256_add_pd(xy2, uv);
+        yy = _mm256_add_pd(yy, vv);
+        sx = _mm256_add_pd(sx, u);
+        sy = _mm256_add_pd(sy, v);
+    }
+#elif defined(__SSE4_1__)
+    const __m128d v_cx = _mm_set1_pd(cx);
+    const __m128d v_cy = _mm_set1_pd(cy);
+    const __m128d v_scale = _mm_set1_pd(scale);
+    __m128d xxxx = _mm_setzero_pd(), xxxy = _mm_setzero_pd(), xxyy = _mm_setzero_pd();
+    __m128d xyyy = _mm_setzero_pd(), yyyy = _mm_setzero_pd();
+    __m128d xxx = _mm_setzero_pd(), xxy = _mm_setzero_pd(), xyy = _mm_setzero_pd(), yyy = _mm_setzero_pd();
+    __m128d xx = _mm_setzero_pd(), xy2 = _mm_setzero_pd(), yy = _mm_setzero_pd();
+    __m128d sx = _mm_setzero_pd(), sy = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+        __m128i p = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(xy + 2 * i)), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128d u = _mm_mul_pd(_mm_sub_pd(_mm_cvtepi32_pd(p), v_cx), v_scale);
+        __m128d v = _mm_mul_pd(_mm_sub_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(p, p)), v_cy), v_scale);
+        __m128d uu = _mm_mul_pd(u, u);
+        __m128d uv = _mm_mul_pd(u, v);
+        __m128d vv = _mm_mul_pd(v, v);
+        xxxx = _mm_add_pd(xxxx, _mm_mul_pd(uu, uu));
+        xxxy = _mm_add_pd(xxxy, _mm_mul_pd(uu, uv));
+        xxyy = _mm_add_pd(xxyy, _mm_mul_pd(uu, vv));
+        xyyy = _mm_add_pd(xyyy, _mm_mul_pd(uv, vv));
+        yyyy = _mm_add_pd(yyyy, _mm_mul_pd(vv, vv));
+        xxx = _mm_add_pd(xxx, _mm_mul_pd(uu, u));
+        xxy = _mm_add_pd(xxy, _mm_mul_pd(uu, v));
+        xyy = _mm_add_pd(xyy, _mm_mul_pd(u, vv));
+        yyy = _mm_add_pd(yyy, _mm_mul_pd(vv, v));
+        xx = _mm_add_pd(xx, uu);
+        xy2 = _mm_add_pd(xy2, uv);
+        yy = _mm_add_pd(yy, vv);
+        sx = _mm_add_pd(sx, u);
+        sy = _mm_add_pd(sy, v);
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+    m.xxxx = horizontal_sum(xxxx);
+    m.xxxy = horizontal_sum(xxxy);
+    m.xxyy = horizontal_sum(xxyy);
+    m.xyyy = horizontal_sum(xyyy);
+    m.yyyy = horizontal_sum(yyyy);
+    m.xxx = horizontal_sum(xxx);
+    m.xxy = horizontal_sum(xxy);
+    m.xyy = horizontal_sum(xyy);
+    m.yyy = horizontal_sum(yyy);
+    m.xx = horizontal_sum(xx);
+    m.xy = horizontal_sum(xy2);
+    m.yy = horizontal_sum(yy);
+    m.x = horizontal_sum(sx);
+    m.y = horizontal_sum(sy);
+#endif
+    for (; i < n; i++) {
+        double u = (points[i].x - cx) * scale;
+        double v = (points[i].y - cy) * scale;
+        double uu = u * u, uv = u * v, vv = v * v;
+        m.xxxx += uu * uu;
+        m.xxxy += uu * uv;
+        m.xxyy += uu * vv;
+        m.xyyy += uv * vv;
+        m.yyyy += vv * vv;
+        m.xxx += uu * u;
+        m.xxy += uu * v;
+        m.xyy += u * vv;
+        m.yyy += vv * v;
+        m.xx += uu;
+        m.xy += uv;
+        m.yy += vv;
+        m.x += u;
+        m.y += v;
+    }
+    m.n = n;
+}
+
+/**
+ * @details Inverse of a 3x3 matrix
+ *
+ * @return false if the matrix is singular
+ */
+bool invert_3x3(const double a[3][3], double inv[3][3]) {
+    double c00 = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+    double c01 = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+    double c02 = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+    double det = a[0][0] * c00 + a[0][1] * c01 + a[0][2] * c02;
+    double norm = fabs(a[0][0]) + fabs(a[1][1]) + fabs(a[2][2]);
+    if (!(fabs(det) > 1e-12 * norm * norm * norm)) {
+        return false;
+    }
+    double d = 1.0 / det;
+    inv[0][0] = c00 * d;
+    inv[1][0] = c01 * d;
+    inv[2][0] = c02 * d;
+    inv[0][1] = (a[0][2] * a[2][1] - a[0][1] * a[2][2]) * d;
+    inv[1][1] = (a[0][0] * a[2][2] - a[0][2] * a[2][0]) * d;
+    inv[2][1] = (a[0][1] * a[2][0] - a[0][0] * a[2][1]) * d;
+    inv[0][2] = (a[0][1] * a[1][2] - a[0][2] * a[1][1]) * d;
+    inv[1][2] = (a[0][2] * a[1][0] - a[0][0] * a[1][2]) * d;
+    inv[2][2] = (a[0][0] * a[1][1] - a[0][1] * a[1][0]) * d;
+    return true;
+}
+
+/**
+ * @details Real roots of x^3 + b x^2 + c x + d
+ *
+ * @param roots Output roots
+ * @return Number of real roots
+ */
+int cubic_roots(double b, double c, double d, double roots[3]) {
+    double p = c - b * b / 3;
+    double q = 2 * b * b * b / 27 - b * c / 3 + d;
+    double shift = -b / 3;
+    double disc = q * q / 4 + p * p * p / 27;
+    if (disc > 0) {
+        double s = sqrt(disc);
+        roots[0] = cbrt(-q / 2 + s) + cbrt(-q / 2 - s) + shift;
+        return 1;
+    }
+    if (p == 0) {
+        roots[0] = shift;
+        return 1;
+    }
+    double r = 2 * sqrt(-p / 3);
+    double phi = acos(max(-1.0, min(1.0, 3 * q / (p * r))));
+    for (int k = 0; k < 3; k++) {
+        roots[k] = r * cos((phi - 2 * CV_PI * k) / 3) + shift;
+    }
+    return 3;
+}
+
+/**
+ * @details Direct least squares ellipse fit (Fitzgibbon, numerically stable version of
+ * Halir and Flusser), the conic is solved in closed form from the moments of the contour.
+ * Contours that are not ellipses are rejected by the conic discriminant and by the
+ * ratio of the axes
+ *
+ * @param points Contour points
+ * @param n Number of points, at least 5
+ * @param ellipse Ellipse output with the same convention as fitEllipse (full axes, degrees)
+ * @return true if the contour is an ellipse
+ */
+bool fit_ellipse_direct(const Point *points, int n, RotatedRect &ellipse) {
+    if (n < 5) {
+        return false;
+    }
+    int min_x = points[0].x, max_x = min_x, min_y = points[0].y, max_y = min_y;
+    for (int i = 1; i < n; i++) {
+        min_x = min(min_x, points[i].x);
+        max_x = max(max_x, points[i].x);
+        min_y = min(min_y, points[i].y);
+        max_y = max(max_y, points[i].y);
+    }
+    if (max_x == min_x || max_y == min_y) {
+        return false;
+    }
+    double cx = (min_x + max_x) * 0.5;
+    double cy = (min_y + max_y) * 0.5;
+    double scale = 2.0 / max(max_x - min_x, max_y - min_y);
+
+    ConicMoments m;
+    conic_moments(points, n, cx, cy, scale, m);
+
+    /* Quadratic part D1 = [u^2 uv v^2] and linear part D2 = [u v 1] of the design matrix */
+    double s1[3][3] = {{m.xxxx, m.xxxy, m.xxyy}, {m.xxxy, m.xxyy, m.xyyy}, {m.xxyy, m.xyyy, m.yyyy}};
+    double s2[3][3] = {{m.xxx, m.xxy, m.xx}, {m.xxy, m.xyy, m.xy}, {m.xyy, m.yyy, m.yy}};
+    double s3[3][3] = {{m.xx, m.xy, m.x}, {m.xy, m.yy, m.y}, {m.x, m.y, m.n}};
+    double s3_inv[3][3];
+    if (!invert_3x3(s3, s3_inv)) {
+        return false;
+    }
+
+    /* T = -S3^-1 S2^T, the linear coefficients are T times the quadratic ones */
+    double t[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            t[r][c] = -(s3_inv[r][0] * s2[c][0] + s3_inv[r][1] * s2[c][1] + s3_inv[r][2] * s2[c][2]);
+        }
+    }
+    /* Reduced scatter matrix M = S1 + S2 T premultiplied by the inverse of the constraint */
+    double reduced[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            reduced[r][c] = s1[r][c] + s2[r][0] * t[0][c] + s2[r][1] * t[1][c] + s2[r][2] * t[2][c];
+        }
+    }
+    double mat[3][3];
+    for (int c = 0; c < 3; c++) {
+        mat[0][c] = reduced[2][c] / 2;
+        mat[1][c] = -reduced[1][c];
+        mat[2][c] = reduced[0][c] / 2;
+    }
+
+    /* The ellipse is the eigenvector with 4ac - b^2 > 0 */
+    double trace = mat[0][0] + mat[1][1] + mat[2][2];
+    double minors = mat[0][0] * mat[1][1] - mat[0][1] * mat[1][0] +
+                    mat[0][0] * mat[2][2] - mat[0][2] * mat[2][0] +
+                    mat[1][1] * mat[2][2] - mat[1][2] * mat[2][1];
+    double det = mat[0][0] * (mat[1][1] * mat[2][2] - mat[1][2] * mat[2][1]) -
+                 mat[0][1] * (mat[1][0] * mat[2][2] - mat[1][2] * mat[2][0]) +
+                 mat[0][2] * (mat[1][0] * mat[2][1] - mat[1][1] * mat[2][0]);
+    double roots[3];
+    int n_roots = cubic_roots(-trace, minors, -det, roots);
+    double best[3] = {0, 0, 0};
+    double best_condition = 0;
+    for (int k = 0; k < n_roots; k++) {
+        double a[3][3];
+        memcpy(a, mat, sizeof(a));
+        for (int d = 0; d < 3; d++) {
+            a[d][d] -= roots[k];
+        }
+        /* The eigenvector is orthogonal to the rows of M - lambda I, take the best cross product */
+        double vec[3] = {0, 0, 0};
+        double vec_norm = 0;
+        for (int r = 0; r < 3; r++) {
+            const double *p = a[r];
+            const double *q = a[(r + 1) % 3];
+            double cross[3] = {p[1] * q[2] - p[2] * q[1], p[2] * q[0] - p[0] * q[2], p[0] * q[1] - p[1] * q[0]};
+            double cross_norm = cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2];
+            if (cross_norm > vec_norm) {
+                vec_norm = cross_norm;
+                memcpy(vec, cross, sizeof(vec));
+            }
+        }
+        if (vec_norm == 0) {
+            continue;
+        }
+        double condition = (4 * vec[0] * vec[2] - vec[1] * vec[1]) / vec_norm;
+        if (condition > best_condition) {
+            best_condition = condition;
+            memcpy(best, vec, sizeof(best));
+        }
+    }
+    if (best_condition <= 0) {
+        return false;
+    }
+
+    /* The sign of the eigenvector is arbitrary, take a + c > 0 */
+    if (best[0] + best[2] < 0) {
+        for (int d = 0; d < 3; d++) {
+            best[d] = -best[d];
+        }
+    }
+    double A = best[0], B = best[1], C = best[2];
+    double D = t[0][0] * A + t[0][1] * B + t[0][2] * C;
+    double E = t[1][0] * A + t[1][1] * B + t[1][2] * C;
+    double F = t[2][0] * A + t[2][1] * B + t[2][2] * C;
+
+    /* Conic discriminant, it has to be negative for an ellipse */
+    double disc = B * B - 4 * A * C;
+    if (!(disc < 0)) {
+        return false;
+    }
+    double u0 = (2 * C * D - B * E) / disc;
+    double v0 = (2 * A * E - B * D) / disc;
+    double num = 2 * (A * E * E + C * D * D - B * D * E + disc * F);
+    double root = sqrt((A - C) * (A - C) + B * B);
+    double major2 = num * (A + C + root);
+    double minor2 = num * (A + C - root);
+    if (!(major2 > 0 && minor2 > 0)) {
+        return false;
+    }
+    double major = sqrt(major2) / -disc;
+    double minor = sqrt(minor2) / -disc;
+    if (!(minor >= major * ELLIPSE_MIN_AXIS_RATIO)) {
+        return false;
+    }
+    double angle;
+    if (B != 0) {
+        angle = atan2(C - A - root, B);
+    } else {
+        angle = A < C ? 0 : CV_PI / 2;
+    }
+
+    ellipse.center = Point2f(u0 / scale + cx, v0 / scale + cy);
+    ellipse.size = Size2f(2 * major / scale, 2 * minor / scale);
+    ellipse.angle = angle * 180 / CV_PI;
+    if (ellipse.angle < 0) {
+        ellipse.angle += 180;
+    }
+    return true;
+}
+
+/**
+ * @details Fit an ellipse to every contour of the batch in one call
+ *
+ * @param batch Contours to fit, the ellipses and the valid flags are written in it
+ * @return Number of contours accepted as ellipses
+ */
+int fit_ellipses(EllipseBatch &batch) {
+    int n = batch.size();
+    batch.ellipses.resize(n);
+    batch.valid.resize(n);
+    int accepted = 0;
+    for (int e = 0; e < n; e++) {
+        int start = batch.offsets[e];
+        batch.valid[e] = fit_ellipse_direct(&batch.points[start], batch.offsets[e + 1] - start, batch.ellipses[e]);
+        accepted += batch.valid[e];
+    }
+    return accepted;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <vector>
+#include "opencv2/highgui/highgui.hpp"
+#include "Profiler.h"
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Decode a list of frames in one forward pass over the video. Seeking to every
+ * frame decodes again from the previous keyframe with inter-frame codecs, so the
+ * positions are sorted, the frames in between are skipped with grab() (no color
+ * conversion) and only the wanted frames are retrieved
+ *
+ * @param cap Opened capture, it is rewound to the first frame
+ * @param frames Positions of the wanted frames, in any order, repeated positions allowed
+ * @param deliver Called with the index in frames and the frame, in the order of the
+ * positions. Every frame has its own buffer
+ * @return Number of frames delivered, less than frames.size() if the video ends before
+ */
+int fetch_frames(VideoCapture &cap, const vector<int> &frames, const function<void(int, Mat &)> &deliver) {
+    vector<int> order(frames.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&frames](int a, int b) {
+        return frames[a] < frames[b];
+    });
+
+    cap.set(CAP_PROP_POS_FRAMES, 0);
+    int position = 0;                   // Position of the next frame of cap
+    int delivered = 0;
+    Mat last;                           // Last frame delivered
+    for (int i = 0; i < order.size(); i++) {
+        int wanted = frames[order[i]];
+        if (wanted < 0) {
+            continue;
+        }
+        if (wanted == position - 1 && !last.empty()) {
+            /* Repeated position */
+            Mat copy = last.clone();
+            deliver(order[i], copy);
+            delivered++;
+            continue;
+        }
+        Mat frame;                      // Own buffer, the caller keeps it
+        bool ok = true;
+        {
+            PROFILE_SCOPE(PROFILE_DECODE);
+            while (ok && position < wanted) {
+                ok = cap.grab();
+                position++;
+            }
+            ok = ok && cap.read(frame);
+        }
+        if (!ok) {
+            break;
+        }
+        position++;
+        last = frame;
+        deliver(order[i], frame);
+        delivered++;
+    }
+    return delivered;
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include "opencv2/highgui/highgui.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "Profiler.h"
+
+using namespace cv;
+using namespace std;
+
+/* Every frame is delivered, the decoder waits when the ring is full (videos) */
+#define FRAME_QUEUE_BLOCK  0
+/* Only the newest frame is delivered, the decoder never waits (live cameras) */
+#define FRAME_QUEUE_LATEST 1
+
+/**
+ * @details Decode a VideoCapture in its own thread into a bounded ring of frame buffers,
+ * so the decode of the next frames overlaps the detection of the current one. The
+ * buffers are recycled: read() swaps the decoded frame with the frame it receives, and
+ * the decoder writes the next frame over the old buffer. Buffers that are still shared
+ * with other Mats when they come back are released instead of overwritten.
+ * The capture must not be used by the caller while the queue is alive
+ */
+class FrameQueue {
+public:
+    /**
+     * @param cap Opened capture, read from its current position
+     * @param capacity Number of frame buffers of the ring
+     * @param policy FRAME_QUEUE_BLOCK or FRAME_QUEUE_LATEST
+     */
+    FrameQueue(VideoCapture &cap, int capacity = 4, int policy = FRAME_QUEUE_BLOCK) : cap(cap), slots(max(1, capacity)) {
+        this->policy = policy;
+        dropped = 0;
+        delivered = 0;
+        head = 0;
+        count = 0;
+        finished = false;
+        stopping = false;
+        producer = thread(&FrameQueue::decode_loop, this);
+    }
+
+    ~FrameQueue() {
+        stop();
+    }
+
+    /**
+     * @details Stop the decoder, the frames in the ring are discarded
+     */
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        space.notify_all();
+        if (producer.joinable()) {
+            producer.join();
+        }
+    }
+
+    /**
+     * @details Next frame, waits for the decoder if the ring is empty. With
+     * FRAME_QUEUE_LATEST the older frames in the ring are dropped
+     *
+     * @param frame Frame output, its previous buffer goes back to the ring
+     * @return false at the end of the video
+     */
+    bool read(Mat &frame) {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [this] { return count > 0 || finished; });
+        if (count == 0) {
+            return false;
+        }
+        if (policy == FRAME_QUEUE_LATEST && count > 1) {
+            dropped += count - 1;
+            head = (head + count - 1) % slots.size();
+            count = 1;
+        }
+        Mat &slot = slots[head];
+        swap(frame, slot);
+        if (slot.u && slot.u->refcount > 1) {
+            slot.release();
+        }
+        head = (head + 1) % slots.size();
+        count--;
+        delivered++;
+        guard.unlock();
+        space.notify_one();
+        return true;
+    }
+
+    /**
+     * @details Frames decoded and never delivered (FRAME_QUEUE_LATEST)
+     */
+    int dropped_frames() {
+        lock_guard<mutex> guard(lock);
+        return dropped;
+    }
+
+    /**
+     * @details Frames returned by read, skipped frames included
+     */
+    int delivered_frames() {
+        lock_guard<mutex> guard(lock);
+        return delivered;
+    }
+
+    /**
+     * @details Discard the next frames, in order
+     *
+     * @param n Number of frames
+     * @return false if the video ended before
+     */
+    bool skip(int n) {
+        for (int i = 0; i < n; i++) {
+            if (!read(skipped)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    VideoCapture &cap;
+    vector<Mat> slots;                  // Ring of frame buffers
+    Mat skipped;                        // Buffer of skip, recycled as the others
+    int policy;
+    int dropped;
+    int delivered;
+    int head;                           // Oldest decoded frame
+    int count;                          // Decoded frames not delivered yet
+    bool finished;                      // The video ended or the decoder failed
+    bool stopping;
+    mutex lock;
+    condition_variable ready;           // A frame was decoded or the video ended
+    condition_variable space;           // A slot was freed or the queue is stopping
+    thread producer;
+
+    void decode_loop() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            if (count == (int)slots.size()) {
+                if (policy == FRAME_QUEUE_BLOCK) {
+                    space.wait(guard, [this] { return count < (int)slots.size() || stopping; });
+                    continue;
+                }
+                head = (head + 1) % slots.size();
+                count--;
+                dropped++;
+            }
+            /* The slot after the decoded frames is not touched by read while it is decoded */
+            Mat &slot = slots[(head + count) % slots.size()];
+            guard.unlock();
+            bool ok;
+            try {
+                PROFILE_SCOPE(PROFILE_DECODE);
+                ok = cap.read(slot);
+            } catch (...) {
+                ok = false;
+            }
+            guard.lock();
+            if (!ok) {
+                break;
+            }
+            count++;
+            ready.notify_one();
+        }
+        finished = true;
+        ready.notify_all();
+    }
+};
@@ -0,0 +1,298 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "Profiler.h"
+
+using namespace cv;
+using namespace std;
+
+/* Version of the file format */
+#define FRAME_STORE_VERSION 1
+/* Planes of every frame */
+#define FRAME_STORE_GRAY 1
+#define FRAME_STORE_BGR  2
+/* Alignment of the rows and the frames, enough for the SIMD loads */
+#define FRAME_STORE_ALIGN 64
+/* The frames start after the header, in their own page */
+#define FRAME_STORE_DATA_OFFSET 4096
+
+/**
+ * @details Header of a frame store file. The frames follow at FRAME_STORE_DATA_OFFSET,
+ * every frame is the gray plane and, if stored, the BGR plane, frame_stride bytes apart.
+ * The frame index is at index_offset: the position of every frame in milliseconds
+ */
+struct FrameStoreHeader {
+    char magic[4];                      // "FRMS"
+    uint32_t version;
+    uint32_t planes;                    // FRAME_STORE_GRAY, plus FRAME_STORE_BGR
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t count;                     // Number of frames
+    uint32_t gray_step;                 // Bytes of a row of the gray plane
+    uint32_t bgr_step;                  // Bytes of a row of the BGR plane, 0 without it
+    uint64_t frame_stride;              // Bytes between two frames
+    uint64_t index_offset;              // Position of the frame index in the file
+    double fps;
+};
+
+/**
+ * @details Round up to a multiple of FRAME_STORE_ALIGN
+ */
+uint64_t frame_store_align(uint64_t size) {
+    return (size + FRAME_STORE_ALIGN - 1) / FRAME_STORE_ALIGN * FRAME_STORE_ALIGN;
+}
+
+/**
+ * @details Store file of a video, next to it
+ */
+string frame_store_path(const string &video_path) {
+    return video_path + ".frames";
+}
+
+/**
+ * @details Decode a video once into a frame store file, the frames can be read later
+ * from a memory map without decoding them again
+ *
+ * @param cap Opened capture, decoded from its current position to the end
+ * @param path Store file
+ * @param planes FRAME_STORE_GRAY, or FRAME_STORE_GRAY | FRAME_STORE_BGR to keep the color
+ * @return Number of frames stored, -1 if the file could not be written
+ */
+int write_frame_store(VideoCapture &cap, const string &path, int planes) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return -1;
+    }
+    FrameStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "FRMS", 4);
+    header.version = FRAME_STORE_VERSION;
+    header.planes = planes | FRAME_STORE_GRAY;
+    header.fps = cap.get(CAP_PROP_FPS);
+
+    vector<double> positions;
+    vector<char> record;
+    Mat frame;
+    bool ok = fseek(file, FRAME_STORE_DATA_OFFSET, SEEK_SET) == 0;
+    while (ok && cap.read(frame)) {
+        if (header.count == 0) {
+            header.rows = frame.rows;
+            header.cols = frame.cols;
+            header.gray_step = frame_store_align(frame.cols);
+            header.bgr_step = (header.planes & FRAME_STORE_BGR) ? frame_store_align(frame.cols * 3) : 0;
+            header.frame_stride = frame_store_align((uint64_t)header.rows * (header.gray_step + header.bgr_step));
+            record.assign(header.frame_stride, 0);
+        } else if (frame.rows != (int)header.rows || frame.cols != (int)header.cols) {
+            break;
+        }
+        /* The planes are written through Mat headers over the record, with the steps of the file */
+        Mat gray_plane(header.rows, header.cols, CV_8UC1, record.data(), header.gray_step);
+        if (frame.channels() == 1) {
+            frame.copyTo(gray_plane);
+        } else {
+            cvtColor(frame, gray_plane, CV_BGR2GRAY);
+        }
+        if (header.planes & FRAME_STORE_BGR) {
+            Mat bgr_plane(header.rows, header.cols, CV_8UC3, record.data() + (size_t)header.rows * header.gray_step, header.bgr_step);
+            if (frame.channels() == 1) {
+                cvtColor(frame, bgr_plane, CV_GRAY2BGR);
+            } else {
+                frame.copyTo(bgr_plane);
+            }
+        }
+        ok = fwrite(record.data(), 1, record.size(), file) == record.size();
+        positions.push_back(cap.get(CAP_PROP_POS_MSEC));
+        header.count++;
+    }
+    header.index_offset = FRAME_STORE_DATA_OFFSET + header.count * header.frame_stride;
+    ok = ok && fwrite(positions.data(), sizeof(double), positions.size(), file) == positions.size();
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        remove(path.c_str());
+        return -1;
+    }
+    return header.count;
+}
+
+/**
+ * @details Frames decoded by write_frame_store, read from a read only memory map. Any
+ * frame is reached in O(1) and the Mats returned are views of the map, nothing is copied
+ * or decoded. The views can not be written, use read() for frames that are drawn
+ */
+class FrameStore {
+public:
+    FrameStore() : data(0), length(0) {
+        memset(&header, 0, sizeof(header));
+    }
+
+    ~FrameStore() {
+        close();
+    }
+
+    /* The map is owned by one store */
+    FrameStore(const FrameStore &) = delete;
+    FrameStore &operator=(const FrameStore &) = delete;
+
+    /**
+     * @details Map a store file
+     *
+     * @param path Store file
+     * @return false if the file does not exist or is not a frame store
+     */
+    bool open(const string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < FRAME_STORE_DATA_OFFSET) {
+            ::close(fd);
+            return false;
+        }
+        void *map = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        data = (const unsigned char *)map;
+        length = info.st_size;
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, "FRMS", 4) != 0 || header.version != FRAME_STORE_VERSION ||
+                FRAME_STORE_DATA_OFFSET + header.count * header.frame_stride > header.index_offset ||
+                header.index_offset + header.count * sizeof(double) > length) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (data) {
+            munmap((void *)data, length);
+        }
+        data = 0;
+        length = 0;
+        memset(&header, 0, sizeof(header));
+    }
+
+    bool is_open() const {
+        return data != 0;
+    }
+
+    /**
+     * @details Check that the store was decoded from the video of a capture, a store left
+     * from another video or an older version of it must not be read instead of the video
+     *
+     * @param cap Opened capture of the video
+     * @param size Size of the frames of the video
+     * @return false if the number of frames or their size is not the one of the video
+     */
+    bool matches(VideoCapture &cap, Size size) const {
+        int count = cap.get(CAP_PROP_FRAME_COUNT);
+        return is_open() && frame_size() == size && (count <= 0 || count == (int)header.count);
+    }
+
+    /**
+     * @details Number of frames
+     */
+    int size() const {
+        return header.count;
+    }
+
+    Size frame_size() const {
+        return Size(header.cols, header.rows);
+    }
+
+    bool has_bgr() const {
+        return (header.planes & FRAME_STORE_BGR) != 0;
+    }
+
+    double fps() const {
+        return header.fps;
+    }
+
+    /**
+     * @details True if the frame is in the store
+     */
+    bool contains(int i) const {
+        return i >= 0 && i < (int)header.count;
+    }
+
+    /**
+     * @details Position of a frame in the video in milliseconds, -1 if it is not in the store
+     */
+    double position(int i) const {
+        if (!contains(i)) {
+            return -1;
+        }
+        return ((const double *)(data + header.index_offset))[i];
+    }
+
+    /**
+     * @details Read only view of the gray plane of a frame, empty if it is not in the store
+     */
+    Mat gray(int i) const {
+        if (!contains(i)) {
+            return Mat();
+        }
+        return Mat(header.rows, header.cols, CV_8UC1, (void *)frame_data(i), header.gray_step);
+    }
+
+    /**
+     * @details Read only view of the BGR plane of a frame, empty if the color was not stored
+     * or the frame is not in the store
+     */
+    Mat bgr(int i) const {
+        if (!has_bgr() || !contains(i)) {
+            return Mat();
+        }
+        return Mat(header.rows, header.cols, CV_8UC3, (void *)(frame_data(i) + (size_t)header.rows * header.gray_step), header.bgr_step);
+    }
+
+    /**
+     * @details Read only view of a frame, in color if it was stored, empty if it is not in the store
+     */
+    Mat view(int i) const {
+        return has_bgr() ? bgr(i) : gray(i);
+    }
+
+    /**
+     * @details Copy of a frame in color that can be written, the gray frames are converted
+     *
+     * @param i Frame
+     * @param frame Output, its buffer is reused
+     * @return false if the frame is not in the store, frame is left untouched
+     */
+    bool read(int i, Mat &frame) const {
+        if (!contains(i)) {
+            return false;
+        }
+        PROFILE_SCOPE(PROFILE_DECODE);
+        if (has_bgr()) {
+            bgr(i).copyTo(frame);
+        } else {
+            cvtColor(gray(i), frame, CV_GRAY2BGR);
+        }
+        return true;
+    }
+
+private:
+    FrameStoreHeader header;
+    const unsigned char *data;
+    size_t length;
+
+    const unsigned char *frame_data(int i) const {
+        return data + FRAME_STORE_DATA_OFFSET + (uint64_t)i * header.frame_stride;
+    }
+};
@@ -1,41 +1,65 @@
+#pragma once
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include <vector>
+#include <cstring>
+#include <stdint.h>
+#include "Profiler.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
 
 using namespace cv;
 using namespace std;
 
 /**
- * @details filter points outside from the mask
+ * @details filter points outside from the mask, each row is clipped against the mask
+ * quad and the spans outside are set to zero, works for any number of channels
  * 
- * @param imagen image input and output
- * @param width image width
- * @param height image height
- * @param mask_points rectangle points to build the mask
+ * @param imagen image input and output, its size bounds the rows and the spans
+ * @param mask_points rectangle points to build the mask (convex quad)
  */
-void clean_using_mask(Mat &imagen, int width, int height, Point mask_points[][4]) {
-    const Point* ppt[1] = { mask_points[0] };
-    int npt[] = { 4 };
-
-    Mat mask = Mat::zeros( imagen.size(), CV_8UC3 );
-
-    fillPoly( mask, ppt, npt, 1, Scalar( 255, 255, 255 ), 1 );
-
-    for (int w = 0; w < width; w++) {
-        for (int h = 0; h < height; h++) {
-            Vec3b& pixel = imagen.at<Vec3b>(w, h);
-            Vec3b& mask_value = mask.at<Vec3b>(w, h);
-            if(mask_value[2] != 255){
-                pixel[0] = 0;
-                pixel[1] = 0;
-                pixel[2] = 0;
+void clean_using_mask(Mat &imagen, Point mask_points[][4]) {
+    int rows = imagen.rows;
+    int cols = imagen.cols;
+    size_t pixel_size = imagen.elemSize();
+    const Point *quad = mask_points[0];
+
+    for (int y = 0; y < rows; y++) {
+        unsigned char *row = imagen.ptr<unsigned char>(y);
+        float x_left = cols;
+        float x_right = -1;
+        for (int e = 0; e < 4; e++) {
+            Point p0 = quad[e];
+            Point p1 = quad[(e + 1) % 4];
+            if (y < min(p0.y, p1.y) || y > max(p0.y, p1.y)) {
+                continue;
+            }
+            if (p0.y == p1.y) {
+                x_left = min(x_left, (float)min(p0.x, p1.x));
+                x_right = max(x_right, (float)max(p0.x, p1.x));
+            } else {
+                float x = p0.x + (y - p0.y) * (float)(p1.x - p0.x) / (p1.y - p0.y);
+                x_left = min(x_left, x);
+                x_right = max(x_right, x);
             }
         }
+        int first = max(0, (int)ceil(x_left));
+        int last = min(cols - 1, (int)floor(x_right));
+        if (first > last) {
+            memset(row, 0, cols * pixel_size);
+            continue;
+        }
+        memset(row, 0, first * pixel_size);
+        memset(row + (last + 1) * pixel_size, 0, (cols - 1 - last) * pixel_size);
     }
 }
 
 /**
- * @details Adaptative threshold segmentation complemented with opencv threshold for borders
+ * @details Adaptative threshold segmentation complemented with opencv threshold for borders,
+ * original per-row allocated version kept as reference for segmentar
  * 
  * @param in Image input in grayscale
  * @param out Image output in grayscale
@@ -43,7 +67,7 @@ void clean_using_mask(Mat &imagen, int width, int height, Point mask_points[][4]
  * @param w image width
  * @param h image height
  */
-void segmentar(Mat &in, Mat &out, Mat adapThresh, int w, int h ) {
+void segmentar_reference(Mat &in, Mat &out, Mat adapThresh, int w, int h ) {
 
     int **intImg = new int*[w];
     for (int i = 0; i < w; i++) {
@@ -95,4 +119,290 @@ void segmentar(Mat &in, Mat &out, Mat adapThresh, int w, int h ) {
         delete intImg[i];
     }
     delete intImg;
-}
\ No newline at end of file
+}
+
+/**
+ * @details Build a row-major summed-area table with a leading row and column of zeros,
+ * integral[(r + 1) * (cols + 1) + c + 1] holds the sum of in(0..r, 0..c)
+ *
+ * @param in Image input in grayscale
+ * @param integral Buffer reused between calls, only grows when the frame size grows
+ */
+void build_integral_image(const Mat &in, vector<uint32_t> &integral) {
+    int rows = in.rows;
+    int cols = in.cols;
+    size_t stride = cols + 1;
+    integral.resize((rows + 1) * stride);
+    memset(&integral[0], 0, stride * sizeof(uint32_t));
+    for (int r = 0; r < rows; r++) {
+        const unsigned char *src = in.ptr<unsigned char>(r);
+        const uint32_t *prev = &integral[r * stride];
+        uint32_t *cur = &integral[(r + 1) * stride];
+        uint32_t sum = 0;
+        cur[0] = 0;
+        for (int c = 0; c < cols; c++) {
+            sum += src[c];
+            cur[c + 1] = prev[c + 1] + sum;
+        }
+    }
+}
+
+/**
+ * @details Threshold the columns [j0, j1) of one row against the mean of its window,
+ * pixel * count <= sum * 85 / 100 is evaluated as pixel * count * 100 <= sum * 85
+ * which is exact for integers and lets the comparison run in unsigned 32 bits
+ *
+ * @param src Input row
+ * @param dst Output row, can be the same as src
+ * @param top Integral row above the window
+ * @param bottom Integral row at the bottom of the window
+ * @param j0 First column
+ * @param j1 Last column (exclusive)
+ * @param hs Half window size
+ * @param count100 Window area multiplied by 100
+ */
+void segmentar_row(const unsigned char *src, unsigned char *dst, const uint32_t *top, const uint32_t *bottom, int j0, int j1, int hs, uint32_t count100) {
+    int j = j0;
+#if defined(__AVX2__)
+    const __m256i v_count = _mm256_set1_epi32(count100);
+    const __m256i v_t = _mm256_set1_epi32(100 - 15);
+    const __m256i v_255 = _mm256_set1_epi32(255);
+    const __m256i v_pick = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (; j + 8 <= j1; j += 8) {
+        __m256i b_hi = _mm256_loadu_si256((const __m256i *)(bottom + j + hs + 1));
+        __m256i b_lo = _mm256_loadu_si256((const __m256i *)(bottom + j - hs));
+        __m256i t_hi = _mm256_loadu_si256((const __m256i *)(top + j + hs + 1));
+        __m256i t_lo = _mm256_loadu_si256((const __m256i *)(top + j - hs));
+        __m256i sum = _mm256_sub_epi32(_mm256_sub_epi32(b_hi, b_lo), _mm256_sub_epi32(t_hi, t_lo));
+        __m256i rhs = _mm256_mullo_epi32(sum, v_t);
+        __m256i pixel = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + j)));
+        __m256i lhs = _mm256_mullo_epi32(pixel, v_count);
+        __m256i le = _mm256_cmpeq_epi32(_mm256_min_epu32(lhs, rhs), lhs);
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_andnot_si256(le, v_255), v_pick);
+        __m128i packed = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+        _mm_storel_epi64((__m128i *)(dst + j), packed);
+    }
+#elif defined(__SSE4_1__)
+    const __m128i v_count = _mm_set1_epi32(count100);
+    const __m128i v_t = _mm_set1_epi32(100 - 15);
+    const __m128i v_255 = _mm_set1_epi32(255);
+    const __m128i v_pick = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (; j + 4 <= j1; j += 4) {
+        __m128i b_hi = _mm_loadu_si128((const __m128i *)(bottom + j + hs + 1));
+        __m128i b_lo = _mm_loadu_si128((const __m128i *)(bottom + j - hs));
+        __m128i t_hi = _mm_loadu_si128((const __m128i *)(top + j + hs + 1));
+        __m128i t_lo = _mm_loadu_si128((const __m128i *)(top + j - hs));
+        __m128i sum = _mm_sub_epi32(_mm_sub_epi32(b_hi, b_lo), _mm_sub_epi32(t_hi, t_lo));
+        __m128i rhs = _mm_mullo_epi32(sum, v_t);
+        int32_t four;
+        memcpy(&four, src + j, 4);
+        __m128i pixel = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(four));
+        __m128i lhs = _mm_mullo_epi32(pixel, v_count);
+        __m128i le = _mm_cmpeq_epi32(_mm_min_epu32(lhs, rhs), lhs);
+        four = _mm_cvtsi128_si32(_mm_shuffle_epi8(_mm_andnot_si128(le, v_255), v_pick));
+        memcpy(dst + j, &four, 4);
+    }
+#endif
+    for (; j < j1; j++) {
+        uint32_t sum = bottom[j + hs + 1] - bottom[j - hs] - top[j + hs + 1] + top[j - hs];
+        dst[j] = (src[j] * count100 <= sum * (100 - 15)) ? 0 : 255;
+    }
+}
+
+/**
+ * @details Same as segmentar_row with 64 bits products, for windows too big to fit in 32 bits
+ */
+void segmentar_row_64(const unsigned char *src, unsigned char *dst, const uint32_t *top, const uint32_t *bottom, int j0, int j1, int hs, uint64_t count100) {
+    for (int j = j0; j < j1; j++) {
+        uint32_t sum = bottom[j + hs + 1] - bottom[j - hs] - top[j + hs + 1] + top[j - hs];
+        dst[j] = (src[j] * count100 <= (uint64_t)sum * (100 - 15)) ? 0 : 255;
+    }
+}
+
+/**
+ * @details Adaptative threshold segmentation complemented with opencv threshold for borders,
+ * same output as segmentar_reference using a contiguous integral image and SIMD comparison
+ *
+ * @param in Image input in grayscale
+ * @param out Image output in grayscale, can be the same as in
+ * @param adapThresh Image segmented using opencv threshold
+ * @param w image width
+ * @param h image height
+ * @param integral Buffer for the integral image, reused between frames
+ */
+void segmentar(Mat &in, Mat &out, Mat adapThresh, int w, int h, vector<uint32_t> &integral) {
+    build_integral_image(in, integral);
+    out.create(in.size(), CV_8UC1);
+
+    int s = w / 8;
+    int t = 15;
+    int hs = s / 2;
+    uint64_t count = (uint64_t)(2 * hs) * (2 * hs);
+    uint64_t window = (uint64_t)(2 * hs + 1) * (2 * hs + 1);
+    bool fits_32 = 255 * count * 100 <= UINT32_MAX && 255 * window * (100 - t) <= UINT32_MAX;
+    size_t stride = h + 1;
+    int j0 = hs + 1;
+    int j1 = max(j0, h - hs);
+
+    for (int i = 0; i < w; i++) {
+        unsigned char *dst = out.ptr<unsigned char>(i);
+        const unsigned char *border = adapThresh.ptr<unsigned char>(i);
+        if (i - hs <= 0 || i + hs >= w || j0 >= j1) {
+            memcpy(dst, border, h);
+            continue;
+        }
+        const unsigned char *src = in.ptr<unsigned char>(i);
+        const uint32_t *top = &integral[(i - hs) * stride];
+        const uint32_t *bottom = &integral[(i + hs + 1) * stride];
+        memcpy(dst, border, j0);
+        if (fits_32) {
+            segmentar_row(src, dst, top, bottom, j0, j1, hs, count * 100);
+        } else {
+            segmentar_row_64(src, dst, top, bottom, j0, j1, hs, count * 100);
+        }
+        memcpy(dst + j1, border + j1, h - j1);
+    }
+}
+
+/**
+ * @details Adaptative threshold segmentation complemented with opencv threshold for borders
+ *
+ * @param in Image input in grayscale
+ * @param out Image output in grayscale
+ * @param adapThresh Image segmented using opencv threshold
+ * @param w image width
+ * @param h image height
+ */
+void segmentar(Mat &in, Mat &out, Mat adapThresh, int w, int h) {
+    // One buffer per thread, the detection runs on a pool
+    static thread_local vector<uint32_t> integral;
+    segmentar(in, out, adapThresh, w, h, integral);
+}
+
+#define SEGMENTATION_LEGACY 0
+#define SEGMENTATION_FUSED  1
+
+/* Radius and offset of the border threshold, the window of the legacy adaptiveThreshold */
+#define SEGMENTATION_BORDER_RADIUS 20
+#define SEGMENTATION_BORDER_C      12
+
+/**
+ * @details Mean threshold over a window clipped to the image, used for the pixels
+ * where the segmentar window does not fit, out = pixel > mean - C
+ *
+ * @param src Input row
+ * @param dst Output row, can be the same as src
+ * @param top Integral row above the window
+ * @param bottom Integral row at the bottom of the window
+ * @param n_rows Number of rows inside the window
+ * @param j0 First column
+ * @param j1 Last column (exclusive)
+ * @param h image height
+ */
+void segmentar_border_row(const unsigned char *src, unsigned char *dst, const uint32_t *top, const uint32_t *bottom, int n_rows, int j0, int j1, int h) {
+    int r = SEGMENTATION_BORDER_RADIUS;
+    int C = SEGMENTATION_BORDER_C;
+    for (int j = j0; j < j1; j++) {
+        int c0 = max(0, j - r);
+        int c1 = min(h, j + r + 1);
+        uint32_t count = n_rows * (c1 - c0);
+        uint32_t sum = bottom[c1] - bottom[c0] - top[c1] + top[c0];
+        dst[j] = ((src[j] + C) * count > sum) ? 255 : 0;
+    }
+}
+
+/**
+ * @details Adaptative threshold segmentation in a single pass, the interior uses the same
+ * rule as segmentar and the borders use a mean threshold (SEGMENTATION_BORDER_RADIUS and
+ * SEGMENTATION_BORDER_C) taken from the same summed-area table instead of a full opencv
+ * adaptiveThreshold. Rows are thresholded as soon as the integral rows they need are built,
+ * so the table is still in cache
+ *
+ * @param in Image input in grayscale
+ * @param out Image output in grayscale, can be the same as in
+ * @param w image width
+ * @param h image height
+ * @param integral Buffer for the integral image, reused between frames
+ */
+void segmentar_fused(Mat &in, Mat &out, int w, int h, vector<uint32_t> &integral) {
+    size_t stride = h + 1;
+    integral.resize((w + 1) * stride);
+    memset(&integral[0], 0, stride * sizeof(uint32_t));
+    out.create(in.size(), CV_8UC1);
+
+    int s = w / 8;
+    int t = 15;
+    int hs = s / 2;
+    int border_r = SEGMENTATION_BORDER_RADIUS;
+    uint64_t count = (uint64_t)(2 * hs) * (2 * hs);
+    uint64_t window = (uint64_t)(2 * hs + 1) * (2 * hs + 1);
+    bool fits_32 = 255 * count * 100 <= UINT32_MAX && 255 * window * (100 - t) <= UINT32_MAX;
+    int j0 = hs + 1;
+    int j1 = max(j0, h - hs);
+    int lag = max(hs, border_r);
+    int next = 0;
+
+    for (int r = 0; r <= w; r++) {
+        if (r < w) {
+            const unsigned char *src = in.ptr<unsigned char>(r);
+            const uint32_t *prev = &integral[r * stride];
+            uint32_t *cur = &integral[(r + 1) * stride];
+            uint32_t sum = 0;
+            cur[0] = 0;
+            for (int c = 0; c < h; c++) {
+                sum += src[c];
+                cur[c + 1] = prev[c + 1] + sum;
+            }
+        }
+        int last = (r < w) ? r - lag : w - 1;
+        for (; next <= last; next++) {
+            int i = next;
+            const unsigned char *src = in.ptr<unsigned char>(i);
+            unsigned char *dst = out.ptr<unsigned char>(i);
+            int b0 = max(0, i - border_r);
+            int b1 = min(w, i + border_r + 1);
+            const uint32_t *border_top = &integral[b0 * stride];
+            const uint32_t *border_bottom = &integral[b1 * stride];
+            if (i - hs <= 0 || i + hs >= w || j0 >= j1) {
+                segmentar_border_row(src, dst, border_top, border_bottom, b1 - b0, 0, h, h);
+                continue;
+            }
+            const uint32_t *top = &integral[(i - hs) * stride];
+            const uint32_t *bottom = &integral[(i + hs + 1) * stride];
+            segmentar_border_row(src, dst, border_top, border_bottom, b1 - b0, 0, j0, h);
+            segmentar_border_row(src, dst, border_top, border_bottom, b1 - b0, j1, h, h);
+            if (fits_32) {
+                segmentar_row(src, dst, top, bottom, j0, j1, hs, count * 100);
+            } else {
+                segmentar_row_64(src, dst, top, bottom, j0, j1, hs, count * 100);
+            }
+        }
+    }
+}
+
+/**
+ * @details Binarize a grayscale frame with the selected segmentation method
+ *
+ * @param frame_gray Image input in grayscale, replaced by the segmented image
+ * @param thresh Buffer for the opencv threshold used by the legacy method
+ * @param w image width
+ * @param h image height
+ * @param method SEGMENTATION_LEGACY (adaptiveThreshold + segmentar) or SEGMENTATION_FUSED
+ * @param integral Buffer for the integral image, reused between frames
+ */
+void threshold_frame(Mat &frame_gray, Mat &thresh, int w, int h, int method, vector<uint32_t> &integral) {
+    PROFILE_SCOPE(PROFILE_THRESHOLD);
+    if (method == SEGMENTATION_FUSED) {
+        segmentar_fused(frame_gray, frame_gray, w, h, integral);
+    } else {
+        adaptiveThreshold(frame_gray, thresh, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 2 * SEGMENTATION_BORDER_RADIUS + 1, SEGMENTATION_BORDER_C);
+        segmentar(frame_gray, frame_gray, thresh, w, h, integral);
+    }
+}
+
+void threshold_frame(Mat &frame_gray, Mat &thresh, int w, int h, int method) {
+    // One buffer per thread, the detection runs on a pool
+    static thread_local vector<uint32_t> integral;
+    threshold_frame(frame_gray, thresh, w, h, method, integral);
+}
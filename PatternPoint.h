@@ -1,3 +1,4 @@
+#pragma once
 /**
  * @details Class to save patter point information
  */
@@ -22,16 +23,16 @@ public:
         this->radio = radio;
         this->h_father = h_father;
     }
-    float area(const PatternPoint p,const PatternPoint p2){
+    float area(const PatternPoint p,const PatternPoint p2) const {
         return distance(p) * distance(p2);
     }
-    float distance(const PatternPoint p) {
+    float distance(const PatternPoint p) const {
         return sqrt(pow(x - p.x, 2) + pow(y - p.y, 2));
     }
-    Point2f to_point2f() {
+    Point2f to_point2f() const {
         return Point2f(x, y);
     }
-    Point2f center() {
+    Point2f center() const {
         return Point2f(x, y);
     }
 };
\ No newline at end of file
@@ -1,17 +1,29 @@
+#pragma once
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include "ImagePreprocessing.h"
 #include "PatternPoint.h"
+#include "EllipseFit.h"
+#include "RegionLabeling.h"
+#include "WorkStealingPool.h"
 #include <algorithm>
+#include <cfloat>
 
 using namespace cv;
 using namespace std;
 
 #define flag_masa 0
 
+/* Ring candidates from the contour tree or from the labeled regions */
+#define CANDIDATES_CONTOURS 0
+#define CANDIDATES_LABELS 1
+
 void order_points_and_track(Mat &out, vector<PatternPoint> &pattern_centers, vector<PatternPoint> new_pattern_points);
-void update_mask_from_points(vector<PatternPoint> points, int w, int h, Point mask_point[][4]);
-int mode_from_father(vector<PatternPoint> pattern_points);
+void update_mask_from_points(const vector<PatternPoint> &points, int w, int h, Point mask_point[][4]);
+void update_mask_from_points(const vector<PatternPoint> &points, int w, int h, Point mask_point[][4], vector<Point2f> &points_2f);
+int mode_from_father(const vector<PatternPoint> &pattern_points);
 int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames);
+int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, Point offset);
 float angle_between_two_points(PatternPoint p1, PatternPoint p2);
 float distance_to_rect(PatternPoint p1, PatternPoint p2, PatternPoint x);
 vector<PatternPoint> more_distant_points(vector<PatternPoint>points);
@@ -43,25 +55,26 @@ bool sort_pattern_point_by_y(PatternPoint p1, PatternPoint p2) {
  * @details Return the father hierarchy mode from a vector of PatternPoints
  *
  * @param pattern_points Vector of points
+ * @param fathers Buffer for the father hierarchies, reused between frames
  * @return father hierarchy mode
  */
-int mode_from_father(vector<PatternPoint> points) {
+int mode_from_father(const vector<PatternPoint> &points, vector<int> &fathers) {
     if (points.size() == 0) {
         return -1;
     }
-    vector<PatternPoint> temp;
+    fathers.resize(points.size());
     for (int p = 0; p < points.size(); p++) {
-        temp.push_back(points[p]);
+        fathers[p] = points[p].h_father;
     }
-    sort(temp.begin(), temp.end(), sort_pattern_point_by_father);
+    sort(fathers.begin(), fathers.end());
 
-    int number = temp[0].h_father;
+    int number = fathers[0];
     int mode = number;
     int count = 1;
     int countMode = 1;
 
-    for (int p = 1; p < temp.size(); p++) {
-        if (number == temp[p].h_father) {
+    for (int p = 1; p < fathers.size(); p++) {
+        if (number == fathers[p]) {
             count++;
         } else {
             if (count > countMode) {
@@ -69,7 +82,7 @@ int mode_from_father(vector<PatternPoint> points) {
                 mode = number;
             }
             count = 1;
-            number =  temp[p].h_father;
+            number =  fathers[p];
         }
     }
     if (count > countMode) {
@@ -79,43 +92,384 @@ int mode_from_father(vector<PatternPoint> points) {
     }
 }
 
-int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames) {
+int mode_from_father(const vector<PatternPoint> &points) {
+    vector<int> fathers;
+    return mode_from_father(points, fathers);
+}
+
+/**
+ * @details Count for every candidate how many other candidates j are nearer than
+ * 5 * radio of j, original all pairs version kept as reference
+ *
+ * @param candidates Ring candidates
+ * @param count Number of near candidates of each candidate
+ * @param neighbors Pairs (i, j) of near candidates
+ */
+void count_near_candidates_reference(const vector<PatternPoint> &candidates, vector<int> &count, vector<Vec2i> &neighbors) {
+    count.assign(candidates.size(), 0);
+    for (int i = 0; i < candidates.size(); ++i) {
+        for (int j = 0; j < candidates.size(); ++j) {
+            if (i == j) continue;
+            if (candidates[i].distance(candidates[j]) < candidates[j].radio * 5/*3.5*/) {
+                neighbors.push_back(Vec2i(i, j));
+                count[i]++;
+            }
+        }
+    }
+}
+
+/**
+ * @details Buffers of the uniform grid used by count_near_candidates
+ */
+struct CandidateGrid {
+    vector<float> radios;
+    vector<int> cell_of;
+    vector<int> cell_start;
+    vector<int> items;
+    vector<int> fill;
+};
+
+/**
+ * @details Count for every candidate how many other candidates j are nearer than
+ * 5 * radio of j. Candidates are stored in a uniform grid with cells of 5 times the
+ * median radio, every candidate j only visits the cells covered by its own reach
+ *
+ * @param candidates Ring candidates
+ * @param count Number of near candidates of each candidate
+ * @param neighbors Pairs (i, j) of near candidates
+ * @param grid Grid buffers, reused between frames
+ */
+void count_near_candidates(const vector<PatternPoint> &candidates, vector<int> &count, vector<Vec2i> &neighbors, CandidateGrid &grid) {
+    int n = candidates.size();
+    count.assign(n, 0);
+    if (n < 2) {
+        return;
+    }
+    float min_x = candidates[0].x;
+    float min_y = candidates[0].y;
+    float max_x = min_x;
+    float max_y = min_y;
+    vector<float> &radios = grid.radios;
+    radios.resize(n);
+    for (int i = 0; i < n; i++) {
+        min_x = min(min_x, candidates[i].x);
+        min_y = min(min_y, candidates[i].y);
+        max_x = max(max_x, candidates[i].x);
+        max_y = max(max_y, candidates[i].y);
+        radios[i] = candidates[i].radio;
+    }
+    nth_element(radios.begin(), radios.begin() + n / 2, radios.end());
+    float cell = max(radios[n / 2] * 5, 1.0f);
+    // Keep the grid small when the candidates are spread and the radios are tiny
+    float extent = max(max_x - min_x, max_y - min_y);
+    cell = max(cell, extent / 256);
+    int cols = (int)((max_x - min_x) / cell) + 1;
+    int rows = (int)((max_y - min_y) / cell) + 1;
+
+    vector<int> &cell_of = grid.cell_of;
+    vector<int> &cell_start = grid.cell_start;
+    vector<int> &items = grid.items;
+    vector<int> &fill = grid.fill;
+    cell_of.resize(n);
+    cell_start.assign(rows * cols + 1, 0);
+    items.resize(n);
+    for (int i = 0; i < n; i++) {
+        int cx = (int)((candidates[i].x - min_x) / cell);
+        int cy = (int)((candidates[i].y - min_y) / cell);
+        cell_of[i] = cy * cols + cx;
+        cell_start[cell_of[i] + 1]++;
+    }
+    for (int c = 0; c < rows * cols; c++) {
+        cell_start[c + 1] += cell_start[c];
+    }
+    fill.assign(cell_start.begin(), cell_start.end() - 1);
+    for (int i = 0; i < n; i++) {
+        items[fill[cell_of[i]]++] = i;
+    }
+
+    for (int j = 0; j < n; j++) {
+        float reach = candidates[j].radio * 5;
+        // One extra cell on each side absorbs the rounding of the cell coordinates
+        int cx0 = max(0, (int)floor((candidates[j].x - reach - min_x) / cell) - 1);
+        int cx1 = min(cols - 1, (int)floor((candidates[j].x + reach - min_x) / cell) + 1);
+        int cy0 = max(0, (int)floor((candidates[j].y - reach - min_y) / cell) - 1);
+        int cy1 = min(rows - 1, (int)floor((candidates[j].y + reach - min_y) / cell) + 1);
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                int c = cy * cols + cx;
+                for (int k = cell_start[c]; k < cell_start[c + 1]; k++) {
+                    int i = items[k];
+                    if (i == j) continue;
+                    if (candidates[i].distance(candidates[j]) < reach) {
+                        neighbors.push_back(Vec2i(i, j));
+                        count[i]++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void count_near_candidates(const vector<PatternPoint> &candidates, vector<int> &count, vector<Vec2i> &neighbors) {
+    CandidateGrid grid;
+    count_near_candidates(candidates, count, neighbors, grid);
+}
+
+/**
+ * @details Result of the pattern detection in one frame, everything needed to draw
+ * the detection afterwards without touching the images during the search
+ */
+struct PatternDetection {
+    vector<RotatedRect> fathers;        // Outer ellipses of the rings found
+    vector<RotatedRect> sons;           // Inner ellipses of the rings found
+    vector<RotatedRect> singles;        // Ellipses with a father but without a son
+    vector<PatternPoint> candidates;    // Ring centers, radius and father hierarchy id
+    vector<Vec2i> neighbors;            // Pairs of near candidates
+    vector<PatternPoint> near;          // Candidates with at least two near candidates
+    vector<PatternPoint> points;        // Near candidates kept after the father filter
+    bool has_father_ellipse;
+    RotatedRect father_ellipse;         // Ellipse of the most common father
+    vector<PatternPoint> previous;      // Ordered points of the previous frame when tracking
+    vector<PatternPoint> ordered;       // Ordered grid 0..19
+    bool tracking;                      // The grid was ordered by tracking the previous one
+    int detected_points;
+    Point offset;                       // Position of the segmented image inside the frame
+
+    void clear() {
+        fathers.clear();
+        sons.clear();
+        singles.clear();
+        candidates.clear();
+        neighbors.clear();
+        near.clear();
+        points.clear();
+        has_father_ellipse = false;
+        previous.clear();
+        ordered.clear();
+        tracking = false;
+        detected_points = 0;
+    }
+};
+
+/**
+ * @details Alpha-beta tracker of the 20 ordered points, every point keeps its own position
+ * and velocity (constant velocity model, in pixels per frame). The prediction is used to
+ * move the points and the mask before the next frame is searched, so the nearest point
+ * association and the region of interest follow the board when it moves fast
+ */
+struct PatternTracker {
+    vector<Point2f> position;           // Filtered position of every ordered point
+    vector<Point2f> velocity;           // Pixels per frame
+    float alpha;                        // Position gain
+    float beta;                         // Velocity gain
+    bool locked;
+    int lost_frames;                    // Frames predicted without measurement
+    int tracked_frames;                 // Frames ordered by tracking the prediction
+    int reacquisitions;                 // Frames where the grid was ordered from scratch
+    vector<Point2f> points_2f;          // Buffer of update_mask_from_points
+
+    PatternTracker() {
+        alpha = 0.85;
+        beta = 0.6;
+        clear();
+    }
+
+    void clear() {
+        position.clear();
+        velocity.clear();
+        locked = false;
+        lost_frames = 0;
+        tracked_frames = 0;
+        reacquisitions = 0;
+    }
+
+    /**
+     * @details Move the tracked points to the position predicted for the next frame and
+     * update the mask around them, it must be called before the frame is masked
+     *
+     * @param pattern_points Points tracked between frames
+     * @param w Frame width
+     * @param h Frame height
+     * @param mask_point Mask updated from the predicted points
+     */
+    void predict(vector<PatternPoint> &pattern_points, int w, int h, Point mask_point[][4]) {
+        if (!locked || pattern_points.size() != position.size()) {
+            return;
+        }
+        for (int p = 0; p < position.size(); p++) {
+            position[p] += velocity[p];
+            pattern_points[p].x = position[p].x;
+            pattern_points[p].y = position[p].y;
+        }
+        update_mask_from_points(pattern_points, w, h, mask_point, points_2f);
+    }
 
+    /**
+     * @details Correct the prediction with the points of the frame
+     *
+     * @param pattern_points Ordered points after the search
+     * @param measured The 20 points were found in this frame, not replayed
+     * @param tracking The points were ordered by tracking the previous ones
+     */
+    void update(const vector<PatternPoint> &pattern_points, bool measured, bool tracking) {
+        if (pattern_points.size() != 20) {
+            locked = false;
+            return;
+        }
+        if (!measured) {
+            lost_frames++;
+            return;
+        }
+        if (!locked || !tracking) {
+            position.resize(pattern_points.size());
+            velocity.assign(pattern_points.size(), Point2f(0, 0));
+            for (int p = 0; p < pattern_points.size(); p++) {
+                position[p] = pattern_points[p].to_point2f();
+            }
+            locked = true;
+            lost_frames = 0;
+            reacquisitions++;
+            return;
+        }
+        // frames without measurement are spread in the velocity correction
+        float steps = lost_frames + 1;
+        for (int p = 0; p < position.size(); p++) {
+            Point2f residual = pattern_points[p].to_point2f() - position[p];
+            position[p] += residual * alpha;
+            velocity[p] += residual * (beta / steps);
+        }
+        lost_frames = 0;
+        tracked_frames++;
+    }
+};
+
+/**
+ * @details Buffers of the grid ordering from the hull corners
+ */
+struct GridOrderBuffers {
+    vector<PatternPoint> sorted;
+    vector<PatternPoint> hull;
+    vector<Point2f> image_points;
+    vector<Point2f> lattice_points;
+    vector<int> cell;
+    vector<PatternPoint> grid;
+};
+
+/**
+ * @details Buffers of the coarse to fine search
+ */
+struct PyramidBuffers {
+    Mat coarse;                         // Downsampled frame in grayscale
+    Mat half;                           // Buffer of the pyramid levels
+    Mat roi_binary;                     // Threshold of the region around one ring at full resolution
+    RegionLabels labels;                // Regions of roi_binary
+    vector<PatternPoint> candidates;    // Rings found in roi_binary
+    vector<RotatedRect> outer;
+    vector<RotatedRect> inner;
+    vector<RotatedRect> singles;
+    vector<PatternPoint> refined;       // Ordered points at full resolution
+};
+
+/**
+ * @details Buffers used to detect the pattern in a frame, owned by the caller and reused
+ * between frames. After the first frame of a given size the search does not allocate
+ * memory by itself, only the opencv functions it calls can do it
+ */
+struct DetectionWorkspace {
+    int candidate_method;               // CANDIDATES_CONTOURS or CANDIDATES_LABELS
+    Mat frame_gray;                     // Frame in grayscale
+    Mat binary_buffer;                  // Frame sized buffer for the segmented region
+    Mat thresh_buffer;                  // Frame sized buffer for the opencv threshold
+    Mat binary;                         // Segmented region, a view of binary_buffer
+    Mat thresh;                         // Opencv threshold, a view of thresh_buffer
+    vector<uint32_t> integral;          // Integral image of the segmentation
     vector<vector<Point> > contours;
     vector<Vec4i> hierarchy;
-    vector<PatternPoint> ellipses_temp;
+    EllipseBatch ellipses;              // Ellipses of the ring contours
+    vector<int> ellipse_index;          // Position of every contour in the batch, -1 if not fitted
+    RegionLabels labels;                // Labeled regions of the segmented image
     vector<PatternPoint> new_pattern_points;
-    float radio_hijo;
-    float radio;
-    float radio_prom = 0;
-    float distance;
-    Scalar purple(255, 0, 255);
-    Scalar red(0, 0, 255);
-    Scalar yellow(0, 255, 255);
-    Scalar blue(255, 0, 0);
-    Scalar green(0, 255, 0);
-    Scalar white(255, 255, 255);
+    vector<PatternPoint> filtered;      // Candidates kept by the father filter
+    vector<PatternPoint> previous_points;
+    vector<int> near_count;
+    vector<int> fathers;                // Buffer of mode_from_father
+    vector<Point2f> points_2f;          // Buffer of update_mask_from_points
+    CandidateGrid grid;
+    GridOrderBuffers grid_order;
+    PyramidBuffers pyramid;
+    PatternDetection detection;
 
-    int erosion_size = 2;
-    Mat kernel = getStructuringElement( MORPH_ELLIPSE,
-                                        Size( 2 * erosion_size + 1, 2 * erosion_size + 1 ),
-                                        Point( erosion_size, erosion_size ) );
+    DetectionWorkspace() {
+        candidate_method = CANDIDATES_LABELS;
+    }
 
-    //erode( src_gray, src_gray, kernel );
+    /**
+     * @details Views of the segmentation buffers for a region, the buffers only grow
+     *
+     * @param rows Rows of the region
+     * @param cols Cols of the region
+     */
+    void region(int rows, int cols) {
+        if (binary_buffer.rows < rows || binary_buffer.cols < cols) {
+            binary_buffer.create(max(rows, binary_buffer.rows), max(cols, binary_buffer.cols), CV_8UC1);
+            thresh_buffer.create(binary_buffer.rows, binary_buffer.cols, CV_8UC1);
+        }
+        binary = binary_buffer(Rect(0, 0, cols, rows));
+        thresh = thresh_buffer(Rect(0, 0, cols, rows));
+    }
+};
 
-    //morphologyEx(src_gray, src_gray, MORPH_CLOSE, kernel);
+void order_points(vector<PatternPoint> &pattern_centers, const vector<PatternPoint> &new_pattern_points, PatternDetection &detection, GridOrderBuffers &buffers);
+void draw_pattern_detection(Mat &binary, Mat &masked, Mat &original, const PatternDetection &detection);
+void draw_pattern_order(Mat &drawing, const PatternDetection &detection);
 
-    findContours( src_gray, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, Point(0, 0) );
+/**
+ * @details Ring candidates from the contour tree of the segmented image, every ring is a
+ * contour with a father and a son with nearly the same center
+ *
+ * @param src_gray Segmented image, it can be a crop of the frame
+ * @param offset Position of src_gray inside the frame
+ * @param workspace Buffers reused between frames, the candidates are left in workspace.detection
+ */
+void contour_candidates(Mat &src_gray, Point offset, DetectionWorkspace &workspace) {
+    PatternDetection &detection = workspace.detection;
+    vector<vector<Point> > &contours = workspace.contours;
+    vector<Vec4i> &hierarchy = workspace.hierarchy;
+    vector<PatternPoint> &ellipses_temp = detection.candidates;
+    float radio_hijo;
+    float radio;
 
-    /* Find ellipses with a father and a son*/
+    {
+        PROFILE_SCOPE(PROFILE_CONTOUR);
+        findContours( src_gray, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, offset );
+    }
+
+    /* Fit all the contours with a father in one batch, the sons are included because they
+     * have a father too. Contours that are not ellipses are rejected here */
+    EllipseBatch &batch = workspace.ellipses;
+    vector<int> &index = workspace.ellipse_index;
+    batch.clear();
+    index.assign(contours.size(), -1);
     for (int c = 0; c < contours.size(); c++) {
         if (contours[c].size() > 4 && hierarchy[c][3] != -1) {
-            RotatedRect elipse  = fitEllipse( Mat(contours[c]) );
+            index[c] = batch.size();
+            batch.add(contours[c]);
+        }
+    }
+    {
+        PROFILE_SCOPE(PROFILE_ELLIPSE_FIT);
+        fit_ellipses(batch);
+    }
+
+    /* Find ellipses with a father and a son*/
+    for (int c = 0; c < contours.size(); c++) {
+        if (index[c] != -1 && batch.valid[index[c]]) {
+            const RotatedRect &elipse = batch.ellipses[index[c]];
             radio = (elipse.size.height + elipse.size.width) / 4;
             if (hierarchy[c][2] != -1) { //If has a son
                 int hijo  = hierarchy[c][2];
-                if (contours[hijo].size() > 4 ) {
-                    RotatedRect elipseHijo  = fitEllipse( Mat(contours[hijo]) );
+                if (index[hijo] != -1 && batch.valid[index[hijo]]) {
+                    const RotatedRect &elipseHijo = batch.ellipses[index[hijo]];
                     radio_hijo = (elipseHijo.size.height + elipseHijo.size.width) / 4;
                     /* Check center proximity */
                     if ( /*radio <= radio_hijo * 2 &&*/ cv::norm(elipse.center - elipseHijo.center) < radio_hijo / 2) {
@@ -131,91 +485,451 @@ int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h,
                                                                  (elipse.center.y + elipseHijo.center.y ) / 2,
                                                                  radio,
                                                                  hierarchy[c][3]));
-                            /*ellipses_temp.push_back(PatternPoint(elipse.center.x,
-                                                                 elipse.center.y,
-                                                                radio,
-                                                                hierarchy[c][3]));*/
-                            /*ellipses_temp.push_back(PatternPoint(elipseHijo.center.x,
-                                                                 elipseHijo.center.y,
-                                                                radio,
-                                                                hierarchy[c][3]));*/
                         }
-                        ellipse(masked, elipseHijo, red, 2);
-                        ellipse(masked, elipse, yellow, 2);
+                        detection.sons.push_back(elipseHijo);
+                        detection.fathers.push_back(elipse);
                     }
                 }
             } else {
-                ellipse(masked, elipse, purple, 2);
+                detection.singles.push_back(elipse);
             }
         }
-        drawContours( src_gray, contours, c, white, 2, 8, hierarchy, 0, Point() );
+    }
+}
+
+/**
+ * @details Ellipse of the father shared by the pattern rings, used to draw it
+ *
+ * @param mode Father id of the rings
+ * @param workspace Buffers of the detection
+ * @param ellipse Ellipse output
+ * @return false if the father has not enough points
+ */
+bool father_ellipse(int mode, DetectionWorkspace &workspace, RotatedRect &ellipse) {
+    if (workspace.candidate_method == CANDIDATES_LABELS) {
+        ellipse_from_moments(workspace.labels.moments[mode], ellipse);
+        return workspace.labels.moments[mode].m00 > 0;
+    }
+    const EllipseBatch &batch = workspace.ellipses;
+    const vector<int> &index = workspace.ellipse_index;
+    if (workspace.contours[mode].size() <= 4) {
+        return false;
+    }
+    if (index[mode] != -1 && batch.valid[index[mode]]) {
+        ellipse = batch.ellipses[index[mode]];
+    } else {
+        ellipse = fitEllipse( Mat(workspace.contours[mode]) );
+    }
+    return true;
+}
+
+/**
+ * @details Find the pattern points in a segmented image without drawing anything
+ *
+ * @param src_gray Segmented image, it can be a crop of the frame
+ * @param w Frame width
+ * @param h Frame height
+ * @param mask_point Mask updated from the points found
+ * @param pattern_points Points tracked between frames
+ * @param keep_per_frames Frames to keep the last points when the pattern is lost
+ * @param offset Position of src_gray inside the frame
+ * @param workspace Buffers reused between frames, the result is left in workspace.detection
+ * @return Number of pattern points found
+ */
+int detect_pattern_points(Mat &src_gray, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, Point offset, DetectionWorkspace &workspace) {
+
+    PatternDetection &detection = workspace.detection;
+    vector<PatternPoint> &ellipses_temp = detection.candidates;
+    vector<PatternPoint> &new_pattern_points = workspace.new_pattern_points;
+
+    detection.clear();
+    detection.offset = offset;
+    new_pattern_points.clear();
+
+    if (workspace.candidate_method == CANDIDATES_LABELS) {
+        PROFILE_SCOPE(PROFILE_CONTOUR);
+        label_regions(src_gray, offset, workspace.labels);
+        ring_candidates(workspace.labels, ellipses_temp, detection.fathers, detection.sons, detection.singles);
+    } else {
+        contour_candidates(src_gray, offset, workspace);
     }
 
     /* Filter ellipses how doesnt have another ones near to it */
-    int count;
+    vector<int> &near_count = workspace.near_count;
+    count_near_candidates(ellipses_temp, near_count, detection.neighbors, workspace.grid);
     for (int i = 0; i < ellipses_temp.size(); ++i) {
-        count = 0;
-        for (int j = 0; j < ellipses_temp.size(); ++j) {
-            if (i == j) continue;
-            radio = ellipses_temp[j].radio;
-
-            distance = ellipses_temp[i].distance(ellipses_temp[j]);
-            if (distance < radio * 5/*3.5*/) {
-                line(masked, ellipses_temp[i].center(), ellipses_temp[j].center(), red, 1);
-                count++;
-            }
-        }
-        if (count >= 2) {
-            radio = ellipses_temp[i].radio;
-            radio_prom += radio;
+        if (near_count[i] >= 2) {
             new_pattern_points.push_back(ellipses_temp[i]);
-            circle(masked, ellipses_temp[i].center(), radio, blue, 5);
         }
     }
-    radio_prom /= new_pattern_points.size();
+    detection.near = new_pattern_points;
 
     /* Clean false positive checking the father hierarchy */
     if (new_pattern_points.size() > 20) {
-        int mode = mode_from_father(new_pattern_points);
-        if (mode != -1 && contours[mode].size() > 4) {
-            RotatedRect elipse  = fitEllipse( Mat(contours[mode]) );
-            ellipse(masked, elipse, white, 5);
+        int mode = mode_from_father(new_pattern_points, workspace.fathers);
+        if (mode != -1 && father_ellipse(mode, workspace, detection.father_ellipse)) {
+            detection.has_father_ellipse = true;
 
             /* CLEAN USING MODE */
-            vector<PatternPoint> temp ;
+            vector<PatternPoint> &temp = workspace.filtered;
+            temp.clear();
             for (int e = 0; e < new_pattern_points.size(); e++) {
                 if (new_pattern_points[e].h_father == mode) {
                     temp.push_back(new_pattern_points[e]);
-                    circle(masked, new_pattern_points[e].center(), new_pattern_points[e].radio, green, 5);
                 }
             }
-            new_pattern_points = temp;
+            new_pattern_points.swap(temp);
         }
     }
-
-    for (int e = 0; e < new_pattern_points.size(); e++) {
-        circle(masked, new_pattern_points[e].center(), new_pattern_points[e].radio, green, 5);
-    }
+    detection.points = new_pattern_points;
 
     if (new_pattern_points.size() == 20) {
         keep_per_frames = 2;
-        //pattern_points = new_pattern_points;
-        order_points_and_track(original, pattern_points, new_pattern_points);
+        order_points(pattern_points, new_pattern_points, detection, workspace.grid_order);
 
     } else {
         if (keep_per_frames-- > 0) {
             new_pattern_points = pattern_points;
-            order_points_and_track(original, pattern_points, new_pattern_points);
+            order_points(pattern_points, new_pattern_points, detection, workspace.grid_order);
         } else {
             new_pattern_points.clear();
             pattern_points.clear();
         }
     }
+    detection.ordered = pattern_points;
+    detection.detected_points = new_pattern_points.size();
 
-    update_mask_from_points(new_pattern_points, w, h, mask_point);
+    update_mask_from_points(new_pattern_points, w, h, mask_point, workspace.points_2f);
     return new_pattern_points.size();
 }
 
+/**
+ * @details Find the pattern points in a segmented image without drawing anything, the
+ * buffers are released at the end, use the DetectionWorkspace version in loops
+ *
+ * @param src_gray Segmented image, it can be a crop of the frame
+ * @param w Frame width
+ * @param h Frame height
+ * @param mask_point Mask updated from the points found
+ * @param pattern_points Points tracked between frames
+ * @param keep_per_frames Frames to keep the last points when the pattern is lost
+ * @param offset Position of src_gray inside the frame
+ * @param detection Detection result
+ * @return Number of pattern points found
+ */
+int detect_pattern_points(Mat &src_gray, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, Point offset, PatternDetection &detection) {
+    DetectionWorkspace workspace;
+    int detected_points = detect_pattern_points(src_gray, w, h, mask_point, pattern_points, keep_per_frames, offset, workspace);
+    swap(detection, workspace.detection);
+    return detected_points;
+}
+
+/**
+ * @details Find the pattern points in a segmented image and draw the detection
+ *
+ * @param src_gray Segmented image, it can be a crop of the frame
+ * @param masked Frame to draw the ellipses found
+ * @param original Frame to draw the ordered pattern
+ * @param w Frame width
+ * @param h Frame height
+ * @param mask_point Mask updated from the points found
+ * @param pattern_points Points tracked between frames
+ * @param keep_per_frames Frames to keep the last points when the pattern is lost
+ * @param offset Position of src_gray inside the frame
+ * @return Number of pattern points found
+ */
+int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, Point offset) {
+    PatternDetection detection;
+    int detected_points = detect_pattern_points(src_gray, w, h, mask_point, pattern_points, keep_per_frames, offset, detection);
+    draw_pattern_detection(src_gray, masked, original, detection);
+    return detected_points;
+}
+
+int find_pattern_points(Mat &src_gray, Mat &masked, Mat&original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames) {
+    return find_pattern_points(src_gray, masked, original, w, h, mask_point, pattern_points, keep_per_frames, Point(0, 0));
+}
+
+/**
+ * @details Gray copy of a frame for the segmentation, which works in place
+ *
+ * @param frame BGR or gray frame, it is not modified (it can be a read only FrameStore view)
+ * @param gray Output, its buffer is reused
+ */
+void frame_to_gray(const Mat &frame, Mat &gray) {
+    if (frame.channels() == 1) {
+        frame.copyTo(gray);
+    } else {
+        cvtColor( frame, gray, CV_BGR2GRAY );
+    }
+}
+
+/**
+ * @details Find the pattern in a BGR or gray frame from scratch, without tracking and
+ * without drawing anything
+ *
+ * @param frame BGR or gray frame, it is not modified
+ * @param w Frame width
+ * @param h Frame height
+ * @param pattern_points Ordered points found in the frame
+ * @param segmentation_method SEGMENTATION_LEGACY or SEGMENTATION_FUSED
+ * @param workspace Buffers reused between frames, workspace.detection holds the result
+ * @return True if the 20 points were found
+ */
+bool detect_pattern_in_frame(const Mat &frame, int w, int h, vector<PatternPoint> &pattern_points, int segmentation_method, DetectionWorkspace &workspace) {
+    Point mask_points[1][4];
+    int keep_per_frames = 2;
+    frame_to_gray(frame, workspace.frame_gray);
+    workspace.region(w, h);
+    threshold_frame(workspace.frame_gray, workspace.thresh, w, h, segmentation_method, workspace.integral);
+    pattern_points.clear();
+    return detect_pattern_points(workspace.frame_gray, w, h, mask_points, pattern_points, keep_per_frames, Point(0, 0), workspace) == 20;
+}
+
+/**
+ * @details Scale the detection found in a downsampled frame to the full frame
+ *
+ * @param detection Detection to scale
+ * @param scale Full resolution over downsampled resolution
+ */
+void scale_detection(PatternDetection &detection, float scale) {
+    vector<RotatedRect> *ellipses[3] = {&detection.fathers, &detection.sons, &detection.singles};
+    for (int v = 0; v < 3; v++) {
+        for (int e = 0; e < ellipses[v]->size(); e++) {
+            RotatedRect &ellipse = (*ellipses[v])[e];
+            ellipse.center = ellipse.center * scale;
+            ellipse.size = Size2f(ellipse.size.width * scale, ellipse.size.height * scale);
+        }
+    }
+    detection.father_ellipse.center = detection.father_ellipse.center * scale;
+    detection.father_ellipse.size = Size2f(detection.father_ellipse.size.width * scale, detection.father_ellipse.size.height * scale);
+    vector<PatternPoint> *points[5] = {&detection.candidates, &detection.near, &detection.points, &detection.previous, &detection.ordered};
+    for (int v = 0; v < 5; v++) {
+        for (int p = 0; p < points[v]->size(); p++) {
+            PatternPoint &point = (*points[v])[p];
+            point = PatternPoint(point.x * scale, point.y * scale, point.radio * scale, point.h_father);
+        }
+    }
+    detection.offset = detection.offset * scale;
+}
+
+/**
+ * @details Refine a ring center at full resolution, the region around the coarse center
+ * is thresholded with Otsu and the ring is searched again in it with the region labeling
+ *
+ * @param frame_gray Frame in grayscale at full resolution
+ * @param point Ring scaled from the coarse search, replaced by the refined ring
+ * @param buffers Buffers of the coarse to fine search
+ * @return false if the ring is not found near the coarse center
+ */
+bool refine_ring(const Mat &frame_gray, PatternPoint &point, PyramidBuffers &buffers) {
+    int half = cvRound(point.radio * 1.5) + 2;
+    Rect roi = Rect(cvRound(point.x) - half, cvRound(point.y) - half, 2 * half + 1, 2 * half + 1) & Rect(0, 0, frame_gray.cols, frame_gray.rows);
+    if (roi.width < 3 || roi.height < 3) {
+        return false;
+    }
+    threshold(frame_gray(roi), buffers.roi_binary, 0, 255, THRESH_BINARY | THRESH_OTSU);
+    label_regions(buffers.roi_binary, roi.tl(), buffers.labels);
+    buffers.candidates.clear();
+    buffers.outer.clear();
+    buffers.inner.clear();
+    buffers.singles.clear();
+    ring_candidates(buffers.labels, buffers.candidates, buffers.outer, buffers.inner, buffers.singles);
+
+    int best = -1;
+    float best_distance = point.radio / 2;
+    for (int c = 0; c < buffers.candidates.size(); c++) {
+        float d = point.distance(buffers.candidates[c]);
+        if (d < best_distance) {
+            best_distance = d;
+            best = c;
+        }
+    }
+    if (best == -1) {
+        return false;
+    }
+    point = PatternPoint(buffers.candidates[best].x, buffers.candidates[best].y, buffers.candidates[best].radio, point.h_father);
+    return true;
+}
+
+/**
+ * @details Find the pattern from scratch in a frame downsampled levels times by 2 and
+ * refine every ring at full resolution, for high resolution cameras where the full
+ * frame segmentation is too slow. With levels 0 it is detect_pattern_in_frame
+ *
+ * @param frame BGR or gray frame, it is not modified
+ * @param w Frame width
+ * @param h Frame height
+ * @param pattern_points Ordered points found in the frame, at full resolution
+ * @param segmentation_method SEGMENTATION_LEGACY or SEGMENTATION_FUSED
+ * @param levels Number of pyramid levels
+ * @param workspace Buffers reused between frames, workspace.detection holds the result
+ * scaled to the full frame
+ * @return True if the 20 points were found and refined
+ */
+bool detect_pattern_in_frame_pyramid(const Mat &frame, int w, int h, vector<PatternPoint> &pattern_points, int segmentation_method, int levels, DetectionWorkspace &workspace) {
+    if (levels <= 0) {
+        return detect_pattern_in_frame(frame, w, h, pattern_points, segmentation_method, workspace);
+    }
+    PyramidBuffers &buffers = workspace.pyramid;
+    frame_to_gray(frame, workspace.frame_gray);
+    pyrDown(workspace.frame_gray, buffers.coarse);
+    for (int l = 1; l < levels; l++) {
+        pyrDown(buffers.coarse, buffers.half);
+        swap(buffers.coarse, buffers.half);
+    }
+    int coarse_w = buffers.coarse.rows;
+    int coarse_h = buffers.coarse.cols;
+    float scale = (float)w / coarse_w;
+
+    Point mask_points[1][4];
+    int keep_per_frames = 2;
+    workspace.region(coarse_w, coarse_h);
+    threshold_frame(buffers.coarse, workspace.thresh, coarse_w, coarse_h, segmentation_method, workspace.integral);
+    pattern_points.clear();
+    bool found = detect_pattern_points(buffers.coarse, coarse_w, coarse_h, mask_points, pattern_points, keep_per_frames, Point(0, 0), workspace) == 20;
+    scale_detection(workspace.detection, scale);
+    if (!found) {
+        pattern_points.clear();
+        return false;
+    }
+
+    /* The coarse centers are good enough to place a small region on every ring */
+    vector<PatternPoint> &refined = buffers.refined;
+    refined.clear();
+    for (int p = 0; p < pattern_points.size(); p++) {
+        PatternPoint point(pattern_points[p].x * scale, pattern_points[p].y * scale, pattern_points[p].radio * scale, pattern_points[p].h_father);
+        if (!refine_ring(workspace.frame_gray, point, buffers)) {
+            pattern_points.clear();
+            return false;
+        }
+        refined.push_back(point);
+    }
+    pattern_points = refined;
+    workspace.detection.ordered = refined;
+    return true;
+}
+
+/**
+ * @details Find the pattern in a batch of independent frames in parallel, every worker
+ * uses its own workspace. Results are stored in the order of the frames
+ *
+ * @param frames BGR frames
+ * @param w Frame width
+ * @param h Frame height
+ * @param segmentation_method SEGMENTATION_LEGACY or SEGMENTATION_FUSED
+ * @param levels Pyramid levels of the search, 0 searches at full resolution
+ * @param points Ordered points of every frame, empty if the pattern was not found
+ * @param pool Workers
+ * @param workspaces One workspace per worker, reused between batches
+ * @return Number of frames where the 20 points were found
+ */
+int detect_pattern_batch(const vector<Mat> &frames, int w, int h, int segmentation_method, int levels, vector<vector<PatternPoint> > &points, WorkStealingPool &pool, vector<DetectionWorkspace> &workspaces) {
+    points.resize(frames.size());
+    if (workspaces.size() < pool.n_threads) {
+        workspaces.resize(pool.n_threads);
+    }
+    pool.run(frames.size(), [&](int f, int worker) {
+        if (!detect_pattern_in_frame_pyramid(frames[f], w, h, points[f], segmentation_method, levels, workspaces[worker])) {
+            points[f].clear();
+        }
+    });
+    int found = 0;
+    for (int f = 0; f < points.size(); f++) {
+        found += points[f].size() == 20;
+    }
+    return found;
+}
+
+/**
+ * @details Axis aligned bounds of the mask clipped to the frame
+ *
+ * @param mask_point Mask points
+ * @param w Frame width
+ * @param h Frame height
+ * @return Bounding rectangle of the mask inside the frame
+ */
+Rect mask_bounds(Point mask_point[][4], int w, int h) {
+    int x0 = mask_point[0][0].x;
+    int y0 = mask_point[0][0].y;
+    int x1 = x0;
+    int y1 = y0;
+    for (int p = 1; p < 4; p++) {
+        x0 = min(x0, mask_point[0][p].x);
+        y0 = min(y0, mask_point[0][p].y);
+        x1 = max(x1, mask_point[0][p].x);
+        y1 = max(y1, mask_point[0][p].y);
+    }
+    return Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1) & Rect(0, 0, h, w);
+}
+
+/**
+ * @details Segment and search the pattern only inside the mask bounds while the pattern is
+ * tracked, results are offset back to frame coordinates. If the pattern is lost inside the
+ * region the whole frame is searched as usual. Nothing is drawn
+ *
+ * @param frame_gray Frame in grayscale, it is not modified
+ * @param w Frame width
+ * @param h Frame height
+ * @param mask_point Mask updated from the points found
+ * @param pattern_points Points tracked between frames
+ * @param keep_per_frames Frames to keep the last points when the pattern is lost
+ * @param segmentation_method SEGMENTATION_LEGACY or SEGMENTATION_FUSED
+ * @param tracker Motion model corrected with the points found, PatternTracker::predict must
+ * be called with the same points before the frame is masked
+ * @param workspace Buffers reused between frames, workspace.binary holds the segmented region
+ * and workspace.detection the result
+ * @return Number of pattern points found
+ */
+int detect_pattern_points_tracked(Mat &frame_gray, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, int segmentation_method, PatternTracker &tracker, DetectionWorkspace &workspace) {
+    if (pattern_points.size() == 20) {
+        Rect roi = mask_bounds(mask_point, w, h);
+        if (roi.width > 0 && roi.height > 0 && roi.area() < w * h) {
+            vector<PatternPoint> &previous_points = workspace.previous_points;
+            previous_points = pattern_points;
+            int previous_keep = keep_per_frames;
+            workspace.region(roi.height, roi.width);
+            frame_gray(roi).copyTo(workspace.binary);
+            threshold_frame(workspace.binary, workspace.thresh, roi.height, roi.width, segmentation_method, workspace.integral);
+            int detected_points = detect_pattern_points(workspace.binary, w, h, mask_point, pattern_points, keep_per_frames, roi.tl(), workspace);
+            // keep_per_frames is only restarted when the 20 points were found in this frame
+            if (detected_points == 20 && keep_per_frames == 2) {
+                tracker.update(pattern_points, true, workspace.detection.tracking);
+                return detected_points;
+            }
+            pattern_points = previous_points;
+            keep_per_frames = previous_keep;
+        }
+    }
+    workspace.region(w, h);
+    frame_gray.copyTo(workspace.binary);
+    threshold_frame(workspace.binary, workspace.thresh, w, h, segmentation_method, workspace.integral);
+    int detected_points = detect_pattern_points(workspace.binary, w, h, mask_point, pattern_points, keep_per_frames, Point(0, 0), workspace);
+    tracker.update(pattern_points, workspace.detection.points.size() == 20, workspace.detection.tracking);
+    return detected_points;
+}
+
+/**
+ * @details Same as detect_pattern_points_tracked, drawing the detection afterwards
+ *
+ * @param frame_gray Frame in grayscale, it is not modified
+ * @param masked Frame to draw the ellipses found
+ * @param original Frame to draw the ordered pattern
+ * @param w Frame width
+ * @param h Frame height
+ * @param mask_point Mask updated from the points found
+ * @param pattern_points Points tracked between frames
+ * @param keep_per_frames Frames to keep the last points when the pattern is lost
+ * @param segmentation_method SEGMENTATION_LEGACY or SEGMENTATION_FUSED
+ * @param tracker Motion model corrected with the points found
+ * @param workspace Buffers reused between frames
+ * @return Number of pattern points found
+ */
+int find_pattern_points_tracked(Mat &frame_gray, Mat &masked, Mat &original, int w, int h, Point mask_point[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, int segmentation_method, PatternTracker &tracker, DetectionWorkspace &workspace) {
+    int detected_points = detect_pattern_points_tracked(frame_gray, w, h, mask_point, pattern_points, keep_per_frames, segmentation_method, tracker, workspace);
+    draw_pattern_detection(workspace.binary, masked, original, workspace.detection);
+    return detected_points;
+}
+
 float distance(Point2f p1, Point2f p2) {
     return pow(p1.x - p2.x, 2) + pow(p1.y - p2.y, 2);
 }
@@ -244,12 +958,13 @@ float distance_to_rect(PatternPoint p1, PatternPoint p2, PatternPoint x) {
     return distance_to_rect(p1.to_point2f(), p2.to_point2f(), x.to_point2f());
 }
 /**
- * @details Calc the most distant points in a vector of points
+ * @details Calc the most distant points in a vector of points, original all pairs version
+ * kept as reference
  *
  * @param points Poinst to be evaluate
  * @return Most distant points order by x coordinate
  */
-vector<PatternPoint> more_distant_points(vector<PatternPoint> points) {
+vector<PatternPoint> more_distant_points_reference(vector<PatternPoint> points) {
     float distance = 0;
     double temp;
     int p1, p2;
@@ -276,83 +991,302 @@ vector<PatternPoint> more_distant_points(vector<PatternPoint> points) {
     p.push_back(points[p2]);
     return p;
 }
+double cross(const PatternPoint &o, const PatternPoint &a, const PatternPoint &b) {
+    return ((double)a.x - o.x) * ((double)b.y - o.y) - ((double)a.y - o.y) * ((double)b.x - o.x);
+}
+
+bool sort_pattern_point_by_xy(PatternPoint p1, PatternPoint p2) {
+    return p1.x < p2.x || (p1.x == p2.x && p1.y < p2.y);
+}
+
 /**
- * @details Draw lines patter in drawing Mat from a vector of points
+ * @details Convex hull of a vector of points using a monotone chain, collinear points
+ * in the border are removed
  *
- * @param drawing Mat to draw patter
- * @param pattern_centers Patter points found
+ * @param points Poinst to be evaluate
+ * @param sorted Buffer for the sorted points
+ * @param hull Hull vertexes in order
  */
-void order_points_and_track(Mat &drawing, vector<PatternPoint> &pattern_centers, vector<PatternPoint> new_pattern_points) {
-    if (new_pattern_points.size() < 20 && pattern_centers.size() < 20) {
-        return;
+void convex_hull(const vector<PatternPoint> &points, vector<PatternPoint> &sorted, vector<PatternPoint> &hull) {
+    int n = points.size();
+    sorted.assign(points.begin(), points.end());
+    sort(sorted.begin(), sorted.end(), sort_pattern_point_by_xy);
+    hull.resize(2 * n);
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        while (k >= 2 && cross(hull[k - 2], hull[k - 1], sorted[i]) <= 0) k--;
+        hull[k++] = sorted[i];
     }
-    vector<Scalar> color_palette(5);
-    color_palette[0] = Scalar(255, 0, 255);
-    color_palette[1] = Scalar(255, 0, 0);
-    color_palette[2] = Scalar(0, 255, 0);
-    color_palette[3] = Scalar(0, 0 , 255);
-    color_palette[4] = Scalar(255, 255 , 0);
+    for (int i = n - 2, lower = k + 1; i >= 0; i--) {
+        while (k >= lower && cross(hull[k - 2], hull[k - 1], sorted[i]) <= 0) k--;
+        hull[k++] = sorted[i];
+    }
+    hull.resize(max(1, k - 1));
+}
+
+vector<PatternPoint> convex_hull(const vector<PatternPoint> &points) {
+    vector<PatternPoint> sorted;
+    vector<PatternPoint> hull;
+    convex_hull(points, sorted, hull);
+    return hull;
+}
+
+/**
+ * @details Calc the most distant points in a vector of points, the farthest pair is searched
+ * with rotating calipers over the convex hull in O(n log n)
+ *
+ * @param points Poinst to be evaluate
+ * @return Most distant points order by x coordinate
+ */
+vector<PatternPoint> more_distant_points(vector<PatternPoint> points) {
+    vector<PatternPoint> hull = convex_hull(points);
 
+    int p1 = 0;
+    int p2 = hull.size() > 1 ? 1 : 0;
+    double distance = 0;
+    int m = hull.size();
+    if (m == 2) {
+        distance = hull[0].distance(hull[1]);
+    }
+    for (int i = 0, j = 1; m > 2 && i < m; i++) {
+        int i_next = (i + 1) % m;
+        // Advance j while the area against the edge (i, i_next) keeps growing
+        while (cross(hull[i], hull[i_next], hull[(j + 1) % m]) > cross(hull[i], hull[i_next], hull[j])) {
+            j = (j + 1) % m;
+        }
+        float d = hull[i].distance(hull[j]);
+        if (d > distance) {
+            distance = d;
+            p1 = i;
+            p2 = j;
+        }
+        d = hull[i_next].distance(hull[j]);
+        if (d > distance) {
+            distance = d;
+            p1 = i_next;
+            p2 = j;
+        }
+    }
+    if (hull[p1].x < hull[p2].x) {
+        swap(p1, p2);
+    }
+    vector<PatternPoint> p;
+    p.push_back(hull[p1]);
+    p.push_back(hull[p2]);
+    return p;
+}
+
+/**
+ * @details Order the points in the 5x4 grid searching every line with 5 points, the
+ * original O(n^3) method, used when the homography ordering can not be applied
+ *
+ * @param pattern_centers Ordered points
+ * @param new_pattern_points Points found in the frame
+ * @return True if the 4 rows were found
+ */
+bool order_grid_by_lines(vector<PatternPoint> &pattern_centers, const vector<PatternPoint> &new_pattern_points) {
     int coincidendes = 0;
-    int centers = pattern_centers.size();
+    int centers = new_pattern_points.size();
     float pattern_range = 2;
-    float distance;
     float min_distance;
-    int replace_point;
-    int line_color = 0;
     vector<PatternPoint> temp;
     vector<PatternPoint> line_points;
     vector<PatternPoint> limit_points;
     int rows = 0;
-    if (pattern_centers.size() == 0) {
-        centers = new_pattern_points.size();
-        for (int i = 0; i < centers; i++) {
-            for (int j = 0; j < centers; j++) {
-                if (i != j) {
-                    temp.clear();
-                    line_points.clear();
-                    coincidendes = 0;
-                    for (int k = 0; k < centers; k++) {
-                        min_distance = distance_to_rect(new_pattern_points[i], new_pattern_points[j], new_pattern_points[k]);
-                        if (min_distance < pattern_range) {
-                            coincidendes++;
-                            line_points.push_back(new_pattern_points[k]);
-                        }
+    for (int i = 0; i < centers; i++) {
+        for (int j = 0; j < centers; j++) {
+            if (i != j) {
+                temp.clear();
+                line_points.clear();
+                coincidendes = 0;
+                for (int k = 0; k < centers; k++) {
+                    min_distance = distance_to_rect(new_pattern_points[i], new_pattern_points[j], new_pattern_points[k]);
+                    if (min_distance < pattern_range) {
+                        coincidendes++;
+                        line_points.push_back(new_pattern_points[k]);
                     }
+                }
 
-                    if (coincidendes == 5) {
-                        sort(line_points.begin(), line_points.end(), sort_pattern_point_by_x);
-                        if (line_points[4].x - line_points[0].x < line_points[0].radio) {
-                            sort(line_points.begin(), line_points.end(), sort_pattern_point_by_y);
-                        }
-                        bool found = false;
-                        for (int l = 0; l < limit_points.size(); l++) {
-                            if (limit_points[l].x == line_points[0].x && limit_points[l].y == line_points[0].y) {
-                                found = true;
-                            }
+                if (coincidendes == 5) {
+                    sort(line_points.begin(), line_points.end(), sort_pattern_point_by_x);
+                    if (line_points[4].x - line_points[0].x < line_points[0].radio) {
+                        sort(line_points.begin(), line_points.end(), sort_pattern_point_by_y);
+                    }
+                    bool found = false;
+                    for (int l = 0; l < limit_points.size(); l++) {
+                        if (limit_points[l].x == line_points[0].x && limit_points[l].y == line_points[0].y) {
+                            found = true;
                         }
-                        if (!found) {
-                            rows++;
-                            for (int l = 0; l < line_points.size(); l++) {
-                                pattern_centers.push_back(line_points[l]);
-                                putText(drawing, to_string(pattern_centers.size() - 1), line_points[l].to_point2f()/*cvPoint(10, 30)*/, FONT_HERSHEY_COMPLEX_SMALL, 1, cvScalar(0, 0, 255), 2);
-
-                            }
-                            limit_points.push_back(line_points[0]);
-                            limit_points.push_back(line_points[4]);
+                    }
+                    if (!found) {
+                        rows++;
+                        for (int l = 0; l < line_points.size(); l++) {
+                            pattern_centers.push_back(line_points[l]);
                         }
+                        limit_points.push_back(line_points[0]);
+                        limit_points.push_back(line_points[4]);
                     }
                 }
             }
         }
-        if (rows != 4) {
-            //cout << "rows " << rows << endl;
-            pattern_centers.clear();
+    }
+    if (rows != 4) {
+        pattern_centers.clear();
+    }
+    return rows == 4;
+}
+
+/**
+ * @details Reduce a convex hull to the 4 corners of the board, removing every time the
+ * vertex that loses less area (the ones lying almost over a side)
+ *
+ * @param hull Convex hull vertexes in order, replaced by the 4 corners in hull order, or
+ * less if the hull is degenerate
+ */
+void hull_corners(vector<PatternPoint> &hull) {
+    while (hull.size() > 4) {
+        int n = hull.size();
+        int remove = 0;
+        double min_area = -1;
+        for (int i = 0; i < n; i++) {
+            double area = abs(cross(hull[(i + n - 1) % n], hull[i], hull[(i + 1) % n]));
+            if (min_area < 0 || area < min_area) {
+                min_area = area;
+                remove = i;
+            }
         }
-        //cout << "Elements checked " << distance_elements << " prom " << prom_distance / distance_elements << endl;
-    } else {
-        //cout << "Pattern Traking" << endl;
+        hull.erase(hull.begin() + remove);
+    }
+}
 
+/**
+ * @details Order the points in the 5x4 grid from the 4 corners of the convex hull, a
+ * homography maps every point to its lattice cell in O(n log n). Rows are sorted bottom
+ * first and every row by x (by y if the row is vertical), the same convention of
+ * avgColinearDistance and calibrate_with_points
+ *
+ * @param pattern_centers Ordered points
+ * @param new_pattern_points Points found in the frame, must be exactly 20
+ * @param buffers Buffers reused between frames
+ * @return True if every point was assigned to a different cell of the lattice
+ */
+bool order_grid_by_homography(vector<PatternPoint> &pattern_centers, const vector<PatternPoint> &new_pattern_points, GridOrderBuffers &buffers) {
+    const int cols = 5;
+    const int rows = 4;
+    float max_deviation = 0.35;
+    int n = new_pattern_points.size();
+    if (n != cols * rows) {
+        return false;
+    }
+    vector<PatternPoint> &corners = buffers.hull;
+    convex_hull(new_pattern_points, buffers.sorted, corners);
+    hull_corners(corners);
+    if (corners.size() != 4 || abs(cross(corners[0], corners[1], corners[2])) < 1) {
+        return false;
+    }
+
+    vector<Point2f> &image_points = buffers.image_points;
+    vector<Point2f> &lattice_points = buffers.lattice_points;
+    vector<int> &cell = buffers.cell;
+    image_points.resize(n);
+    cell.resize(n);
+    for (int i = 0; i < n; i++) {
+        image_points[i] = new_pattern_points[i].to_point2f();
+    }
+    Point2f lattice[4] = {Point2f(0, 0), Point2f(cols - 1, 0), Point2f(cols - 1, rows - 1), Point2f(0, rows - 1)};
+    bool assigned = false;
+    // the long side of the board can start in any of the two first corners
+    for (int start = 0; start < 2 && !assigned; start++) {
+        Point2f src[4];
+        for (int c = 0; c < 4; c++) {
+            src[c] = corners[(start + c) % 4].to_point2f();
+        }
+        Mat H = getPerspectiveTransform(src, lattice);
+        perspectiveTransform(image_points, lattice_points, H);
+
+        bool used[cols * rows] = {false};
+        assigned = true;
+        for (int i = 0; i < n && assigned; i++) {
+            int col = cvRound(lattice_points[i].x);
+            int row = cvRound(lattice_points[i].y);
+            if (col < 0 || col >= cols || row < 0 || row >= rows ||
+                abs(lattice_points[i].x - col) > max_deviation ||
+                abs(lattice_points[i].y - row) > max_deviation ||
+                used[row * cols + col]) {
+                assigned = false;
+                break;
+            }
+            used[row * cols + col] = true;
+            cell[i] = row * cols + col;
+        }
+    }
+    if (!assigned) {
+        return false;
+    }
+
+    vector<PatternPoint> &grid = buffers.grid;
+    grid.resize(n);
+    for (int i = 0; i < n; i++) {
+        grid[cell[i]] = new_pattern_points[i];
+    }
+    float min_y = FLT_MAX, max_y = -FLT_MAX;
+    pair<float, int> row_order[rows];
+    Point2f row_center[rows];
+    for (int r = 0; r < rows; r++) {
+        vector<PatternPoint>::iterator line = grid.begin() + r * cols;
+        sort(line, line + cols, sort_pattern_point_by_x);
+        if (line[cols - 1].x - line[0].x < line[0].radio) {
+            sort(line, line + cols, sort_pattern_point_by_y);
+        }
+        for (int c = 0; c < cols; c++) {
+            row_center[r] += line[c].to_point2f() * (1.0f / cols);
+        }
+        min_y = min(min_y, row_center[r].y);
+        max_y = max(max_y, row_center[r].y);
+    }
+    // bottom row first, left row first when the rows are vertical
+    bool vertical = max_y - min_y < grid[0].radio;
+    for (int r = 0; r < rows; r++) {
+        row_order[r] = make_pair(vertical ? row_center[r].x : -row_center[r].y, r);
+    }
+    sort(row_order, row_order + rows);
+
+    pattern_centers.clear();
+    for (int r = 0; r < rows; r++) {
+        int line = row_order[r].second * cols;
+        pattern_centers.insert(pattern_centers.end(), grid.begin() + line, grid.begin() + line + cols);
+    }
+    return true;
+}
+
+/**
+ * @details Order the new points in the 5x4 grid, or track the previous grid if there is one,
+ * without drawing anything
+ *
+ * @param pattern_centers Ordered points, updated with the new positions
+ * @param new_pattern_points Points found in the frame
+ * @param detection Detection result, stores the previous grid when tracking
+ * @param buffers Buffers of the grid ordering, reused between frames
+ */
+void order_points(vector<PatternPoint> &pattern_centers, const vector<PatternPoint> &new_pattern_points, PatternDetection &detection, GridOrderBuffers &buffers) {
+    detection.tracking = false;
+    detection.previous.clear();
+    if (new_pattern_points.size() < 20 && pattern_centers.size() < 20) {
+        return;
+    }
+
+    float distance;
+    float min_distance;
+    int replace_point;
+    if (pattern_centers.size() == 0) {
+        PROFILE_SCOPE(PROFILE_ORDERING);
+        if (!order_grid_by_homography(pattern_centers, new_pattern_points, buffers)) {
+            order_grid_by_lines(pattern_centers, new_pattern_points);
+        }
+    } else {
+        PROFILE_SCOPE(PROFILE_TRACKING);
+        detection.previous = pattern_centers;
+        detection.tracking = true;
         for (int p = 0; p < pattern_centers.size(); p++) {
             replace_point = 0;
             min_distance = 100;
@@ -363,44 +1297,150 @@ void order_points_and_track(Mat &drawing, vector<PatternPoint> &pattern_centers,
                     replace_point = n;
                 }
             }
-            if (min_distance > pattern_centers[p].radio) {
+            // gate around the previous (or predicted) point, every point is used only once
+            bool taken = false;
+            for (int q = 0; q < p; q++) {
+                if (pattern_centers[q].x == new_pattern_points[replace_point].x && pattern_centers[q].y == new_pattern_points[replace_point].y) {
+                    taken = true;
+                }
+            }
+            if (min_distance > pattern_centers[p].radio || taken) {
                 min_distance = -1;
                 break;
             }
-            //line(drawing, pattern_centers[p].to_point2f(), new_pattern_points[replace_point].to_point2f(), Scalar(0, 255, 255), 1);
-            //pattern_centers[p] = new_pattern_points[replace_point];
-            //putText(drawing, to_string(p), pattern_centers[p].to_point2f()/*cvPoint(10, 30)*/, FONT_HERSHEY_PLAIN, 2, cvScalar(0, 0, 255), 2, CV_AA);
-            circle(drawing, pattern_centers[p].to_point2f(), pattern_centers[p].radio/**1.5*/, Scalar(0, 255, 255), 1);
-            line(drawing, pattern_centers[p].to_point2f(), new_pattern_points[replace_point].to_point2f(), Scalar(0, 255, 255), 1);
             pattern_centers[p] = new_pattern_points[replace_point];
-            putText(drawing, to_string(p), pattern_centers[p].to_point2f()/*cvPoint(10, 30)*/, FONT_HERSHEY_COMPLEX_SMALL, 1, cvScalar(0, 0, 255), 2);
         }
-        //cout << "Elements checked " << distance_elements << " prom " << prom_distance / distance_elements << endl;
         if (min_distance == -1) {
             pattern_centers.clear();
             return;
         }
+    }
+}
 
+void order_points(vector<PatternPoint> &pattern_centers, const vector<PatternPoint> &new_pattern_points, PatternDetection &detection) {
+    GridOrderBuffers buffers;
+    order_points(pattern_centers, new_pattern_points, detection, buffers);
+}
 
+/**
+ * @details Draw lines patter in drawing Mat from a vector of points
+ *
+ * @param drawing Mat to draw patter
+ * @param pattern_centers Patter points found
+ */
+void order_points_and_track(Mat &drawing, vector<PatternPoint> &pattern_centers, vector<PatternPoint> new_pattern_points) {
+    PatternDetection detection;
+    detection.clear();
+    order_points(pattern_centers, new_pattern_points, detection);
+    detection.ordered = pattern_centers;
+    draw_pattern_order(drawing, detection);
+}
+
+/**
+ * @details Draw the ordered grid, the tracking displacement and the point indexes
+ *
+ * @param drawing Mat to draw patter
+ * @param detection Detection result
+ */
+void draw_pattern_order(Mat &drawing, const PatternDetection &detection) {
+    const vector<PatternPoint> &pattern_centers = detection.ordered;
+    if (pattern_centers.size() != 20) {
+        return;
     }
-    if (pattern_centers.size() == 20) {
-        //avgColinearDistance(pattern_centers);
-        line(drawing, pattern_centers[0].to_point2f() , pattern_centers[4].to_point2f() , color_palette[0], 1);
-        line(drawing, pattern_centers[5].to_point2f() , pattern_centers[4].to_point2f() , color_palette[1], 1);
-        line(drawing, pattern_centers[5].to_point2f() , pattern_centers[9].to_point2f() , color_palette[1], 1);
-        line(drawing, pattern_centers[10].to_point2f(), pattern_centers[9].to_point2f() , color_palette[2], 1);
-        line(drawing, pattern_centers[10].to_point2f(), pattern_centers[14].to_point2f(), color_palette[2], 1);
-        line(drawing, pattern_centers[15].to_point2f(), pattern_centers[14].to_point2f(), color_palette[3], 1);
-        line(drawing, pattern_centers[15].to_point2f(), pattern_centers[19].to_point2f(), color_palette[3], 1);
+    vector<Scalar> color_palette(5);
+    color_palette[0] = Scalar(255, 0, 255);
+    color_palette[1] = Scalar(255, 0, 0);
+    color_palette[2] = Scalar(0, 255, 0);
+    color_palette[3] = Scalar(0, 0 , 255);
+    color_palette[4] = Scalar(255, 255 , 0);
 
-        line(drawing, pattern_centers[0].to_point2f(), pattern_centers[15].to_point2f(), color_palette[4], 1);
-        line(drawing, pattern_centers[1].to_point2f(), pattern_centers[16].to_point2f(), color_palette[4], 1);
-        line(drawing, pattern_centers[2].to_point2f(), pattern_centers[17].to_point2f(), color_palette[4], 1);
-        line(drawing, pattern_centers[3].to_point2f(), pattern_centers[18].to_point2f(), color_palette[4], 1);
-        line(drawing, pattern_centers[4].to_point2f(), pattern_centers[19].to_point2f(), color_palette[4], 1);
+    for (int p = 0; p < pattern_centers.size(); p++) {
+        if (detection.tracking && p < detection.previous.size()) {
+            PatternPoint previous = detection.previous[p];
+            circle(drawing, previous.to_point2f(), previous.radio, Scalar(0, 255, 255), 1);
+            line(drawing, previous.to_point2f(), pattern_centers[p].center(), Scalar(0, 255, 255), 1);
+        }
+        PatternPoint point = pattern_centers[p];
+        putText(drawing, to_string(p), point.to_point2f(), FONT_HERSHEY_COMPLEX_SMALL, 1, cvScalar(0, 0, 255), 2);
+    }
 
+    vector<Point2f> c(20);
+    for (int p = 0; p < 20; p++) {
+        PatternPoint point = pattern_centers[p];
+        c[p] = point.to_point2f();
     }
+    line(drawing, c[0] , c[4] , color_palette[0], 1);
+    line(drawing, c[5] , c[4] , color_palette[1], 1);
+    line(drawing, c[5] , c[9] , color_palette[1], 1);
+    line(drawing, c[10], c[9] , color_palette[2], 1);
+    line(drawing, c[10], c[14], color_palette[2], 1);
+    line(drawing, c[15], c[14], color_palette[3], 1);
+    line(drawing, c[15], c[19], color_palette[3], 1);
+
+    line(drawing, c[0], c[15], color_palette[4], 1);
+    line(drawing, c[1], c[16], color_palette[4], 1);
+    line(drawing, c[2], c[17], color_palette[4], 1);
+    line(drawing, c[3], c[18], color_palette[4], 1);
+    line(drawing, c[4], c[19], color_palette[4], 1);
+}
+
+/**
+ * @details Draw a detection result, this is the only place where the detection is rendered
+ *
+ * @param binary Segmented image, the ellipses are drawn over it (can be empty)
+ * @param masked Frame to draw the ellipses found
+ * @param original Frame to draw the ordered pattern
+ * @param detection Detection result
+ */
+void draw_pattern_detection(Mat &binary, Mat &masked, Mat &original, const PatternDetection &detection) {
+    Scalar purple(255, 0, 255);
+    Scalar red(0, 0, 255);
+    Scalar yellow(0, 255, 255);
+    Scalar blue(255, 0, 0);
+    Scalar green(0, 255, 0);
+    Scalar white(255, 255, 255);
 
+    if (!binary.empty()) {
+        Point2f offset(detection.offset.x, detection.offset.y);
+        for (int e = 0; e < detection.fathers.size(); e++) {
+            RotatedRect father = detection.fathers[e];
+            RotatedRect son = detection.sons[e];
+            ellipse(binary, RotatedRect(father.center - offset, father.size, father.angle), white, 2);
+            ellipse(binary, RotatedRect(son.center - offset, son.size, son.angle), white, 2);
+        }
+        for (int e = 0; e < detection.singles.size(); e++) {
+            RotatedRect single = detection.singles[e];
+            ellipse(binary, RotatedRect(single.center - offset, single.size, single.angle), white, 2);
+        }
+    }
+    if (!masked.empty()) {
+        for (int e = 0; e < detection.fathers.size(); e++) {
+            ellipse(masked, detection.sons[e], red, 2);
+            ellipse(masked, detection.fathers[e], yellow, 2);
+        }
+        for (int e = 0; e < detection.singles.size(); e++) {
+            ellipse(masked, detection.singles[e], purple, 2);
+        }
+        for (int n = 0; n < detection.neighbors.size(); n++) {
+            PatternPoint p1 = detection.candidates[detection.neighbors[n][0]];
+            PatternPoint p2 = detection.candidates[detection.neighbors[n][1]];
+            line(masked, p1.center(), p2.center(), red, 1);
+        }
+        for (int e = 0; e < detection.near.size(); e++) {
+            PatternPoint p = detection.near[e];
+            circle(masked, p.center(), p.radio, blue, 5);
+        }
+        if (detection.has_father_ellipse) {
+            ellipse(masked, detection.father_ellipse, white, 5);
+        }
+        for (int e = 0; e < detection.points.size(); e++) {
+            PatternPoint p = detection.points[e];
+            circle(masked, p.center(), p.radio, green, 5);
+        }
+    }
+    if (!original.empty()) {
+        draw_pattern_order(original, detection);
+    }
 }
 
 /**
@@ -410,8 +1450,9 @@ void order_points_and_track(Mat &drawing, vector<PatternPoint> &pattern_centers,
  * @param w Original image width
  * @param h Original image height
  * @param mask_point Array which store mask points
+ * @param points_2f Buffer for the points, reused between frames
  */
-void update_mask_from_points(vector<PatternPoint> points, int w, int h, Point mask_point[][4]) {
+void update_mask_from_points(const vector<PatternPoint> &points, int w, int h, Point mask_point[][4], vector<Point2f> &points_2f) {
     if (points.size() < 20) {
         mask_point[0][0]  = Point(0, 0);
         mask_point[0][1]  = Point(h, 0);
@@ -419,7 +1460,7 @@ void update_mask_from_points(vector<PatternPoint> points, int w, int h, Point ma
         mask_point[0][3]  = Point(0, w);
         return;
     }
-    vector<Point2f> points_2f(points.size());
+    points_2f.resize(points.size());
     for (int p = 0; p < points.size(); p++) {
         points_2f[p] = Point2f(points[p].x, points[p].y);
     }
@@ -443,6 +1484,11 @@ void update_mask_from_points(vector<PatternPoint> points, int w, int h, Point ma
     mask_point[0][3]  = Point((rect_points[3].x - mask_center.x) * scale + mask_center.x, (rect_points[3].y - mask_center.y) * scale + mask_center.y);
 }
 
+void update_mask_from_points(const vector<PatternPoint> &points, int w, int h, Point mask_point[][4]) {
+    vector<Point2f> points_2f;
+    update_mask_from_points(points, w, h, mask_point, points_2f);
+}
+
 float avgColinearDistance(vector<PatternPoint> &points) {
     vector<Point2f> temp(20);
     for (int p = 0; p < 20; p++) {
@@ -0,0 +1,429 @@
+#pragma once
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+using namespace cv;
+using namespace std;
+
+/* Fixed point iterations of the undistortion of the image points, as undistortPoints */
+#define PLANAR_POSE_UNDISTORT_ITERATIONS 5
+/* Gauss-Newton iterations over the reprojection error after the closed form, 0 keeps it */
+#define PLANAR_POSE_REFINE_ITERATIONS 3
+
+/**
+ * @details Pose of a planar board (z = 0) in the camera, X_camera = R * X_board + t
+ */
+struct PlanarPose {
+    double R[9];                        // Rotation, row major
+    double t[3];                        // Translation, in the units of the object points
+    bool valid;                         // The pose could be computed
+
+    PlanarPose() : valid(false) {}
+};
+
+/**
+ * @details Product of two 3x3 row major matrices, out can not be a or b
+ */
+void mat3_mul(const double a[9], const double b[9], double out[9]) {
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            out[r * 3 + c] = a[r * 3] * b[c] + a[r * 3 + 1] * b[3 + c] + a[r * 3 + 2] * b[6 + c];
+        }
+    }
+}
+
+/**
+ * @details Euler angles in degrees of a rotation, the same values decomposeProjectionMatrix
+ * gives for [R | 0]. The Givens rotations of RQDecomp3x3 and its sign ambiguity are
+ * computed in place, without the six Mats of decomposeProjectionMatrix
+ *
+ * @param R Rotation, row major
+ * @param euler_angles Rotations around x, y and z in degrees
+ */
+void rotation_euler_angles(const double R[9], Vec3d &euler_angles) {
+    double m[9], q[9];
+    double c, s, z;
+
+    /* Rotation around x that zeroes m32 */
+    s = R[7];
+    c = R[8];
+    z = 1. / sqrt(c * c + s * s + DBL_EPSILON);
+    double qx[9] = {1, 0, 0, 0, c * z, s * z, 0, -s * z, c * z};
+    mat3_mul(R, qx, q);
+
+    /* Rotation around y that zeroes m31 */
+    s = -q[6];
+    c = q[8];
+    z = 1. / sqrt(c * c + s * s + DBL_EPSILON);
+    double qy[9] = {c * z, 0, -s * z, 0, 1, 0, s * z, 0, c * z};
+    mat3_mul(q, qy, m);
+
+    /* Rotation around z that zeroes m21 */
+    s = m[3];
+    c = m[4];
+    z = 1. / sqrt(c * c + s * s + DBL_EPSILON);
+    double qz[9] = {c * z, s * z, 0, -s * z, c * z, 0, 0, 0, 1};
+    mat3_mul(m, qz, q);
+
+    /* The diagonal of the triangular factor is made positive with a rotation of 180 degrees,
+     * only the entries read by the angles are updated */
+    if (q[0] < 0) {
+        if (q[4] < 0) {
+            qz[0] = -qz[0];
+            qz[1] = -qz[1];
+        } else {
+            qz[1] = qz[3];
+            qy[0] = -qy[0];
+            qy[6] = -qy[6];
+        }
+    } else if (q[4] < 0) {
+        qz[1] = qz[3];
+        qy[6] = qy[2];
+        qx[4] = -qx[4];
+        qx[5] = -qx[5];
+    }
+    euler_angles[0] = acos(qx[4]) * (qx[5] >= 0 ? 1 : -1) * (180.0 / CV_PI);
+    euler_angles[1] = acos(qy[0]) * (qy[6] >= 0 ? 1 : -1) * (180.0 / CV_PI);
+    euler_angles[2] = acos(qz[0]) * (qz[1] >= 0 ? 1 : -1) * (180.0 / CV_PI);
+}
+
+/**
+ * @details Solve a n x n linear system in place with Gaussian elimination and partial pivoting
+ *
+ * @param a Row major matrix, it is destroyed
+ * @param b Right hand side, the solution on return
+ * @param n Size of the system, at most 8
+ * @return false if the matrix is singular
+ */
+bool solve_linear_system(double *a, double *b, int n) {
+    for (int k = 0; k < n; k++) {
+        int pivot = k;
+        for (int r = k + 1; r < n; r++) {
+            if (fabs(a[r * n + k]) > fabs(a[pivot * n + k])) {
+                pivot = r;
+            }
+        }
+        if (fabs(a[pivot * n + k]) < 1e-12) {
+            return false;
+        }
+        if (pivot != k) {
+            for (int c = 0; c < n; c++) {
+                swap(a[k * n + c], a[pivot * n + c]);
+            }
+            swap(b[k], b[pivot]);
+        }
+        for (int r = k + 1; r < n; r++) {
+            double f = a[r * n + k] / a[k * n + k];
+            for (int c = k; c < n; c++) {
+                a[r * n + c] -= f * a[k * n + c];
+            }
+            b[r] -= f * b[k];
+        }
+    }
+    for (int k = n - 1; k >= 0; k--) {
+        for (int c = k + 1; c < n; c++) {
+            b[k] -= a[k * n + c] * b[c];
+        }
+        b[k] /= a[k * n + k];
+    }
+    return true;
+}
+
+/**
+ * @details Closed form pose of a planar board, replacement of solvePnP followed by Rodrigues
+ * when only the orientation is needed. The image points are undistorted to normalized
+ * coordinates, the homography from the board plane is fitted by least squares over the
+ * normalized points (Hartley normalization, h33 = 1) and decomposed into R and t, the
+ * first two columns of R are made orthonormal symmetrically.
+ *
+ * The camera is read once and the buffer only grows, after the first frame nothing is
+ * allocated, so one solver can be used over many frames. It can not be shared between threads
+ */
+struct PlanarPoseSolver {
+    double fx, fy, cx, cy;              // Camera matrix, the skew is ignored as in undistortPoints
+    double k[8];                        // k1 k2 p1 p2 k3 k4 k5 k6, missing terms are 0
+    vector<Point2d> normalized;         // Undistorted image points of the last frame
+
+    PlanarPoseSolver() : fx(1), fy(1), cx(0), cy(0) {
+        for (int i = 0; i < 8; i++) {
+            k[i] = 0;
+        }
+    }
+
+    PlanarPoseSolver(const Mat &camera_matrix, const Mat &dist_coeffs) {
+        set_camera(camera_matrix, dist_coeffs);
+    }
+
+    /**
+     * @details Read the calibration used for the next frames
+     *
+     * @param camera_matrix Camera matrix (CV_64F)
+     * @param dist_coeffs Distortion coefficients (CV_64F, 4, 5 or 8 terms), empty if the
+     * points are already undistorted
+     */
+    void set_camera(const Mat &camera_matrix, const Mat &dist_coeffs) {
+        fx = camera_matrix.at<double>(0, 0);
+        fy = camera_matrix.at<double>(1, 1);
+        cx = camera_matrix.at<double>(0, 2);
+        cy = camera_matrix.at<double>(1, 2);
+        int n = dist_coeffs.rows * dist_coeffs.cols;
+        const double *d = n ? dist_coeffs.ptr<double>() : 0;
+        for (int i = 0; i < 8; i++) {
+            k[i] = i < n ? d[i] : 0;
+        }
+    }
+
+    /**
+     * @details Normalized undistorted coordinates of a pixel, the iterations of undistortPoints
+     */
+    Point2d undistort(const Point2f &pixel) const {
+        double x0 = (pixel.x - cx) / fx;
+        double y0 = (pixel.y - cy) / fy;
+        double x = x0, y = y0;
+        for (int it = 0; it < PLANAR_POSE_UNDISTORT_ITERATIONS; it++) {
+            double r2 = x * x + y * y;
+            double icdist = (1 + ((k[7] * r2 + k[6]) * r2 + k[5]) * r2) / (1 + ((k[4] * r2 + k[1]) * r2 + k[0]) * r2);
+            double dx = 2 * k[2] * x * y + k[3] * (r2 + 2 * x * x);
+            double dy = k[2] * (r2 + 2 * y * y) + 2 * k[3] * x * y;
+            x = (x0 - dx) * icdist;
+            y = (y0 - dy) * icdist;
+        }
+        return Point2d(x, y);
+    }
+
+    /**
+     * @details Homography from the board plane to the normalized image, fitted over the
+     * points of normalized
+     *
+     * @param object_points Points of the board, z is ignored
+     * @param H Homography, row major
+     * @return false with less than 4 points or a degenerate configuration
+     */
+    bool homography(const vector<Point3f> &object_points, double H[9]) const {
+        int n = object_points.size();
+        if (n < 4 || normalized.size() < n) {
+            return false;
+        }
+        /* Both point sets centered at the origin with a mean distance of sqrt(2) */
+        double ox = 0, oy = 0, ix = 0, iy = 0;
+        for (int p = 0; p < n; p++) {
+            ox += object_points[p].x;
+            oy += object_points[p].y;
+            ix += normalized[p].x;
+            iy += normalized[p].y;
+        }
+        ox /= n;
+        oy /= n;
+        ix /= n;
+        iy /= n;
+        double od = 0, id = 0;
+        for (int p = 0; p < n; p++) {
+            od += sqrt((object_points[p].x - ox) * (object_points[p].x - ox) + (object_points[p].y - oy) * (object_points[p].y - oy));
+            id += sqrt((normalized[p].x - ix) * (normalized[p].x - ix) + (normalized[p].y - iy) * (normalized[p].y - iy));
+        }
+        if (od < DBL_EPSILON || id < DBL_EPSILON) {
+            return false;
+        }
+        double os = sqrt(2.) * n / od;
+        double is = sqrt(2.) * n / id;
+
+        /* Normal equations of the 8 unknowns, two rows per point */
+        double ata[64] = {0};
+        double atb[8] = {0};
+        for (int p = 0; p < n; p++) {
+            double X = (object_points[p].x - ox) * os;
+            double Y = (object_points[p].y - oy) * os;
+            double x = (normalized[p].x - ix) * is;
+            double y = (normalized[p].y - iy) * is;
+            double row_x[8] = {X, Y, 1, 0, 0, 0, -x * X, -x * Y};
+            double row_y[8] = {0, 0, 0, X, Y, 1, -y * X, -y * Y};
+            for (int r = 0; r < 8; r++) {
+                for (int c = r; c < 8; c++) {
+                    ata[r * 8 + c] += row_x[r] * row_x[c] + row_y[r] * row_y[c];
+                }
+                atb[r] += row_x[r] * x + row_y[r] * y;
+            }
+        }
+        for (int r = 1; r < 8; r++) {
+            for (int c = 0; c < r; c++) {
+                ata[r * 8 + c] = ata[c * 8 + r];
+            }
+        }
+        if (!solve_linear_system(ata, atb, 8)) {
+            return false;
+        }
+
+        /* H = T_image^-1 * Hn * T_object */
+        double hn[9] = {atb[0], atb[1], atb[2], atb[3], atb[4], atb[5], atb[6], atb[7], 1};
+        double t_object[9] = {os, 0, -os * ox, 0, os, -os * oy, 0, 0, 1};
+        double t_image_inv[9] = {1 / is, 0, ix, 0, 1 / is, iy, 0, 0, 1};
+        double temp[9];
+        mat3_mul(hn, t_object, temp);
+        mat3_mul(t_image_inv, temp, H);
+        return true;
+    }
+
+    /**
+     * @details Pose of the board in a frame
+     *
+     * @param object_points Points of the board, z = 0
+     * @param image_points Points found in the frame, in the same order
+     * @param pose Rotation and translation, pose.valid is false if it could not be computed
+     * @return pose.valid
+     */
+    bool solve(const vector<Point3f> &object_points, const vector<Point2f> &image_points, PlanarPose &pose) {
+        pose.valid = false;
+        int n = image_points.size();
+        normalized.resize(n);
+        for (int p = 0; p < n; p++) {
+            normalized[p] = undistort(image_points[p]);
+        }
+        double H[9];
+        if (n != object_points.size() || !homography(object_points, H)) {
+            return false;
+        }
+
+        /* H ~ [r1 r2 t], the scale is the mean norm of the first two columns and its sign
+         * puts the board in front of the camera */
+        double n1 = sqrt(H[0] * H[0] + H[3] * H[3] + H[6] * H[6]);
+        double n2 = sqrt(H[1] * H[1] + H[4] * H[4] + H[7] * H[7]);
+        if (n1 < DBL_EPSILON || n2 < DBL_EPSILON) {
+            return false;
+        }
+        double lambda = (H[8] < 0 ? -2 : 2) / (n1 + n2);
+
+        /* Unit columns, their bisectors c and d are orthogonal and give the closest
+         * orthonormal pair symmetrically */
+        double a[3] = {H[0] / n1, H[3] / n1, H[6] / n1};
+        double b[3] = {H[1] / n2, H[4] / n2, H[7] / n2};
+        double c[3] = {a[0] + b[0], a[1] + b[1], a[2] + b[2]};
+        double d[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+        double nc = sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+        double nd = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        if (nc < DBL_EPSILON || nd < DBL_EPSILON) {
+            return false;
+        }
+        double sign = lambda < 0 ? -1 : 1;
+        double r1[3], r2[3];
+        for (int i = 0; i < 3; i++) {
+            r1[i] = sign * (c[i] / nc + d[i] / nd) / sqrt(2.);
+            r2[i] = sign * (c[i] / nc - d[i] / nd) / sqrt(2.);
+        }
+        double r3[3] = {r1[1] * r2[2] - r1[2] * r2[1], r1[2] * r2[0] - r1[0] * r2[2], r1[0] * r2[1] - r1[1] * r2[0]};
+        for (int i = 0; i < 3; i++) {
+            pose.R[i * 3] = r1[i];
+            pose.R[i * 3 + 1] = r2[i];
+            pose.R[i * 3 + 2] = r3[i];
+            pose.t[i] = lambda * H[i * 3 + 2];
+        }
+        pose.valid = true;
+        for (int it = 0; it < PLANAR_POSE_REFINE_ITERATIONS; it++) {
+            refine(object_points, pose);
+        }
+        return true;
+    }
+
+    /**
+     * @details One Gauss-Newton step of the pose over the reprojection error in normalized
+     * coordinates, R is updated by a rotation w on the left so it stays orthonormal
+     *
+     * @param object_points Points of the board, z = 0
+     * @param pose Pose updated, its image points are the ones of normalized
+     */
+    void refine(const vector<Point3f> &object_points, PlanarPose &pose) const {
+        double jtj[36] = {0};
+        double jtr[6] = {0};
+        for (int p = 0; p < object_points.size(); p++) {
+            double X = object_points[p].x, Y = object_points[p].y;
+            /* Rotated point and point in the camera */
+            double rx = pose.R[0] * X + pose.R[1] * Y;
+            double ry = pose.R[3] * X + pose.R[4] * Y;
+            double rz = pose.R[6] * X + pose.R[7] * Y;
+            double cx = rx + pose.t[0], cy = ry + pose.t[1], cz = rz + pose.t[2];
+            if (cz < DBL_EPSILON) {
+                return;
+            }
+            double iz = 1 / cz;
+            double u = cx * iz, v = cy * iz;
+            double res[2] = {u - normalized[p].x, v - normalized[p].y};
+            /* d(u, v)/d(camera point) times d(camera point)/d(w, t), with d/dw = -[RX]x */
+            double du[3] = {iz, 0, -u * iz};
+            double dv[3] = {0, iz, -v * iz};
+            double j[2][6];
+            const double *d[2] = {du, dv};
+            for (int k = 0; k < 2; k++) {
+                j[k][0] = d[k][1] * -rz + d[k][2] * ry;
+                j[k][1] = d[k][0] * rz + d[k][2] * -rx;
+                j[k][2] = d[k][0] * -ry + d[k][1] * rx;
+                j[k][3] = d[k][0];
+                j[k][4] = d[k][1];
+                j[k][5] = d[k][2];
+            }
+            for (int k = 0; k < 2; k++) {
+                for (int r = 0; r < 6; r++) {
+                    for (int c = 0; c < 6; c++) {
+                        jtj[r * 6 + c] += j[k][r] * j[k][c];
+                    }
+                    jtr[r] -= j[k][r] * res[k];
+                }
+            }
+        }
+        if (!solve_linear_system(jtj, jtr, 6)) {
+            return;
+        }
+
+        /* R = exp([w]x) * R with the Rodrigues formula */
+        double theta = sqrt(jtr[0] * jtr[0] + jtr[1] * jtr[1] + jtr[2] * jtr[2]);
+        double a = theta > DBL_EPSILON ? sin(theta) / theta : 1;
+        double b = theta > DBL_EPSILON ? (1 - cos(theta)) / (theta * theta) : 0.5;
+        double wx = jtr[0], wy = jtr[1], wz = jtr[2];
+        double e[9] = {1 - b * (wy * wy + wz * wz), -a * wz + b * wx * wy, a * wy + b * wx * wz,
+                       a * wz + b * wx * wy, 1 - b * (wx * wx + wz * wz), -a * wx + b * wy * wz,
+                       -a * wy + b * wx * wz, a * wx + b * wy * wz, 1 - b * (wx * wx + wy * wy)
+                      };
+        double rotated[9];
+        mat3_mul(e, pose.R, rotated);
+        for (int i = 0; i < 9; i++) {
+            pose.R[i] = rotated[i];
+        }
+        for (int i = 0; i < 3; i++) {
+            pose.t[i] += jtr[3 + i];
+        }
+    }
+
+    /**
+     * @details Euler angles of the board in a frame, the same convention as rotation_euler_angles
+     *
+     * @param object_points Points of the board, z = 0
+     * @param image_points Points found in the frame, in the same order
+     * @param euler_angles Rotations around x, y and z in degrees
+     * @return false if the pose could not be computed
+     */
+    bool euler_angles(const vector<Point3f> &object_points, const vector<Point2f> &image_points, Vec3d &euler_angles) {
+        PlanarPose pose;
+        if (!solve(object_points, image_points, pose)) {
+            return false;
+        }
+        rotation_euler_angles(pose.R, euler_angles);
+        return true;
+    }
+
+    /**
+     * @details Poses of the board in many frames with the same camera
+     *
+     * @param object_points Points of the board, z = 0
+     * @param image_points Points found in every frame
+     * @param poses Pose of every frame, the buffer is reused
+     * @return Number of valid poses
+     */
+    int solve_batch(const vector<Point3f> &object_points, const vector<vector<Point2f> > &image_points, vector<PlanarPose> &poses) {
+        poses.resize(image_points.size());
+        int valid = 0;
+        for (int f = 0; f < image_points.size(); f++) {
+            valid += solve(object_points, image_points[f], poses[f]);
+        }
+        return valid;
+    }
+};
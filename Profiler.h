@@ -0,0 +1,358 @@
+#pragma once
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <stdint.h>
+
+using namespace std;
+
+/* Set to 0 to compile the PROFILE_SCOPE instrumentation out */
+#ifndef PROFILER
+#define PROFILER 1
+#endif
+
+/* Events kept per thread for the trace, the oldest are overwritten */
+#define PROFILER_BUFFER_SIZE 16384
+/* Histogram buckets, bucket 0 is under 1us and bucket b is [2^(b-1), 2^b) us */
+#define PROFILER_BUCKETS 32
+
+/* Pipeline stages */
+#define PROFILE_FRAME             0
+#define PROFILE_DECODE            1
+#define PROFILE_UNDISTORT         2
+#define PROFILE_THRESHOLD         3
+#define PROFILE_CONTOUR           4
+#define PROFILE_ELLIPSE_FIT       5
+#define PROFILE_ORDERING          6
+#define PROFILE_TRACKING          7
+#define PROFILE_SADDLE_FILTERING  8
+#define PROFILE_SADDLE_REFINEMENT 9
+#define PROFILE_CLUSTERING        10
+#define PROFILE_GRID_SEARCH       11
+#define PROFILE_CALIBRATE         12
+#define PROFILE_SHARPNESS         13
+#define PROFILE_STAGES            14
+
+static const char *const profile_stage_names[PROFILE_STAGES] = {
+    "frame", "decode", "undistort", "threshold", "contour", "ellipse_fit", "ordering", "tracking",
+    "saddle_filtering", "saddle_refinement", "clustering", "grid_search", "calibrateCamera", "sharpness"
+};
+
+/**
+ * @details One timed scope, nanoseconds since the start of the profiler
+ */
+struct ProfileEvent {
+    int stage;
+    int64_t start;
+    int64_t duration;
+};
+
+/**
+ * @details Events and histograms of one thread. Only the owner thread writes them, the
+ * counters are atomic so the histograms can be read while the threads are running
+ */
+struct ProfileBuffer {
+    int lane;                                   // Trace lane, buffers are reused by new threads
+    vector<ProfileEvent> events;                // Ring buffer of the last events
+    atomic<uint64_t> written;                   // Events written since the start
+    atomic<uint64_t> count[PROFILE_STAGES];
+    atomic<uint64_t> total_ns[PROFILE_STAGES];
+    atomic<uint64_t> max_ns[PROFILE_STAGES];
+    atomic<uint64_t> buckets[PROFILE_STAGES][PROFILER_BUCKETS];
+    int64_t last_ns[PROFILE_STAGES];            // Last duration of every stage in this thread
+
+    ProfileBuffer(int lane) : lane(lane), events(PROFILER_BUFFER_SIZE) {
+        clear();
+    }
+
+    void clear() {
+        written.store(0);
+        for (int s = 0; s < PROFILE_STAGES; s++) {
+            count[s].store(0);
+            total_ns[s].store(0);
+            max_ns[s].store(0);
+            last_ns[s] = 0;
+            for (int b = 0; b < PROFILER_BUCKETS; b++) {
+                buckets[s][b].store(0);
+            }
+        }
+    }
+};
+
+/**
+ * @details Buffers of all the threads. A thread takes a free buffer the first time it
+ * records an event and gives it back when it ends, so the short lived workers of
+ * WorkStealingPool do not allocate a buffer per batch
+ */
+struct Profiler {
+    atomic<bool> enabled;
+    chrono::steady_clock::time_point epoch;
+    mutex lock;
+    vector<ProfileBuffer *> buffers;
+    vector<ProfileBuffer *> free_buffers;
+
+    Profiler() : enabled(true), epoch(chrono::steady_clock::now()) {}
+};
+
+Profiler &profiler() {
+    static Profiler instance;
+    return instance;
+}
+
+/**
+ * @details Owner of the buffer of the current thread
+ */
+struct ProfileThread {
+    ProfileBuffer *buffer;
+
+    ProfileThread() : buffer(0) {}
+
+    ~ProfileThread() {
+        if (buffer) {
+            Profiler &p = profiler();
+            lock_guard<mutex> guard(p.lock);
+            p.free_buffers.push_back(buffer);
+        }
+    }
+};
+
+ProfileBuffer &profile_buffer() {
+    static thread_local ProfileThread thread;
+    if (!thread.buffer) {
+        Profiler &p = profiler();
+        lock_guard<mutex> guard(p.lock);
+        if (p.free_buffers.empty()) {
+            p.buffers.push_back(new ProfileBuffer(p.buffers.size()));
+            thread.buffer = p.buffers.back();
+        } else {
+            thread.buffer = p.free_buffers.back();
+            p.free_buffers.pop_back();
+        }
+    }
+    return *thread.buffer;
+}
+
+inline int64_t profile_now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - profiler().epoch).count();
+}
+
+/**
+ * @details Store a timed scope in the buffer of the current thread
+ *
+ * @param stage PROFILE_* stage
+ * @param start Start time from profile_now
+ * @param duration Duration in nanoseconds
+ */
+void profile_record(int stage, int64_t start, int64_t duration) {
+    ProfileBuffer &buffer = profile_buffer();
+    uint64_t n = buffer.written.load(memory_order_relaxed);
+    ProfileEvent &event = buffer.events[n % PROFILER_BUFFER_SIZE];
+    event.stage = stage;
+    event.start = start;
+    event.duration = duration;
+    buffer.written.store(n + 1, memory_order_release);
+
+    /* Single writer, plain load and store instead of a locked add */
+    uint64_t us = duration / 1000;
+    int bucket = 0;
+    while (us && bucket < PROFILER_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    buffer.count[stage].store(buffer.count[stage].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    buffer.total_ns[stage].store(buffer.total_ns[stage].load(memory_order_relaxed) + duration, memory_order_relaxed);
+    if (buffer.max_ns[stage].load(memory_order_relaxed) < (uint64_t)duration) {
+        buffer.max_ns[stage].store(duration, memory_order_relaxed);
+    }
+    buffer.buckets[stage][bucket].store(buffer.buckets[stage][bucket].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    buffer.last_ns[stage] = duration;
+}
+
+/**
+ * @details Time a scope and record it as a stage when it ends, stop() records it before
+ */
+class ProfileScope {
+public:
+    ProfileScope(int stage) : stage(stage), start(PROFILER && profiler().enabled.load(memory_order_relaxed) ? profile_now() : -1) {}
+
+    ~ProfileScope() {
+        stop();
+    }
+
+    void stop() {
+        if (start >= 0) {
+            profile_record(stage, start, profile_now() - start);
+            start = -1;
+        }
+    }
+
+private:
+    int stage;
+    int64_t start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#if PROFILER
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+#else
+#define PROFILE_SCOPE(stage)
+#endif
+
+void profiler_enable(bool enabled) {
+    profiler().enabled.store(enabled);
+}
+
+/**
+ * @details Last duration of a stage in the current thread
+ */
+double profile_last_ms(int stage) {
+    return profile_buffer().last_ns[stage] / 1e6;
+}
+
+/**
+ * @details Aggregated histogram of a stage over all the threads
+ */
+struct ProfileHistogram {
+    uint64_t count;
+    double total_ms;
+    double max_ms;
+    uint64_t buckets[PROFILER_BUCKETS];
+
+    double mean_ms() const {
+        return count ? total_ms / count : 0;
+    }
+
+    /**
+     * @details Percentile estimated with the upper bound of its bucket
+     *
+     * @param p Percentile in [0, 100]
+     */
+    double percentile_ms(double p) const {
+        uint64_t rank = (uint64_t)(p / 100 * count + 0.5);
+        uint64_t accumulated = 0;
+        for (int b = 0; b < PROFILER_BUCKETS; b++) {
+            accumulated += buckets[b];
+            if (accumulated >= rank && accumulated > 0) {
+                return min(max_ms, (double)(1ull << b) / 1000);
+            }
+        }
+        return max_ms;
+    }
+};
+
+ProfileHistogram profile_histogram(int stage) {
+    Profiler &p = profiler();
+    lock_guard<mutex> guard(p.lock);
+    ProfileHistogram histogram = {0, 0, 0};
+    for (int b = 0; b < PROFILER_BUCKETS; b++) {
+        histogram.buckets[b] = 0;
+    }
+    for (int i = 0; i < p.buffers.size(); i++) {
+        const ProfileBuffer &buffer = *p.buffers[i];
+        histogram.count += buffer.count[stage].load(memory_order_relaxed);
+        histogram.total_ms += buffer.total_ns[stage].load(memory_order_relaxed) / 1e6;
+        histogram.max_ms = max(histogram.max_ms, buffer.max_ns[stage].load(memory_order_relaxed) / 1e6);
+        for (int b = 0; b < PROFILER_BUCKETS; b++) {
+            histogram.buckets[b] += buffer.buckets[stage][b].load(memory_order_relaxed);
+        }
+    }
+    return histogram;
+}
+
+/**
+ * @details Clear the events and histograms of all the threads, call it when no other
+ * thread is recording
+ */
+void profiler_reset() {
+    Profiler &p = profiler();
+    lock_guard<mutex> guard(p.lock);
+    for (int i = 0; i < p.buffers.size(); i++) {
+        p.buffers[i]->clear();
+    }
+}
+
+/**
+ * @details Write the events kept in the buffers as Chrome trace_event JSON, it opens in
+ * chrome://tracing or Perfetto. Call it when no other thread is recording
+ *
+ * @param path Output file
+ * @return false if the file can not be written
+ */
+bool profiler_write_trace(const string &path) {
+    ofstream json(path.c_str());
+    if (!json.is_open()) {
+        return false;
+    }
+    Profiler &p = profiler();
+    lock_guard<mutex> guard(p.lock);
+    json << std::fixed << std::setprecision(3);
+    json << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (int i = 0; i < p.buffers.size(); i++) {
+        const ProfileBuffer &buffer = *p.buffers[i];
+        json << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer.lane
+             << ", \"args\": {\"name\": \"thread " << buffer.lane << "\"}}";
+        first = false;
+        uint64_t written = buffer.written.load(memory_order_acquire);
+        uint64_t begin = written > PROFILER_BUFFER_SIZE ? written - PROFILER_BUFFER_SIZE : 0;
+        for (uint64_t n = begin; n < written; n++) {
+            const ProfileEvent &event = buffer.events[n % PROFILER_BUFFER_SIZE];
+            json << ",\n{\"name\": \"" << profile_stage_names[event.stage] << "\", \"cat\": \"calibration\", \"ph\": \"X\""
+                 << ", \"ts\": " << event.start / 1e3 << ", \"dur\": " << event.duration / 1e3
+                 << ", \"pid\": 1, \"tid\": " << buffer.lane << "}";
+        }
+    }
+    json << "\n]}" << endl;
+    return true;
+}
+
+/**
+ * @details Write the histogram of every stage as CSV, the bucket columns count the scopes
+ * that took less than that many microseconds
+ *
+ * @param path Output file
+ * @return false if the file can not be written
+ */
+bool profiler_write_histograms(const string &path) {
+    ofstream csv(path.c_str());
+    if (!csv.is_open()) {
+        return false;
+    }
+    csv << "stage,count,total_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms";
+    for (int b = 0; b < PROFILER_BUCKETS; b++) {
+        csv << ",lt_" << (1ull << b) << "us";
+    }
+    csv << endl << std::fixed << std::setprecision(4);
+    for (int s = 0; s < PROFILE_STAGES; s++) {
+        ProfileHistogram h = profile_histogram(s);
+        csv << profile_stage_names[s] << "," << h.count << "," << h.total_ms << "," << h.mean_ms() << ","
+            << h.percentile_ms(50) << "," << h.percentile_ms(90) << "," << h.percentile_ms(99) << "," << h.max_ms;
+        for (int b = 0; b < PROFILER_BUCKETS; b++) {
+            csv << "," << h.buckets[b];
+        }
+        csv << endl;
+    }
+    return true;
+}
+
+/**
+ * @details Print the stages with at least one scope, sorted as the pipeline
+ */
+void profiler_print_summary(ostream &out) {
+    out << "stage\t\t\tcount\ttotal\t\tmean\t\tp90\t\tmax" << endl;
+    for (int s = 0; s < PROFILE_STAGES; s++) {
+        ProfileHistogram h = profile_histogram(s);
+        if (h.count == 0) {
+            continue;
+        }
+        out << left << setw(24) << profile_stage_names[s] << right << h.count << "\t"
+            << std::fixed << std::setprecision(3) << h.total_ms << "ms\t" << h.mean_ms() << "ms\t"
+            << h.percentile_ms(90) << "ms\t" << h.max_ms << "ms" << endl;
+    }
+}
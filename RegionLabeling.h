@@ -0,0 +1,263 @@
+#pragma once
+#include "opencv2/imgproc/imgproc.hpp"
+#include "EllipseFit.h"
+#include "PatternPoint.h"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+using namespace cv;
+using namespace std;
+
+/* Regions smaller than this area (pixels) are not used as rings */
+#define RING_MIN_AREA 12
+/* Accepted range of the area of a region over the area of the ellipse with its moments */
+#define RING_MIN_FILL 0.75
+#define RING_MAX_FILL 1.25
+
+/**
+ * @details Horizontal run of pixels with the same color in a row
+ */
+struct RegionRun {
+    int y;
+    int x0;                             // First column
+    int x1;                             // Last column (exclusive)
+    int light;                          // 1 for non zero pixels
+};
+
+/**
+ * @details Area moments up to second order
+ */
+struct RegionMoments {
+    double m00, m10, m01, m20, m11, m02;
+
+    void add(const RegionMoments &m) {
+        m00 += m.m00;
+        m10 += m.m10;
+        m01 += m.m01;
+        m20 += m.m20;
+        m11 += m.m11;
+        m02 += m.m02;
+    }
+};
+
+/**
+ * @details Buffers of the region labeling, reused between frames. Every region is
+ * identified by the index of its first run in raster order (the root of its runs), the
+ * run 0 is the region outside the image
+ */
+struct RegionLabels {
+    vector<RegionRun> runs;
+    vector<int> label;                  // Union find of the runs, root of every run after the labeling
+    vector<RegionMoments> moments;      // Moments of every region, holes included
+    vector<int> parent;                 // Region that contains every region, 0 for the outside
+    vector<int> children;               // Number of regions directly inside every region
+    vector<int> largest_child;          // Biggest region directly inside every region
+};
+
+int region_root(vector<int> &label, int r) {
+    while (label[r] != r) {
+        label[r] = label[label[r]];
+        r = label[r];
+    }
+    return r;
+}
+
+void region_union(vector<int> &label, int a, int b) {
+    a = region_root(label, a);
+    b = region_root(label, b);
+    // The smaller index is kept as root, so the root of a region is its first run
+    if (a < b) {
+        label[b] = a;
+    } else if (b < a) {
+        label[a] = b;
+    }
+}
+
+/**
+ * @details Label the light (8 connected) and dark (4 connected) regions of a binary image
+ * in one sweep over runs, the same connectivity used by findContours. The image border
+ * is taken as dark, like findContours does. For every region it computes the moments, the
+ * region that contains it and its children
+ *
+ * @param binary Binary image, zero is dark
+ * @param offset Position of binary inside the frame, added to the moments
+ * @param labels Labeling output
+ */
+void label_regions(const Mat &binary, Point offset, RegionLabels &labels) {
+    vector<RegionRun> &runs = labels.runs;
+    vector<int> &label = labels.label;
+    int rows = binary.rows;
+    int cols = binary.cols;
+    runs.clear();
+    label.clear();
+    RegionRun outside = {-1, 0, 0, 0};
+    runs.push_back(outside);
+    label.push_back(0);
+
+    int previous_start = 1, previous_end = 1;
+    for (int y = 0; y < rows; y++) {
+        const unsigned char *p = binary.ptr<unsigned char>(y);
+        int current_start = runs.size();
+        int k = previous_start;
+        int x = 0;
+        while (x < cols) {
+            int light = p[x] != 0;
+            int x0 = x++;
+            /* Skip 8 pixels at a time inside uniform spans */
+            uint64_t uniform = light ? ~(uint64_t)0 : 0;
+            while (x + 8 <= cols) {
+                uint64_t word;
+                memcpy(&word, p + x, 8);
+                if (word != uniform) {
+                    break;
+                }
+                x += 8;
+            }
+            while (x < cols && (p[x] != 0) == light) {
+                x++;
+            }
+            RegionRun run = {y, x0, x, light};
+            int r = runs.size();
+            runs.push_back(run);
+            label.push_back(r);
+            if (!light && (x0 == 0 || x == cols || y == 0 || y == rows - 1)) {
+                region_union(label, r, 0);
+            }
+            /* Light runs touch diagonally (8 connected), dark runs only by the sides */
+            int reach = light;
+            while (k < previous_end && runs[k].x1 + reach <= x0) {
+                k++;
+            }
+            for (int q = k; q < previous_end && runs[q].x0 < x + reach; q++) {
+                if (runs[q].light == light) {
+                    region_union(label, r, q);
+                }
+            }
+        }
+        previous_start = current_start;
+        previous_end = runs.size();
+    }
+
+    int n = runs.size();
+    RegionMoments zero = {0, 0, 0, 0, 0, 0};
+    labels.moments.assign(n, zero);
+    labels.parent.assign(n, -1);
+    labels.children.assign(n, 0);
+    labels.largest_child.assign(n, -1);
+    for (int r = 1; r < n; r++) {
+        int root = region_root(label, r);
+        label[r] = root;
+        const RegionRun &run = runs[r];
+        double count = run.x1 - run.x0;
+        double x0 = run.x0 + offset.x;
+        double x1 = run.x1 + offset.x - 1;
+        double y = run.y + offset.y;
+        double sx = (x0 + x1) * count / 2;
+        double sxx = (x1 * (x1 + 1) * (2 * x1 + 1) - (x0 - 1) * x0 * (2 * x0 - 1)) / 6;
+        RegionMoments &m = labels.moments[root];
+        m.m00 += count;
+        m.m10 += sx;
+        m.m01 += count * y;
+        m.m20 += sxx;
+        m.m11 += sx * y;
+        m.m02 += count * y * y;
+    }
+
+    /* The pixel at the left of the first pixel of a region belongs to the region that
+     * contains it, the image border belongs to the outside */
+    for (int r = 1; r < n; r++) {
+        if (label[r] == r) {
+            labels.parent[r] = runs[r].x0 == 0 ? 0 : label[r - 1];
+        }
+    }
+    /* A region starts after the region that contains it, going backwards every region
+     * is complete when it is added to its parent */
+    for (int r = n - 1; r >= 1; r--) {
+        if (label[r] == r) {
+            int p = labels.parent[r];
+            labels.children[p]++;
+            if (labels.largest_child[p] == -1 || labels.moments[labels.largest_child[p]].m00 < labels.moments[r].m00) {
+                labels.largest_child[p] = r;
+            }
+            labels.moments[p].add(labels.moments[r]);
+        }
+    }
+}
+
+/**
+ * @details Ellipse with the same area moments as a region, holes included
+ *
+ * @param m Region moments
+ * @param ellipse Ellipse output with the same convention as fitEllipse (full axes, degrees)
+ * @return true if the region looks like an ellipse (area and axis ratio)
+ */
+bool ellipse_from_moments(const RegionMoments &m, RotatedRect &ellipse) {
+    if (m.m00 < RING_MIN_AREA) {
+        return false;
+    }
+    double cx = m.m10 / m.m00;
+    double cy = m.m01 / m.m00;
+    double mu20 = m.m20 / m.m00 - cx * cx;
+    double mu11 = m.m11 / m.m00 - cx * cy;
+    double mu02 = m.m02 / m.m00 - cy * cy;
+    double root = sqrt((mu20 - mu02) * (mu20 - mu02) + 4 * mu11 * mu11);
+    double l1 = (mu20 + mu02 + root) / 2;
+    double l2 = (mu20 + mu02 - root) / 2;
+    if (!(l2 > 0)) {
+        return false;
+    }
+    /* A filled ellipse with semi axes a, b has variances a^2 / 4 and b^2 / 4 */
+    double a = 2 * sqrt(l1);
+    double b = 2 * sqrt(l2);
+    ellipse.center = Point2f(cx, cy);
+    ellipse.size = Size2f(2 * a, 2 * b);
+    ellipse.angle = 0.5 * atan2(2 * mu11, mu20 - mu02) * 180 / CV_PI;
+    if (ellipse.angle < 0) {
+        ellipse.angle += 180;
+    }
+    double fill = m.m00 / (CV_PI * a * b);
+    return fill >= RING_MIN_FILL && fill <= RING_MAX_FILL && b >= a * ELLIPSE_MIN_AXIS_RATIO;
+}
+
+/**
+ * @details Ring candidates from the labeled regions, a ring is a region with a parent
+ * whose biggest child has nearly the same center. Outer and inner shapes are the regions
+ * with their holes filled, so no contour is traced
+ *
+ * @param labels Labeled regions
+ * @param candidates Ring centers, radius and parent region
+ * @param fathers Outer ellipses of the rings
+ * @param sons Inner ellipses of the rings
+ * @param singles Ellipses of the regions with a parent but without children
+ */
+void ring_candidates(const RegionLabels &labels, vector<PatternPoint> &candidates, vector<RotatedRect> &fathers, vector<RotatedRect> &sons, vector<RotatedRect> &singles) {
+    RotatedRect elipse, elipseHijo;
+    for (int r = 1; r < labels.runs.size(); r++) {
+        if (labels.label[r] != r || labels.parent[r] <= 0) {
+            continue;
+        }
+        if (labels.children[r] == 0) {
+            if (ellipse_from_moments(labels.moments[r], elipse)) {
+                singles.push_back(elipse);
+            }
+            continue;
+        }
+        int hijo = labels.largest_child[r];
+        if (!ellipse_from_moments(labels.moments[r], elipse) || !ellipse_from_moments(labels.moments[hijo], elipseHijo)) {
+            continue;
+        }
+        float radio = (elipse.size.height + elipse.size.width) / 4;
+        float radio_hijo = (elipseHijo.size.height + elipseHijo.size.width) / 4;
+        /* Check center proximity */
+        if (cv::norm(elipse.center - elipseHijo.center) < radio_hijo / 2) {
+            candidates.push_back(PatternPoint((elipse.center.x + elipseHijo.center.x) / 2,
+                                              (elipse.center.y + elipseHijo.center.y) / 2,
+                                              radio,
+                                              labels.parent[r]));
+            fathers.push_back(elipse);
+            sons.push_back(elipseHijo);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <stdint.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "Profiler.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+/* Minimum variance of the Laplacian to search a frame, 0 searches every frame */
+#define SHARPNESS_MIN 25.0
+
+/**
+ * @details Sum and sum of squares of the 4 neighbour Laplacian along one row
+ *
+ * @param up Row above
+ * @param row Row of the Laplacian
+ * @param down Row below
+ * @param j0 First column, at least 1
+ * @param j1 Last column (exclusive), at most cols - 1
+ * @param sum Sum of the Laplacian, accumulated
+ * @param sum_sq Sum of the squares, accumulated
+ */
+void laplacian_row(const unsigned char *up, const unsigned char *row, const unsigned char *down, int j0, int j1, int64_t &sum, uint64_t &sum_sq) {
+    int j = j0;
+    /* |Laplacian| <= 1020 fits in 16 bits, madd adds the pairs of products in 32 bits.
+     * The squares are added as unsigned, a lane holds 2000 blocks (rows up to 16000 columns) */
+#if defined(__AVX2__)
+    const __m256i v_ones = _mm256_set1_epi16(1);
+    __m256i v_sum = _mm256_setzero_si256();
+    __m256i v_sq = _mm256_setzero_si256();
+    for (; j + 16 <= j1; j += 16) {
+        __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + j)));
+        __m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + j - 1)));
+        __m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + j + 1)));
+        __m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(up + j)));
+        __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(down + j)));
+        __m256i lap = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(l, r), _mm256_add_epi16(u, d)), _mm256_slli_epi16(c, 2));
+        v_sum = _mm256_add_epi32(v_sum, _mm256_madd_epi16(lap, v_ones));
+        v_sq = _mm256_add_epi32(v_sq, _mm256_madd_epi16(lap, lap));
+    }
+    int32_t lanes_sum[8];
+    uint32_t lanes_sq[8];
+    _mm256_storeu_si256((__m256i *)lanes_sum, v_sum);
+    _mm256_storeu_si256((__m256i *)lanes_sq, v_sq);
+    for (int k = 0; k < 8; k++) {
+        sum += lanes_sum[k];
+        sum_sq += lanes_sq[k];
+    }
+#elif defined(__SSE4_1__)
+    const __m128i v_ones = _mm_set1_epi16(1);
+    __m128i v_sum = _mm_setzero_si128();
+    __m128i v_sq = _mm_setzero_si128();
+    for (; j + 8 <= j1; j += 8) {
+        __m128i c = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(row + j)));
+        __m128i l = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(row + j - 1)));
+        __m128i r = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(row + j + 1)));
+        __m128i u = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(up + j)));
+        __m128i d = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(down + j)));
+        __m128i lap = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)), _mm_slli_epi16(c, 2));
+        v_sum = _mm_add_epi32(v_sum, _mm_madd_epi16(lap, v_ones));
+        v_sq = _mm_add_epi32(v_sq, _mm_madd_epi16(lap, lap));
+    }
+    int32_t lanes_sum[4];
+    uint32_t lanes_sq[4];
+    _mm_storeu_si128((__m128i *)lanes_sum, v_sum);
+    _mm_storeu_si128((__m128i *)lanes_sq, v_sq);
+    for (int k = 0; k < 4; k++) {
+        sum += lanes_sum[k];
+        sum_sq += lanes_sq[k];
+    }
+#endif
+    for (; j < j1; j++) {
+        int lap = row[j - 1] + row[j + 1] + up[j] + down[j] - 4 * row[j];
+        sum += lap;
+        sum_sq += lap * lap;
+    }
+}
+
+/**
+ * @details Variance of the Laplacian of a region, a measure of focus and motion blur: a
+ * blurred frame has weak second derivatives everywhere. The 4 neighbour Laplacian is the
+ * cross of the 3x3 Sobel window of tests/sobel.cpp without the smoothing, so the mean and
+ * the variance are accumulated in a single pass without intermediate images
+ *
+ * @param gray Frame in grayscale
+ * @param roi Region measured, clipped to the frame
+ * @return Variance of the Laplacian, 0 if the region is smaller than 3x3
+ */
+double laplacian_variance(const Mat &gray, Rect roi) {
+    roi = roi & Rect(0, 0, gray.cols, gray.rows);
+    if (roi.width < 3 || roi.height < 3) {
+        return 0;
+    }
+    int64_t sum = 0;
+    uint64_t sum_sq = 0;
+    int j0 = roi.x + 1;
+    int j1 = roi.x + roi.width - 1;
+    for (int i = roi.y + 1; i < roi.y + roi.height - 1; i++) {
+        laplacian_row(gray.ptr<uchar>(i - 1), gray.ptr<uchar>(i), gray.ptr<uchar>(i + 1), j0, j1, sum, sum_sq);
+    }
+    double n = (double)(roi.width - 2) * (roi.height - 2);
+    double mean = sum / n;
+    return sum_sq / n - mean * mean;
+}
+
+/**
+ * @details Sharpness test before the pattern search, the blurred frames are rejected before
+ * the segmentation, the contours and the ellipse fits, and they do not reach the calibration.
+ * The counters are the metric of the gate
+ */
+struct SharpnessGate {
+    double threshold;                   // Minimum variance of the Laplacian, 0 accepts every frame
+    int checked;                        // Frames measured
+    int rejected;                       // Frames under the threshold
+    double last;                        // Sharpness of the last frame measured
+
+    SharpnessGate(double threshold = SHARPNESS_MIN) : threshold(threshold) {
+        clear();
+    }
+
+    void clear() {
+        checked = 0;
+        rejected = 0;
+        last = 0;
+    }
+
+    /**
+     * @details Measure a frame and count it
+     *
+     * @param gray Frame in grayscale
+     * @param roi Region of the pattern, the whole frame if it is not tracked
+     * @return true if the frame is sharp enough to be searched
+     */
+    bool accept(const Mat &gray, Rect roi) {
+        if (threshold <= 0) {
+            return true;
+        }
+        PROFILE_SCOPE(PROFILE_SHARPNESS);
+        last = laplacian_variance(gray, roi);
+        checked++;
+        if (last < threshold) {
+            rejected++;
+            return false;
+        }
+        return true;
+    }
+
+    bool accept(const Mat &gray) {
+        return accept(gray, Rect(0, 0, gray.cols, gray.rows));
+    }
+};
@@ -0,0 +1,382 @@
+#pragma once
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "WorkStealingPool.h"
+#include <vector>
+#include <cmath>
+#include <functional>
+
+using namespace cv;
+using namespace std;
+
+#define BOARD_RINGS 0
+#define BOARD_DELTILLE 1
+
+/* Gray levels of the rendered frames */
+#define SYNTHETIC_BLACK 20
+#define SYNTHETIC_WHITE 220
+#define SYNTHETIC_BACKGROUND 60
+/* Samples per pixel side used to antialias the board */
+#define SYNTHETIC_SUPERSAMPLING 4
+
+/**
+ * @details Geometry of a calibration board in millimeters, the board is the plane Z = 0
+ * and its control points are in the order of the object points used to calibrate
+ */
+struct SyntheticBoard {
+    int type;                           // BOARD_RINGS or BOARD_DELTILLE
+    vector<Point3f> control_points;
+    float spacing;                      // Distance between columns
+    float row_spacing;                  // Distance between rows
+    float outer;                        // Outer radius of the rings
+    float inner;                        // Inner radius of the rings
+    int cols;
+    int rows;
+    Point2f area_min;                   // Extent of the printed board
+    Point2f area_max;
+};
+
+/**
+ * @details Ring board of calibrate_with_points, 5x4 rings 44.3 mm apart, the rings
+ * have the proportions of pattern.png
+ */
+SyntheticBoard ring_board() {
+    SyntheticBoard board;
+    board.type = BOARD_RINGS;
+    board.cols = 5;
+    board.rows = 4;
+    board.spacing = 44.3;
+    board.row_spacing = 44.3;
+    board.outer = board.spacing * 0.33;
+    board.inner = board.spacing * 0.17;
+    for (int i = 0; i < board.rows; i++) {
+        for (int j = 0; j < board.cols; j++) {
+            board.control_points.push_back(Point3f(j * board.spacing, i * board.row_spacing, 0));
+        }
+    }
+    float margin = board.spacing * 0.93;
+    board.area_min = Point2f(-margin, -margin);
+    board.area_max = Point2f((board.cols - 1) * board.spacing + margin, (board.rows - 1) * board.row_spacing + margin);
+    return board;
+}
+
+/**
+ * @details Triangular board of CameraCalibrationDeltille::load_object_points, rows of
+ * cols and cols + 1 saddle points alternated, 20 mm between columns and 18 mm between rows
+ *
+ * @param cols Saddle points in the even rows
+ * @param rows Number of rows
+ */
+SyntheticBoard deltille_board(int cols = 8, int rows = 5) {
+    SyntheticBoard board;
+    board.type = BOARD_DELTILLE;
+    board.cols = cols;
+    board.rows = rows;
+    board.spacing = 20;
+    board.row_spacing = 18;
+    board.outer = 0;
+    board.inner = 0;
+    for (int i = 0; i < rows; i++) {
+        if (i % 2) {
+            for (int j = 0; j < cols + 1; j++) {
+                board.control_points.push_back(Point3f(j * board.spacing, i * board.row_spacing, 0));
+            }
+        } else {
+            for (int j = 0; j < cols; j++) {
+                board.control_points.push_back(Point3f((2 * j + 1) * board.spacing / 2.0, i * board.row_spacing, 0));
+            }
+        }
+    }
+    // One row of triangles around the saddle points plus a white margin
+    board.area_min = Point2f(-2 * board.spacing, -2 * board.row_spacing);
+    board.area_max = Point2f((cols + 2) * board.spacing, (rows + 1) * board.row_spacing);
+    return board;
+}
+
+/**
+ * @details Reflectance of the board at a point of its plane
+ *
+ * @param board Board geometry
+ * @param x Board x in millimeters
+ * @param y Board y in millimeters
+ * @return 1 for white, 0 for black and -1 outside the board
+ */
+float board_intensity(const SyntheticBoard &board, float x, float y) {
+    if (x < board.area_min.x || y < board.area_min.y || x > board.area_max.x || y > board.area_max.y) {
+        return -1;
+    }
+    if (board.type == BOARD_RINGS) {
+        int j = min(max(cvRound(x / board.spacing), 0), board.cols - 1);
+        int i = min(max(cvRound(y / board.row_spacing), 0), board.rows - 1);
+        float dx = x - j * board.spacing;
+        float dy = y - i * board.row_spacing;
+        float d2 = dx * dx + dy * dy;
+        return (d2 >= board.inner * board.inner && d2 <= board.outer * board.outer) ? 0 : 1;
+    }
+    /* Triangles between the saddle rows, one row of triangles beyond the saddle points */
+    float first_x = -board.spacing;
+    float last_x = (board.cols + 1) * board.spacing;
+    float first_y = -board.row_spacing;
+    float last_y = board.rows * board.row_spacing;
+    if (x < first_x || x > last_x || y < first_y || y > last_y) {
+        return 1;
+    }
+    // Even rows start half a triangle to the right
+    int r = (int)floor(y / board.row_spacing);
+    float t = y / board.row_spacing - r;
+    float u = x / board.spacing - ((r % 2 + 2) % 2 ? 0 : 0.5f);
+    int parity = (int)floor(u - t / 2) + (int)floor(u + t / 2);
+    return (parity & 1) ? 1 : 0;
+}
+
+/**
+ * @details Camera and pose used to render one frame
+ */
+struct SyntheticView {
+    Mat camera_matrix;                  // 3x3 CV_64F
+    Mat dist_coeffs;                    // 1x5 CV_64F, k1 k2 p1 p2 k3 as in distortPoints
+    Vec3d rvec;                         // Board to camera rotation (Rodrigues)
+    Vec3d tvec;                         // Board to camera translation in millimeters
+    float blur_sigma;                   // Gaussian blur of the optics, 0 to disable
+    float noise_sigma;                  // Gaussian sensor noise in gray levels, 0 to disable
+};
+
+/**
+ * @details Intrinsics of a SyntheticView as plain numbers
+ */
+struct SyntheticCamera {
+    double fx, fy, cx, cy;
+    double k1, k2, p1, p2, k3;
+
+    SyntheticCamera(const Mat &camera_matrix, const Mat &dist_coeffs) {
+        fx = camera_matrix.at<double>(0, 0);
+        fy = camera_matrix.at<double>(1, 1);
+        cx = camera_matrix.at<double>(0, 2);
+        cy = camera_matrix.at<double>(1, 2);
+        const double *d = dist_coeffs.ptr<double>(0);
+        k1 = d[0];
+        k2 = d[1];
+        p1 = d[2];
+        p2 = d[3];
+        k3 = d[4];
+    }
+
+    /**
+     * @details Normalized coordinates to distorted pixels, same model as distortPoints
+     */
+    Point2d distort(double x, double y) const {
+        double r2 = x * x + y * y;
+        double radial = 1 + k1 * r2 + k2 * r2 * r2 + k3 * r2 * r2 * r2;
+        double xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+        double yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+        return Point2d(xd * fx + cx, yd * fy + cy);
+    }
+
+    /**
+     * @details Distorted pixels to normalized coordinates, fixed point iterations like
+     * undistortPoints
+     */
+    Point2d undistort(double u, double v) const {
+        double xd = (u - cx) / fx;
+        double yd = (v - cy) / fy;
+        double x = xd;
+        double y = yd;
+        for (int i = 0; i < 20; i++) {
+            double r2 = x * x + y * y;
+            double radial = 1 + k1 * r2 + k2 * r2 * r2 + k3 * r2 * r2 * r2;
+            double dx = 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+            double dy = p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+            x = (xd - dx) / radial;
+            y = (yd - dy) / radial;
+        }
+        return Point2d(x, y);
+    }
+};
+
+/**
+ * @details Exact image position of the board control points
+ *
+ * @param board Board geometry
+ * @param view Camera and pose
+ * @param points Distorted image points, in the order of board.control_points
+ */
+void project_board_points(const SyntheticBoard &board, const SyntheticView &view, vector<Point2f> &points) {
+    SyntheticCamera camera(view.camera_matrix, view.dist_coeffs);
+    Mat rotation;
+    Rodrigues(view.rvec, rotation);
+    const double *r = rotation.ptr<double>(0);
+    points.resize(board.control_points.size());
+    for (int p = 0; p < board.control_points.size(); p++) {
+        const Point3f &o = board.control_points[p];
+        double X = r[0] * o.x + r[1] * o.y + r[2] * o.z + view.tvec[0];
+        double Y = r[3] * o.x + r[4] * o.y + r[5] * o.z + view.tvec[1];
+        double Z = r[6] * o.x + r[7] * o.y + r[8] * o.z + view.tvec[2];
+        Point2d uv = camera.distort(X / Z, Y / Z);
+        points[p] = Point2f(uv.x, uv.y);
+    }
+}
+
+/**
+ * @details Render the board seen by a camera. Every pixel corner is traced back through
+ * the distortion to the board plane and the pixel is supersampled between its corners,
+ * then the blur and the noise are added
+ *
+ * @param board Board geometry
+ * @param view Camera and pose
+ * @param w Frame width (rows)
+ * @param h Frame height (cols)
+ * @param seed Seed of the noise, the same seed gives the same frame
+ * @param frame BGR frame output
+ */
+void render_board(const SyntheticBoard &board, const SyntheticView &view, int w, int h, uint64 seed, Mat &frame) {
+    SyntheticCamera camera(view.camera_matrix, view.dist_coeffs);
+    Mat rotation;
+    Rodrigues(view.rvec, rotation);
+    const double *r = rotation.ptr<double>(0);
+    /* Board plane to normalized camera coordinates is [r1 r2 t], its inverse goes back */
+    double plane[3][3] = {{r[0], r[1], view.tvec[0]}, {r[3], r[4], view.tvec[1]}, {r[6], r[7], view.tvec[2]}};
+    Mat inverse = Mat(3, 3, CV_64F, plane).inv();
+    const double *m = inverse.ptr<double>(0);
+
+    /* Board coordinates of the pixel corners, NaN when the ray misses the plane */
+    vector<Point2f> corners((w + 1) * (h + 1));
+    for (int y = 0; y <= w; y++) {
+        for (int x = 0; x <= h; x++) {
+            Point2d n = camera.undistort(x - 0.5, y - 0.5);
+            double bx = m[0] * n.x + m[1] * n.y + m[2];
+            double by = m[3] * n.x + m[4] * n.y + m[5];
+            double bz = m[6] * n.x + m[7] * n.y + m[8];
+            corners[y * (h + 1) + x] = bz > 0 ? Point2f(bx / bz, by / bz) : Point2f(NAN, NAN);
+        }
+    }
+
+    Mat gray(w, h, CV_8UC1);
+    const int s = SYNTHETIC_SUPERSAMPLING;
+    for (int y = 0; y < w; y++) {
+        unsigned char *row = gray.ptr<unsigned char>(y);
+        for (int x = 0; x < h; x++) {
+            const Point2f &c00 = corners[y * (h + 1) + x];
+            const Point2f &c01 = corners[y * (h + 1) + x + 1];
+            const Point2f &c10 = corners[(y + 1) * (h + 1) + x];
+            const Point2f &c11 = corners[(y + 1) * (h + 1) + x + 1];
+            float sum = 0;
+            for (int sy = 0; sy < s; sy++) {
+                float v = (sy + 0.5f) / s;
+                for (int sx = 0; sx < s; sx++) {
+                    float u = (sx + 0.5f) / s;
+                    Point2f b = (c00 * (1 - u) + c01 * u) * (1 - v) + (c10 * (1 - u) + c11 * u) * v;
+                    float intensity = (b.x == b.x) ? board_intensity(board, b.x, b.y) : -1;
+                    sum += intensity < 0 ? SYNTHETIC_BACKGROUND : SYNTHETIC_BLACK + (SYNTHETIC_WHITE - SYNTHETIC_BLACK) * intensity;
+                }
+            }
+            row[x] = saturate_cast<unsigned char>(sum / (s * s));
+        }
+    }
+
+    if (view.blur_sigma > 0) {
+        GaussianBlur(gray, gray, Size(0, 0), view.blur_sigma);
+    }
+    if (view.noise_sigma > 0) {
+        Mat noise(w, h, CV_16SC1);
+        RNG rng(seed);
+        rng.fill(noise, RNG::NORMAL, 0, view.noise_sigma);
+        Mat noisy;
+        gray.convertTo(noisy, CV_16SC1);
+        noisy += noise;
+        noisy.convertTo(gray, CV_8UC1);
+    }
+    cvtColor(gray, frame, CV_GRAY2BGR);
+}
+
+/**
+ * @details Random pose with the whole board inside the frame, the board covers between
+ * 30% and 80% of the frame width and is tilted up to 45 degrees. The board y axis points
+ * up in the image as in the calibration videos, so the row y = 0 is the bottom row: the
+ * detectors number the rows from the bottom of the image and the control points of the
+ * views are in the order of the points they return
+ *
+ * @param board Board geometry
+ * @param view Camera of the view, the pose is written in it
+ * @param w Frame width (rows)
+ * @param h Frame height (cols)
+ * @param rng Random generator
+ * @return false if no pose was found with the board inside the frame
+ */
+bool random_pose(const SyntheticBoard &board, SyntheticView &view, int w, int h, RNG &rng) {
+    SyntheticCamera camera(view.camera_matrix, view.dist_coeffs);
+    Point2f size = board.area_max - board.area_min;
+    Point2f center = (board.area_max + board.area_min) * 0.5;
+    SyntheticBoard area = board;
+    area.control_points.clear();
+    area.control_points.push_back(Point3f(board.area_min.x, board.area_min.y, 0));
+    area.control_points.push_back(Point3f(board.area_max.x, board.area_min.y, 0));
+    area.control_points.push_back(Point3f(board.area_max.x, board.area_max.y, 0));
+    area.control_points.push_back(Point3f(board.area_min.x, board.area_max.y, 0));
+    vector<Point2f> corners;
+    for (int attempt = 0; attempt < 100; attempt++) {
+        double roll = rng.uniform(-30.0, 30.0) * CV_PI / 180;
+        double tilt_x = rng.uniform(-45.0, 45.0) * CV_PI / 180;
+        double tilt_y = rng.uniform(-45.0, 45.0) * CV_PI / 180;
+        double coverage = rng.uniform(0.3, 0.8);
+        double z = camera.fx * size.x / (coverage * h);
+        Point2d target(rng.uniform(0.3, 0.7) * h, rng.uniform(0.3, 0.7) * w);
+
+        Matx33d rz(cos(roll), -sin(roll), 0, sin(roll), cos(roll), 0, 0, 0, 1);
+        Matx33d rx(1, 0, 0, 0, cos(tilt_x), -sin(tilt_x), 0, sin(tilt_x), cos(tilt_x));
+        Matx33d ry(cos(tilt_y), 0, sin(tilt_y), 0, 1, 0, -sin(tilt_y), 0, cos(tilt_y));
+        Matx33d flip(1, 0, 0, 0, -1, 0, 0, 0, -1);
+        Matx33d rotation = rz * rx * ry * flip;
+        Vec3d ray((target.x - camera.cx) / camera.fx, (target.y - camera.cy) / camera.fy, 1);
+        view.tvec = ray * z - rotation * Vec3d(center.x, center.y, 0);
+        Rodrigues(Mat(rotation), view.rvec);
+
+        project_board_points(area, view, corners);
+        bool inside = true;
+        for (int c = 0; c < 4 && inside; c++) {
+            inside = corners[c].x >= 0 && corners[c].y >= 0 && corners[c].x < h && corners[c].y < w;
+        }
+        if (inside) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @details Render a corpus of frames with random poses in parallel. Every frame has its
+ * own generator seeded from the corpus seed, so the corpus does not depend on the
+ * number of threads. The frames are handed to a callback as soon as they are ready
+ *
+ * @param board Board geometry
+ * @param camera Camera, blur and noise of all the frames, the pose is random
+ * @param w Frame width (rows)
+ * @param h Frame height (cols)
+ * @param n_frames Number of frames
+ * @param seed Seed of the corpus
+ * @param pool Workers
+ * @param output Called from the workers with (frame index, frame, view, ground truth points)
+ * @return Number of frames rendered
+ */
+int render_corpus(const SyntheticBoard &board, const SyntheticView &camera, int w, int h, int n_frames, uint64 seed, WorkStealingPool &pool,
+                  const function<void(int, const Mat &, const SyntheticView &, const vector<Point2f> &)> &output) {
+    vector<char> rendered(n_frames, 0);
+    pool.run(n_frames, [&](int f, int worker) {
+        RNG rng(seed * 1000003 + f);
+        SyntheticView view = camera;
+        if (!random_pose(board, view, w, h, rng)) {
+            return;
+        }
+        Mat frame;
+        vector<Point2f> points;
+        render_board(board, view, w, h, rng.next(), frame);
+        project_board_points(board, view, points);
+        output(f, frame, view, points);
+        rendered[f] = 1;
+    });
+    int count = 0;
+    for (int f = 0; f < n_frames; f++) {
+        count += rendered[f];
+    }
+    return count;
+}
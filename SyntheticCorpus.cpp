@@ -0,0 +1,116 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+#include <mutex>
+#include <sys/stat.h>
+#include "SyntheticBoard.h"
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Render a benchmark corpus of synthetic frames with exact ground truth.
+ * Output directory layout:
+ *   frame_00000.png ...    frames, readable with VideoCapture("<dir>/frame_%05d.png")
+ *   points.csv             frame, point, x, y of every control point, in the order of the object points
+ *   poses.csv              frame, rvec, tvec of every frame
+ *   camera.yml             camera_matrix and dist_coeffs used to render
+ *
+ * Usage: SyntheticCorpus <rings|deltille> <n_frames> <output_dir> [width height] [blur] [noise] [seed]
+ */
+int main( int argc, char** argv ) {
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " <rings|deltille> <n_frames> <output_dir> [width height] [blur] [noise] [seed]" << endl;
+        return -1;
+    }
+    string type = argv[1];
+    int n_frames = atoi(argv[2]);
+    string output_dir = argv[3];
+    int h = argc > 5 ? atoi(argv[4]) : 1280;
+    int w = argc > 5 ? atoi(argv[5]) : 720;
+    float blur = argc > 6 ? atof(argv[6]) : 0.8;
+    float noise = argc > 7 ? atof(argv[7]) : 3;
+    uint64 seed = argc > 8 ? atoll(argv[8]) : 12345;
+
+    struct stat dir_stat;
+    if (stat(output_dir.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+        cout << "Output directory " << output_dir << " does not exist" << endl;
+        return -1;
+    }
+
+    SyntheticBoard board = type == "deltille" ? deltille_board(8, 5) : ring_board();
+
+    /* Wide angle camera with visible barrel distortion */
+    SyntheticView camera;
+    camera.camera_matrix = (Mat_<double>(3, 3) << 0.9 * h, 0, h / 2.0, 0, 0.9 * h, w / 2.0, 0, 0, 1);
+    camera.dist_coeffs = (Mat_<double>(1, 5) << -0.25, 0.08, 0.0005, -0.0005, -0.01);
+    camera.blur_sigma = blur;
+    camera.noise_sigma = noise;
+
+    FileStorage fs(output_dir + "/camera.yml", FileStorage::WRITE);
+    if (!fs.isOpened()) {
+        cout << "Cannot write " << output_dir << "/camera.yml" << endl;
+        return -1;
+    }
+    fs << "camera_matrix" << camera.camera_matrix;
+    fs << "dist_coeffs" << camera.dist_coeffs;
+    fs << "image_width" << h;
+    fs << "image_height" << w;
+    fs.release();
+
+    vector<vector<Point2f> > points(n_frames);
+    vector<SyntheticView> views(n_frames);
+    mutex progress_lock;
+    int done = 0;
+    int failed = 0;
+    WorkStealingPool pool;
+    double t0 = getTickCount();
+    int rendered = render_corpus(board, camera, w, h, n_frames, seed, pool,
+    [&](int f, const Mat & frame, const SyntheticView & view, const vector<Point2f> &frame_points) {
+        char name[32];
+        sprintf(name, "/frame_%05d.png", f);
+        bool written = imwrite(output_dir + name, frame);
+        points[f] = frame_points;
+        views[f] = view;
+        lock_guard<mutex> guard(progress_lock);
+        if (!written) {
+            failed++;
+            cout << "Cannot write " << output_dir << name << endl;
+        }
+        if (++done % 100 == 0) {
+            cout << done << " frames" << endl;
+        }
+    });
+    double seconds = (getTickCount() - t0) / getTickFrequency();
+    if (failed > 0) {
+        cout << failed << "/" << n_frames << " frames were not written" << endl;
+        return -1;
+    }
+
+    ofstream points_csv((output_dir + "/points.csv").c_str());
+    ofstream poses_csv((output_dir + "/poses.csv").c_str());
+    if (!points_csv || !poses_csv) {
+        cout << "Cannot write the ground truth in " << output_dir << endl;
+        return -1;
+    }
+    points_csv << "frame,point,x,y" << endl << std::fixed << std::setprecision(4);
+    poses_csv << "frame,rx,ry,rz,tx,ty,tz" << endl << std::fixed << std::setprecision(6);
+    for (int f = 0; f < n_frames; f++) {
+        if (points[f].empty()) {
+            continue;
+        }
+        for (int p = 0; p < points[f].size(); p++) {
+            points_csv << f << "," << p << "," << points[f][p].x << "," << points[f][p].y << endl;
+        }
+        poses_csv << f << "," << views[f].rvec[0] << "," << views[f].rvec[1] << "," << views[f].rvec[2] << ","
+                  << views[f].tvec[0] << "," << views[f].tvec[1] << "," << views[f].tvec[2] << endl;
+    }
+    if (!points_csv || !poses_csv) {
+        cout << "Cannot write the ground truth in " << output_dir << endl;
+        return -1;
+    }
+    cout << rendered << "/" << n_frames << " frames rendered in " << seconds << "s with "
+         << pool.n_threads << " threads" << endl;
+    return 0;
+}
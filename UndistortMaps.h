@@ -0,0 +1,113 @@
+#pragma once
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "Profiler.h"
+
+using namespace cv;
+using namespace std;
+
+/* Rows of every tile of remap_tiled */
+#define UNDISTORT_TILE_ROWS 32
+/* Alpha of UndistortMaps::update that keeps the camera matrix, as cv::undistort does */
+#define UNDISTORT_KEEP_CAMERA -1
+
+/**
+ * @details True if both matrices have the same size, type and values
+ */
+bool same_values(const Mat &a, const Mat &b) {
+    if (a.empty() || b.empty()) {
+        return a.empty() && b.empty();
+    }
+    if (a.size() != b.size() || a.type() != b.type()) {
+        return false;
+    }
+    return norm(a, b, NORM_INF) == 0;
+}
+
+/**
+ * @details Undistortion maps of a calibration, rebuilt only when the camera matrix, the
+ * distortion, the size or alpha change. The maps are in the fixed point form (CV_16SC2
+ * and CV_16UC1), the fastest for remap
+ */
+struct UndistortMaps {
+    Mat camera_matrix;                  // Parameters of the maps, copies of the last update
+    Mat dist_coeffs;
+    Size size;
+    double alpha;
+    Mat new_camera_matrix;              // Camera matrix of the undistorted image
+    Mat map1;                           // CV_16SC2 integer positions
+    Mat map2;                           // CV_16UC1 interpolation table index
+
+    UndistortMaps() : alpha(0) {}
+
+    /**
+     * @details Rebuild the maps if the parameters are not the ones of the current maps
+     *
+     * @param camera_matrix Camera matrix
+     * @param dist_coeffs Distortion coefficients
+     * @param size Image size
+     * @param alpha Free scaling of getOptimalNewCameraMatrix, UNDISTORT_KEEP_CAMERA uses
+     * the same camera matrix in the undistorted image
+     * @return true if the maps were rebuilt
+     */
+    bool update(const Mat &camera_matrix, const Mat &dist_coeffs, Size size, double alpha = 1) {
+        if (!map1.empty() && size == this->size && alpha == this->alpha &&
+                same_values(camera_matrix, this->camera_matrix) && same_values(dist_coeffs, this->dist_coeffs)) {
+            return false;
+        }
+        PROFILE_SCOPE(PROFILE_UNDISTORT);
+        // The caller can recalibrate over the same Mats, keep copies to compare
+        this->camera_matrix = camera_matrix.clone();
+        this->dist_coeffs = dist_coeffs.clone();
+        this->size = size;
+        this->alpha = alpha;
+        if (alpha == UNDISTORT_KEEP_CAMERA) {
+            new_camera_matrix = this->camera_matrix;
+        } else {
+            new_camera_matrix = getOptimalNewCameraMatrix(camera_matrix, dist_coeffs, size, alpha, size, 0);
+        }
+        initUndistortRectifyMap(camera_matrix, dist_coeffs, Mat(), new_camera_matrix, size, CV_16SC2, map1, map2);
+        return true;
+    }
+};
+
+/**
+ * @details Remap of a band of tiles, every tile is UNDISTORT_TILE_ROWS rows of the output
+ */
+class RemapTiles : public ParallelLoopBody {
+public:
+    RemapTiles(const Mat &src, Mat &dst, const UndistortMaps &maps, int interpolation) : src(src), dst(dst), maps(maps), interpolation(interpolation) {}
+
+    void operator()(const Range &range) const {
+        for (int t = range.start; t < range.end; t++) {
+            int y0 = t * UNDISTORT_TILE_ROWS;
+            int y1 = min(dst.rows, y0 + UNDISTORT_TILE_ROWS);
+            Rect tile(0, y0, dst.cols, y1 - y0);
+            Mat dst_tile = dst(tile);
+            // The maps hold absolute source positions, so a band of the maps reads the whole source
+            remap(src, dst_tile, maps.map1(tile), maps.map2(tile), interpolation, BORDER_CONSTANT);
+        }
+    }
+
+private:
+    const Mat &src;
+    Mat &dst;
+    const UndistortMaps &maps;
+    int interpolation;
+};
+
+/**
+ * @details Undistort a frame with cached maps, the tiles are remapped in parallel on the
+ * OpenCV thread pool, so a live loop does not start threads for every frame
+ *
+ * @param src Distorted frame
+ * @param dst Undistorted frame, it can not be src
+ * @param maps Maps updated for the size of src
+ * @param interpolation Interpolation of remap
+ */
+void remap_tiled(const Mat &src, Mat &dst, const UndistortMaps &maps, int interpolation = INTER_LINEAR) {
+    PROFILE_SCOPE(PROFILE_UNDISTORT);
+    dst.create(maps.size, src.type());
+    int tiles = (dst.rows + UNDISTORT_TILE_ROWS - 1) / UNDISTORT_TILE_ROWS;
+    parallel_for_(Range(0, tiles), RemapTiles(src, dst, maps, interpolation));
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @details Tasks of one worker, the owner takes them from the front and the other
+ * workers steal them from the back
+ */
+struct TaskQueue {
+    mutex lock;
+    deque<int> tasks;
+};
+
+/**
+ * @details Run a batch of independent tasks over a set of workers. Every worker starts
+ * with a contiguous block of tasks and, when its own queue is empty, steals from the back
+ * of the other queues, so slow frames do not leave the rest of the threads idle. The
+ * calling thread works as the worker 0
+ */
+class WorkStealingPool {
+public:
+    int n_threads;
+
+    /**
+     * @param n_threads Number of workers, 0 uses all the hardware threads
+     */
+    WorkStealingPool(int n_threads = 0) {
+        if (n_threads <= 0) {
+            n_threads = thread::hardware_concurrency();
+        }
+        this->n_threads = max(1, n_threads);
+    }
+
+    /**
+     * @details Call body(task, worker) once for every task in [0, n_tasks) and wait for all
+     * of them. worker is in [0, n_threads) and identifies the thread, it can be used to pick
+     * per thread buffers. The first exception thrown by a task is rethrown at the end
+     *
+     * @param n_tasks Number of tasks
+     * @param body Task function
+     */
+    void run(int n_tasks, const function<void(int, int)> &body) {
+        int workers = min(n_threads, n_tasks);
+        if (workers <= 1) {
+            for (int t = 0; t < n_tasks; t++) {
+                body(t, 0);
+            }
+            return;
+        }
+        vector<TaskQueue> queues(workers);
+        for (int w = 0; w < workers; w++) {
+            for (int t = n_tasks * w / workers; t < n_tasks * (w + 1) / workers; t++) {
+                queues[w].tasks.push_back(t);
+            }
+        }
+        exception_ptr error;
+        mutex error_lock;
+        vector<thread> threads;
+        for (int w = 1; w < workers; w++) {
+            threads.push_back(thread(&WorkStealingPool::work, this, ref(queues), w, cref(body), ref(error), ref(error_lock)));
+        }
+        work(queues, 0, body, error, error_lock);
+        for (int t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+private:
+    bool pop(TaskQueue &queue, int &task, bool front) {
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        if (front) {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+
+    void work(vector<TaskQueue> &queues, int worker, const function<void(int, int)> &body, exception_ptr &error, mutex &error_lock) {
+        int n = queues.size();
+        int task;
+        while (true) {
+            bool found = pop(queues[worker], task, true);
+            // No task is added after the start, when every queue is empty the batch is done
+            for (int v = 1; v < n && !found; v++) {
+                found = pop(queues[(worker + v) % n], task, false);
+            }
+            if (!found) {
+                return;
+            }
+            try {
+                body(task, worker);
+            } catch (...) {
+                lock_guard<mutex> guard(error_lock);
+                if (!error) {
+                    error = current_exception();
+                }
+            }
+        }
+    }
+};
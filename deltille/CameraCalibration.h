@@ -7,6 +7,11 @@
 #include "deltille/DetectorParams.h"
 
 #include "ImagePreprocessing.h"
+#include "../WorkStealingPool.h"
+#include "../Profiler.h"
+#include "../UndistortMaps.h"
+#include "../CanonicalView.h"
+#include "../FrameStore.h"
 
 #define REFINE_AVG       0
 #define REFINE_BLEND      1
@@ -16,20 +21,31 @@
 #define REFINE_FP_IDEAL 5
 #define REFINE_FP_INTERSECTION 6
 
+/* Points of the fronto parallel iterations: detected in the undistorted frame, or detected
+ * once in the distorted frame by collect_points and undistorted alone */
+#define FP_UNDISTORT_IMAGE  0
+#define FP_UNDISTORT_POINTS 1
+#define FRONTO_PARALLEL_UNDISTORT FP_UNDISTORT_POINTS
+
 using namespace findSaddlesPoints;
 
 class CameraCalibration {
 public:
 	vector<vector<Point2f>> set_points;
 	vector<Mat> frames;
+	vector<vector<Point2f>> frame_points;   // Points of collect_points in the order of frames, empty if not found
 	vector<Point3f> object_points;
 	vector<Point3f> object_points_image;
 	VideoCapture cap;
+	FrameStore store;                   // Frames decoded before, read instead of cap if it is open
 	Mat camera_matrix;
 	Mat dist_coeffs;
 	int w;
 	int h;
 	Size image_size;
+	UndistortMaps view_maps;            // Maps of undistort_image
+	UndistortMaps search_maps;          // Maps with the same camera matrix, for the search of points
+	CanonicalView canonical_view;       // Board region of the fronto parallel view
 	CameraCalibration(VideoCapture &cap) {
 		this -> cap = cap;
 		if ( !cap.isOpened() ) {
@@ -50,17 +66,20 @@ public:
 
 	void collect_points_fronto_parallel(int refine_type, int refine_fronto_parallel_type);
 	/**
-	* @brief Skip f frames using a simple for,
+	* @brief Skip f frames using a simple for, the frames are grabbed and not retrieved.
+	* Nothing is decoded with a frame store
 	*
 	* @param cap Videocapture reference
 	* @param f number of frames to be skiped
 	*/
 	void skip_frames(VideoCapture &cap, int f) {
-		Mat frame;
+		if (store.is_open()) {
+			return;
+		}
+		PROFILE_SCOPE(PROFILE_DECODE);
 		for (int i = 0; i < f; i++) {
-			cap >> frame;
+			cap.grab();
 		}
-		frame.release();
 	}
 	/**
 	* @brief Remove the distortion of the image, the result its only for visualization pourposes
@@ -72,22 +91,10 @@ public:
 	* @param dist_coeffs   Distortion coefficients
 	*/
 	void undistort_image(Mat & frame) {
-		Mat rview, map1, map2;
-		Size imageSize(h, w);
-		initUndistortRectifyMap(camera_matrix,
-		                        dist_coeffs,
-		                        Mat(),
-		                        getOptimalNewCameraMatrix(camera_matrix, dist_coeffs, imageSize, 1, imageSize, 0),
-		                        imageSize,
-		                        CV_16SC2,
-		                        map1,
-		                        map2);
-
-		remap(frame, rview, map1, map2, INTER_LINEAR);
-		rview.copyTo(frame);
-		rview.release();
-		map1.release();
-		map2.release();
+		Mat rview;
+		view_maps.update(camera_matrix, dist_coeffs, Size(h, w));
+		remap_tiled(frame, rview, view_maps);
+		swap(frame, rview);
 	}
 
 	/**
@@ -137,7 +144,15 @@ public:
 		while (selected_frames < n_frames && max_points * n_rows * n_columns > selected_frames) {
 			vector<Point2f> pattern_points;
 
-			if (!cap.read(frame)) {
+			bool read;
+			if (store.is_open()) {
+				// The frames are drawn, the store gives a copy
+				read = store.read(f, frame);
+			} else {
+				PROFILE_SCOPE(PROFILE_DECODE);
+				read = cap.read(frame);
+			}
+			if (!read) {
 				cout << "FinishVideo at frame " << f << endl;
 				break;//return false;
 			}
@@ -249,7 +264,9 @@ public:
 		}
 	}
 	/**
-	* @brief Search pattern points of choosen frames and save the points in the set_points array
+	* @brief Search pattern points of choosen frames and save the points in the set_points array,
+	* the frames are searched in parallel and the points are saved in the order of the frames.
+	* The points of every frame are kept in frame_points for the fronto parallel iterations
 	*
 	* @param cap           VideoCapture reference
 	* @param w             Width of the frame
@@ -258,12 +275,20 @@ public:
 	*/
 	void collect_points() {
 		set_points.clear();
+		vector<vector<Point2f>> pattern_points(frames.size());
+		vector<char> found(frames.size(), 0);
+		WorkStealingPool pool;
+		pool.run(frames.size(), [&](int f, int worker) {
+			found[f] = find_points_in_frame(frames[f], pattern_points[f]);
+		});
 		for (int f = 0; f < frames.size(); f++) {
-			vector<Point2f> pattern_points;
-			if (find_points_in_frame(frames[f], pattern_points)) {
-				set_points.push_back(pattern_points);
+			if (found[f]) {
+				set_points.push_back(pattern_points[f]);
+			} else {
+				pattern_points[f].clear();
 			}
 		}
+		frame_points.swap(pattern_points);
 	}
 	void calibrate_camera_iterative(int n_iterations, int n_frames, int grid_rows, int grid_cols) {
 		Mat frontoParallel = Mat::zeros(Size(h, w), CV_8UC3);
@@ -361,8 +386,8 @@ void CameraCalibration::collect_points_fronto_parallel(int refine_type, int refi
 	Size boardSize(8, 5);
 	int n_points = 42;
 	Mat frame;
-	Mat map1, map2;
 	Mat input_undistorted;
+	Mat img_out;
 	//vector<Point3f> points_real;
 	vector<Point2f> temp(n_points);
 	vector<Point2f> temp2(n_points);
@@ -372,35 +397,44 @@ void CameraCalibration::collect_points_fronto_parallel(int refine_type, int refi
 	vector<Point2f> points_fronto_parallel;
 
 	set_points.clear();
+	if (FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_IMAGE) {
+		search_maps.update(camera_matrix, dist_coeffs, imageSize, UNDISTORT_KEEP_CAMERA);
+	}
+	// The canonical points are 64 units apart
+	canonical_view.set_region(object_points_image, 64 * CANONICAL_MARGIN);
 
 	for (int f = 0; f < frames.size(); f++) {
 		points_undistorted.clear();
 		points_fronto_parallel.clear();
 		frames[f].copyTo(frame);
-		frame.copyTo(input_undistorted);
-		undistort_image(input_undistorted);
-		imshow("Undistort", input_undistorted);
-
-		undistort(frame, input_undistorted, camera_matrix, dist_coeffs);
-		// imshow("UndistortInput", input_undistorted);
-		if (!find_points_in_frame(input_undistorted, points_undistorted)) {
-			cout << "Not found in undistort" << endl;
-			continue;
+		if (FRONTO_PARALLEL_UNDISTORT == FP_UNDISTORT_POINTS) {
+			if (f >= frame_points.size() || frame_points[f].size() != n_points) {
+				cout << "Not found in distort" << endl;
+				continue;
+			}
+			// Only the points of collect_points are undistorted, the frame is not
+			PROFILE_SCOPE(PROFILE_UNDISTORT);
+			undistortPoints(frame_points[f], points_undistorted, camera_matrix, dist_coeffs, Mat(), camera_matrix);
 		} else {
-			cout << "found" << endl;
+			remap_tiled(frame, input_undistorted, search_maps);
+			imshow("Undistort", input_undistorted);
+			// imshow("UndistortInput", input_undistorted);
+			if (!find_points_in_frame(input_undistorted, points_undistorted)) {
+				cout << "Not found in undistort" << endl;
+				continue;
+			} else {
+				cout << "found" << endl;
+			}
 		}
 
-		Mat homography = cv::findHomography(points_undistorted, object_points_image);
+		// The canonical view samples the distorted frame once, through the inverse homography and the distortion
 		Mat inv_homography = cv::findHomography(object_points_image, points_undistorted);
-		Mat img_in  = input_undistorted.clone();
-		Mat img_out = input_undistorted.clone();
-		cv::warpPerspective(img_in, img_out, homography, imageSize);
-		// imshow("img_in", img_in);
+		canonical_view.render(frame, img_out, inv_homography, camera_matrix, dist_coeffs);
 		// imshow("img_out", img_out);
 		
 		// imwrite("frontoParallel/fp_" + to_string(f)+".png", img_out);
 
-		for (int p = 0; p < n_points; p++) 
+		for (int p = 0; p < n_points && !input_undistorted.empty(); p++) 
 			circle(input_undistorted, points_undistorted[p], 2, Scalar(0, 255, 0));
 
 		// HERE
@@ -415,20 +449,16 @@ void CameraCalibration::collect_points_fronto_parallel(int refine_type, int refi
 			}
 			
 			vector<Point2f> object_p_canonical;
+			for (int p = 0; p < n_points; p++) {
+				object_p_canonical.push_back(canonical_view.to_canonical(points_fronto_parallel[p]));
+			}
 			if (refine_fronto_parallel_type == REFINE_FP_IDEAL) {
 				for (int p = 0; p < n_points; p++) {
-					object_p_canonical.push_back(Point2f((points_fronto_parallel[p].x + object_points_image[p].x) / 2.0 ,
-					                                     (points_fronto_parallel[p].y + object_points_image[p].y) / 2.0 ));
+					object_p_canonical[p] = Point2f((object_p_canonical[p].x + object_points_image[p].x) / 2.0 ,
+					                                (object_p_canonical[p].y + object_points_image[p].y) / 2.0 );
 				}
 			} else if (refine_fronto_parallel_type == REFINE_FP_INTERSECTION) {
-				for (int p = 0; p < n_points; p++) {
-					object_p_canonical.push_back(points_fronto_parallel[p]);
-				}
 				//refine_points_intersection(object_p_canonical);
-			} else {
-				for (int p = 0; p < n_points; p++) {
-					object_p_canonical.push_back(points_fronto_parallel[p]);
-				}
 			}
 
 			vector<Point2f> new_points2D(n_points);
@@ -453,14 +483,13 @@ void CameraCalibration::collect_points_fronto_parallel(int refine_type, int refi
 			//start_set_points.push_back(points_undistorted);
 			//new_set_points.push_back(new_points2D);
 			imshow("FrontoParallel", img_out);
-			imshow("Reproject", input_undistorted);
+			if (!input_undistorted.empty()) {
+				imshow("Reproject", input_undistorted);
+			}
 			imshow("Distort", frame);
 		} else {
 			cout << "Not found in FP" << endl;
 		}
-		img_in.release();
-		img_out.release();
-		homography.release();
 		inv_homography.release();
 		waitKey(1);
 	}
@@ -556,8 +585,10 @@ public:
 		cout << "set_points size: "<<set_points.size();
 		objectPoints.resize(set_points.size(), object_points);
 
+		ProfileScope calibrate_scope(PROFILE_CALIBRATE);
 		double rms = calibrateCamera(objectPoints, set_points, image_size, camera_matrix,
 		                             dist_coeffs, rvecs, tvecs);
+		calibrate_scope.stop();
 		cout << camera_matrix << endl;
 		cout << dist_coeffs   << endl;
 		cout << "rms " << rms << endl;
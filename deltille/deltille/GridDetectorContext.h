@@ -985,9 +985,7 @@ public:
 
     while (true) {
       BoardObservation obs;
-#if DEBUG_TIMING
-      auto t3 = high_resolution_clock::now();
-#endif
+      ProfileScope grid_scope(PROFILE_GRID_SEARCH);
       findBestGrid(board_size, obs.board);
       obs.indexed = false;
       // squeeze all corner locations on this board...
@@ -1015,11 +1013,7 @@ public:
       cv::waitKey(0);
 #endif
 
-#ifdef DEBUG_TIMING
-      auto t4 = high_resolution_clock::now();
-      printf("Indexing took: %.3f ms , found %d corners\n",
-             duration_cast<microseconds>(t4 - t3).count() / 1000.0, cnt);
-#endif
+      grid_scope.stop();
       // found less than 10 corners on a board... stop here
       if (cnt < 9)
         break;
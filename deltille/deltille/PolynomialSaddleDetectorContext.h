@@ -28,6 +28,7 @@
 
 #include "DetectorTools.h"
 #include "PolynomialFit.h"
+#include "../../Profiler.h"
 
 #include <chrono>
 #include <cmath>
@@ -60,33 +61,23 @@ public:
 
 public:
   PolynomialSaddleDetectorContext(const cv::Mat &img) {
-#ifdef DEBUG_TIMING
-    auto t0 = high_resolution_clock::now();
-#endif
-    preprocessImage(img);
-#ifdef DEBUG_TIMING
-    auto t1 = high_resolution_clock::now();
-    printf("Filtering took: %.3f ms\n",
-           duration_cast<microseconds>(t1 - t0).count() / 1000.0);
-#endif
+    {
+      PROFILE_SCOPE(PROFILE_SADDLE_FILTERING);
+      preprocessImage(img);
+    }
     num_iterations = SaddlePointType::isTriangular ? 5 : 20;
   }
 
 
   int findSaddles(std::vector<SaddlePointType> &refclust) {
 
-#ifdef DEBUG_TIMING
-    auto t0 = high_resolution_clock::now();
-#endif
     std::vector<cv::Point> locations;
+    {
+      PROFILE_SCOPE(PROFILE_SADDLE_FILTERING);
+      getInitialSaddleLocations(input_lowres, locations);
+    }
 
-    getInitialSaddleLocations(input_lowres, locations);
-
-#ifdef DEBUG_TIMING
-    auto t1 = high_resolution_clock::now();
-    printf("Preprocessing took: %.3f ms\n",
-           duration_cast<microseconds>(t1 - t0).count() / 1000.0);
-#endif
+    ProfileScope refinement_scope(PROFILE_SADDLE_REFINEMENT);
     std::vector<SaddlePointType> refined;
     lowresFitting.saddleSubpixelRefinement(lowres, locations, refined,
                                            num_iterations, true);
@@ -114,23 +105,17 @@ public:
     refined.resize(std::remove_if(refined.begin(), refined.end(),
                                   PointIsInf<SaddlePointType>) -
                    refined.begin());
+    refinement_scope.stop();
 
-#ifdef DEBUG_TIMING
-    auto t2 = high_resolution_clock::now();
-    printf("Refinement took: %.3f ms\n",
-           duration_cast<microseconds>(t2 - t1).count() / 1000.0);
-#endif
     int num_clusters = 0;
     std::vector<int> cluster_ids;
 
     std::vector<typename SaddlePointType::ClusterDescType> cluster_stats;
-    clusterPoints2(refined, lowres.size(), cluster_ids, cluster_stats,
-                   num_clusters, 1.0);
-#ifdef DEBUG_TIMING
-    auto t3 = high_resolution_clock::now();
-    printf("Clustering took: %.3f ms\n",
-           duration_cast<microseconds>(t3 - t2).count() / 1000.0);
-#endif
+    {
+      PROFILE_SCOPE(PROFILE_CLUSTERING);
+      clusterPoints2(refined, lowres.size(), cluster_ids, cluster_stats,
+                     num_clusters, 1.0);
+    }
     refclust.resize(cluster_stats.size());
     for (size_t i = 0; i < cluster_stats.size(); i++)
       refclust[i] = cluster_stats[i];
@@ -149,10 +134,8 @@ public:
     }
 #endif
 
-#ifdef DEBUG_TIMING
-    auto t4 = high_resolution_clock::now();
-#endif
     if (SaddlePointType::isTriangular) {
+      PROFILE_SCOPE(PROFILE_SADDLE_REFINEMENT);
       // a bit hackier monkey saddle second filter, that checks if points would
       // converge to the same location with larger scale...
       PolynomialFit<SaddlePointType> tempFitting;
@@ -191,17 +174,12 @@ public:
                   cv::FONT_HERSHEY_PLAIN, 0.8, cv::Scalar(255, 0, 255));
     }
     imshow("detections", DEBUG);
-#endif
-#ifdef DEBUG_TIMING
-    auto t5 = high_resolution_clock::now();
 #endif
     return int(refclust.size());
   }
 
   int finalizeSaddles(std::vector<BoardObservation> &boards) {
-#ifdef DEBUG_TIMING
-    auto t1 = high_resolution_clock::now();
-#endif
+    PROFILE_SCOPE(PROFILE_SADDLE_REFINEMENT);
     // finally, refine at full scale..    .
     for (size_t i = 0; i < boards.size(); ++i) {
       BoardObservation &obs = boards[i];
@@ -237,11 +215,6 @@ public:
         }
       }
     }
-#ifdef DEBUG_TIMING
-    auto t2 = high_resolution_clock::now();
-    printf("Final refinement took: %.3f ms\n",
-           duration_cast<microseconds>(t2 - t1).count() / 1000.0);
-#endif
     return 0;
   }
 
@@ -269,6 +269,7 @@ bool findSaddleCenters(Mat &gray, vector<Point2f> &order_points, Mat frame, bool
         // putText(InitialPointsFounded, to_string(p),  points2f[p], FONT_HERSHEY_COMPLEX_SMALL, 0.4,  cvScalar(255, 255, 255), 1);
     }
 
+    ProfileScope grid_scope(PROFILE_GRID_SEARCH);
     if (FP)
     {
             /* Filter points with ideals points  */
@@ -305,6 +306,7 @@ bool findSaddleCenters(Mat &gray, vector<Point2f> &order_points, Mat frame, bool
             order_points_in_lines(9, 8, 5, points2f);
         }
     }
+    grid_scope.stop();
 
     for (int p = 0; p < points2f.size(); p++) {
         circle(InitialPointsFounded, points2f[p], 1, Scalar(0, 0, 255), -1);
@@ -319,7 +321,6 @@ bool findSaddleCenters(Mat &gray, vector<Point2f> &order_points, Mat frame, bool
         }
         found = order_points.size() == 42 ;
     }
-    waitKey(1);
     return found;
 }
 
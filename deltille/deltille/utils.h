@@ -30,6 +30,67 @@ template <class T> inline void doNotOptimizeAway(T &&d) {
   asm volatile("" : "+r"(d));
 }
 
+/**
+ * A class for simple wall clock timing
+ */
+class Timer {
+public:
+  typedef std::chrono::milliseconds Milliseconds;
+
+public:
+  inline Timer() { start(); }
+
+  /**
+   * starts the timer
+   */
+  inline void start() { _start_time = std::chrono::high_resolution_clock::now(); }
+
+  /**
+   * \return elapsed time since the last call to start() and resets the
+   * start point
+   */
+  inline Milliseconds stop() {
+    Milliseconds t = elapsed();
+    start();
+    return t;
+  }
+
+  /**
+   * \return elapsed time since the last call to start()
+   */
+  inline Milliseconds elapsed() const {
+    return std::chrono::duration_cast<Milliseconds>(
+        std::chrono::high_resolution_clock::now() - _start_time);
+  }
+
+  /**
+   * \return elapsed time since the last call to start() in fractional
+   * milliseconds, for stages shorter than a millisecond
+   */
+  inline double elapsedMilliseconds() const {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::high_resolution_clock::now() - _start_time)
+        .count();
+  }
+
+private:
+  std::chrono::high_resolution_clock::time_point _start_time;
+}; // Timer
+
+/**
+ * Runs 'Func' for 'N_rep" times and reports the average elapsed time in
+ * milliseconds
+ */
+template <class Func, class... Args>
+inline double TimeCode(int N_rep, Func &&f, Args... args) {
+  Timer timer;
+  for (int i = 0; i < N_rep; ++i)
+    f(args...);
+  auto t = timer.elapsedMilliseconds() / static_cast<double>(N_rep);
+  doNotOptimizeAway(t);
+  return t;
+}
+
 #if defined(WITH_BOOST)
 
 #include <boost/program_options.hpp>
@@ -108,50 +169,6 @@ private:
   boost::program_options::variables_map _vm;
 }; // ProgramOptions
 
-/**
- * A class for simple wall clock timing
- */
-class Timer {
-public:
-  typedef std::chrono::milliseconds Milliseconds;
-
-public:
-  inline Timer() { start(); }
-
-  /**
-   * starts the timer
-   */
-  void start();
-
-  /**
-   * \return elapsed time since the last call to start() and resets the
-   * start point
-   */
-  Milliseconds stop();
-
-  /**
-   * \return elapsed time since the last call to start()
-   */
-  Milliseconds elapsed() const;
-
-private:
-  std::chrono::high_resolution_clock::time_point _start_time;
-}; // Timer
-
-/**
- * Runs 'Func' for 'N_rep" times and reports the average elapsed time in
- * milliseconds
- */
-template <class Func, class... Args>
-inline double TimeCode(int N_rep, Func &&f, Args... args) {
-  Timer timer;
-  for (int i = 0; i < N_rep; ++i)
-    f(args...);
-  auto t = timer.stop().count() / static_cast<double>(N_rep);
-  doNotOptimizeAway(t);
-  return t;
-}
-
 #endif
 
 #endif
\ No newline at end of file
@@ -9,6 +9,10 @@ using namespace std;
 
 #define CALIBRATION_LIFECAM_VIDEO     "calibration_videos/Triangles_Blue.mp4"
 
+/* Profile of the calibration, written at the end */
+#define PROFILE_TRACE_FILE      "calibration_trace.json"
+#define PROFILE_HISTOGRAM_FILE  "calibration_profile.csv"
+
 // void window_setup() {
 //     int window_w = 640;
 //     int window_h = 480;
@@ -89,10 +93,22 @@ int main( int argc, char** argv ) {
     
     window_setup();
     CameraCalibrationDeltille camera_calibration(cap, 8, 5);
+    // Frames of the video decoded before by DecodeVideo, if they exist and are the frames of the video
+    if (camera_calibration.store.open(frame_store_path(CALIBRATION_LIFECAM_VIDEO))) {
+        if (camera_calibration.store.matches(cap, camera_calibration.image_size)) {
+            cout << "Reading " << camera_calibration.store.size() << " frames from " << frame_store_path(CALIBRATION_LIFECAM_VIDEO) << endl;
+        } else {
+            cout << frame_store_path(CALIBRATION_LIFECAM_VIDEO) << " is not a store of this video, decoding it" << endl;
+            camera_calibration.store.close();
+        }
+    }
     int n_frames  = 40;
     int grid_cols = 4;
     int grid_rows = 3;
     camera_calibration.calibrate_camera_iterative(10, n_frames, grid_rows, grid_cols);
+    profiler_print_summary(cout);
+    profiler_write_trace(PROFILE_TRACE_FILE);
+    profiler_write_histograms(PROFILE_HISTOGRAM_FILE);
 
 
 
@@ -7,6 +7,9 @@
 #include "ImagePreprocessing.h"
 #include "PatternSearch.h"
 #include "CalibrateCamera.h"
+#include "FrameQueue.h"
+#include "UndistortMaps.h"
+#include "PlanarPose.h"
 #include "libs/OBJ_Loader.h"
 
 using namespace std;
@@ -33,6 +36,7 @@ Mat camera_matrix;
 Mat distortion_coeffs;
 vector<PatternPoint> pattern_points;
 VideoCapture cap(CALIBRATION_PS3_VIDEO);
+FrameQueue *frame_queue;                // Decodes cap in its own thread, only the newest frame is shown
 
 vector<GLint> obj_model;
 
@@ -41,14 +45,15 @@ void draw(void* userdata) {
     ogl::render(data->arr, data->indices, ogl::TRIANGLES);
 }
 
-Mat frame, original, frame_gray, thresh, masked;
+Mat frame, original, frame_gray, masked;
 int detected_points;
-Mat rvec(3, 1, DataType<double>::type);
-Mat tvec(3, 1, DataType<double>::type);
 
 int w;
 int h;
 int keep_per_frames = 2;
+int segmentation_method = SEGMENTATION_LEGACY;
+PatternTracker tracker;
+DetectionWorkspace workspace;
 Point mask_points[1][4];
 Mat pattern = imread("pattern.png");
 
@@ -93,11 +98,14 @@ void draw_cube() {
     glEnd();
 
 }
-Mat rview, map1, map2;
+Mat rview;
+UndistortMaps undistort_maps;
 Size boardSize(5, 4);
 int squareSize = 45;
 int points = 20;
-Mat rotation;
+vector<Point3f> objectPoints;
+vector<Point2f> image_points(points);
+PlanarPoseSolver pose_solver;            // Pose of the board in the undistorted frame
 Vec3d eulerAngles;
 Vec3d eulerAnglesTranform;
 Mat m_homography;
@@ -118,50 +126,35 @@ void display(void) {
     glLineWidth(5);
     draw_cube();
 
-    cap >> frame ;
+    if (!frame_queue->read(frame)) {
+        return;
+    }
     w = frame.rows;
     h = frame.cols;
     Size imageSize(h, w);
 
-    initUndistortRectifyMap(camera_matrix,
-                            distortion_coeffs,
-                            Mat(),
-                            getOptimalNewCameraMatrix(camera_matrix, distortion_coeffs, imageSize, 1, imageSize, 0),
-                            imageSize,
-                            CV_16SC2,
-                            map1,
-                            map2);
-
-    remap(frame, rview, map1, map2, INTER_LINEAR);
-    map1.release();
-    map2.release();
-    frame.release();
-    frame = rview;
+    if (undistort_maps.update(camera_matrix, distortion_coeffs, imageSize)) {
+        // The points are found in the undistorted frame, of the new camera matrix
+        pose_solver.set_camera(undistort_maps.new_camera_matrix, Mat());
+    }
+    remap_tiled(frame, rview, undistort_maps);
+    swap(frame, rview);
 
     original = frame.clone();
-    clean_using_mask(frame, w, h, mask_points);
     masked = frame.clone();
     cvtColor( frame, frame_gray, CV_BGR2GRAY );
-    adaptiveThreshold(frame_gray, thresh, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 41, 12);
-    segmentar(frame_gray, frame_gray, thresh, w, h);
-    detected_points = find_pattern_points(frame_gray, masked, original, w, h, mask_points, pattern_points, keep_per_frames);
+    tracker.predict(pattern_points, w, h, mask_points);
+    clean_using_mask(frame_gray, mask_points);
+    detected_points = find_pattern_points_tracked(frame_gray, masked, original, w, h, mask_points, pattern_points, keep_per_frames, segmentation_method, tracker, workspace);
+    bool posed = false;
     if (detected_points == 20) {
-        vector<Point3f> objectPoints;
-        for ( int i = 0; i < boardSize.height; i++ ) {
-            for ( int j = 0; j < boardSize.width; j++ ) {
-                objectPoints.push_back(Point3f(  float(j * squareSize),
-                                                 float(i * squareSize), 0));
-            }
-        }
-        vector<Point2f> temp(points);
         for (int i = 0; i < 20; i++) {
-            temp[i] = pattern_points[i].to_point2f();
+            image_points[i] = pattern_points[i].to_point2f();
         }
-        solvePnP(Mat(objectPoints), Mat(temp), camera_matrix, distortion_coeffs, rvec, tvec);
-
-        Rodrigues(rvec, rotation);
-        getEulerAngles(rotation, eulerAngles);
-
+        // Without a pose the board is not drawn in this frame
+        posed = pose_solver.euler_angles(objectPoints, image_points, eulerAngles);
+    }
+    if (posed) {
         float yaw = eulerAngles[1];
         float pitch = eulerAngles[0];
         float roll = eulerAngles[2];
@@ -197,11 +190,16 @@ void display(void) {
     frame.release();
     original.release();
     masked.release();
-    thresh.release();
 }
 
 void init(void) {
     glClearColor( 0, 1, 1, 1);
+    for ( int i = 0; i < boardSize.height; i++ ) {
+        for ( int j = 0; j < boardSize.width; j++ ) {
+            objectPoints.push_back(Point3f(  float(j * squareSize),
+                                             float(i * squareSize), 0));
+        }
+    }
     /*camera_matrix = (Mat_<double>(3, 3) << 619.8529149086295, 0, 317.8602231908566,
                         0, 623.7464457495411, 257.8088409771084,
                         0, 0, 1);
@@ -265,6 +263,15 @@ void init(void) {
 
 }
 
+/**
+ * @details Stop the decoder thread at exit. GLUT leaves the main loop through exit(), which
+ * destroys cap while the thread may still be reading it, the handler runs before that
+ */
+void stop_decoding() {
+    delete frame_queue;
+    frame_queue = 0;
+}
+
 int main(int argc, char **argv) {
     if ( !cap.isOpened() ) {
         cout << "Cannot open the video file. \n";
@@ -276,6 +283,9 @@ int main(int argc, char **argv) {
     glutCreateWindow("red 3D lighted cube");
     glutDisplayFunc(display);
     init();
+    frame_queue = new FrameQueue(cap, 2, FRAME_QUEUE_LATEST);
+    // Registered after cap was built, so it runs before cap is destroyed
+    atexit(stop_decoding);
     glutMainLoop();
     return 0;
 }
\ No newline at end of file
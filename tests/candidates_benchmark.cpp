@@ -0,0 +1,87 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include <iostream>
+#include <iomanip>
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Build the 20 ring candidates of the pattern plus clutter candidates
+ * (cables, text, other circular objects) spread over a 1920x1080 frame
+ *
+ * @param n_clutter Number of clutter candidates
+ * @param rng Random generator
+ * @return Ring candidates
+ */
+vector<PatternPoint> synthetic_candidates(int n_clutter, RNG &rng) {
+  vector<PatternPoint> candidates;
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 5; x++) {
+      candidates.push_back(PatternPoint(600 + x * 90, 300 + y * 90, 20, 1));
+    }
+  }
+  for (int c = 0; c < n_clutter; c++) {
+    candidates.push_back(PatternPoint(rng.uniform(0.0f, 1920.0f),
+                                      rng.uniform(0.0f, 1080.0f),
+                                      rng.uniform(2.0f, 30.0f),
+                                      rng.uniform(2, 50)));
+  }
+  return candidates;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int clutter[4] = {0, 100, 500, 2000};
+  int repetitions = 20;
+  RNG rng(12345);
+
+  cout << "candidates\tneighbors ref\tneighbors grid\tfarthest ref\tfarthest hull" << endl;
+  for (int s = 0; s < 4; s++) {
+    vector<PatternPoint> candidates = synthetic_candidates(clutter[s], rng);
+    vector<int> count_reference, count_grid;
+    vector<Vec2i> neighbors;
+    vector<PatternPoint> far_reference, far_hull;
+
+    double t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      neighbors.clear();
+      count_near_candidates_reference(candidates, count_reference, neighbors);
+    }
+    double t_reference = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      neighbors.clear();
+      count_near_candidates(candidates, count_grid, neighbors);
+    }
+    double t_grid = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      far_reference = more_distant_points_reference(candidates);
+    }
+    double t_far_reference = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      far_hull = more_distant_points(candidates);
+    }
+    double t_far_hull = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    bool same = count_reference == count_grid &&
+                abs(far_reference[0].distance(far_reference[1]) - far_hull[0].distance(far_hull[1])) < 1e-3;
+    cout << candidates.size() << "\t\t"
+         << std::fixed << std::setprecision(3) << t_reference << "ms\t"
+         << t_grid << "ms\t"
+         << t_far_reference << "ms\t"
+         << t_far_hull << "ms\t"
+         << (same ? "identical" : "DIFFERENT") << endl;
+    if (!same) {
+      return -1;
+    }
+  }
+  return 0;
+}
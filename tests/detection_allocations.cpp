@@ -0,0 +1,134 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+using namespace cv;
+using namespace std;
+
+static long allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+/**
+ * @details Build a synthetic frame with the 5x4 ring pattern
+ *
+ * @param w image width (rows)
+ * @param h image height (cols)
+ * @return BGR frame
+ */
+Mat synthetic_frame(int w, int h) {
+  Mat frame(w, h, CV_8UC3, Scalar(200, 200, 200));
+  float radio = h / 40.0;
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 5; x++) {
+      Point center(h * (0.25 + x * 0.12), w * (0.25 + y * 0.16));
+      circle(frame, center, radio * 1.6, Scalar(20, 20, 20), -1);
+      circle(frame, center, radio, Scalar(200, 200, 200), -1);
+    }
+  }
+  return frame;
+}
+
+/**
+ * @details Allocations of the opencv calls done by the labels path of the detection, the
+ * labels and the ellipses from moments are computed without opencv, only the mask uses
+ * minAreaRect. They are out of the control of the workspace
+ *
+ * @param points_2f Points of the mask, the same ones the detection used
+ */
+long opencv_allocations(vector<Point2f> &points_2f) {
+  long start = allocations;
+  minAreaRect(Mat(points_2f));
+  return allocations - start;
+}
+
+/**
+ * @details Segmentation and detection of one frame with the workspace, the gray conversion
+ * is done before because it is not part of the detection
+ *
+ * @return Number of pattern points found
+ */
+int search_frame(Mat &frame, int w, int h, Point mask_points[][4], vector<PatternPoint> &pattern_points, int &keep_per_frames, DetectionWorkspace &workspace, long &used) {
+  cvtColor(frame, workspace.frame_gray, CV_BGR2GRAY);
+  long start = allocations;
+  threshold_frame(workspace.frame_gray, workspace.thresh, w, h, SEGMENTATION_FUSED, workspace.integral);
+  int detected_points = detect_pattern_points(workspace.frame_gray, w, h, mask_points, pattern_points, keep_per_frames, Point(0, 0), workspace);
+  used = allocations - start;
+  return detected_points;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int w = 720;
+  int h = 1280;
+  int frames = 10;
+  Mat frame = synthetic_frame(w, h);
+  Point mask_points[1][4];
+  vector<PatternPoint> pattern_points;
+  int keep_per_frames = 2;
+  DetectionWorkspace workspace;
+  vector<Point2f> points_2f(20);
+
+  /* Warm-up frame, searched twice: the first search orders the grid and the second one
+   * tracks it, so the buffers of both paths have grown */
+  long warmup = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    long used;
+    int detected_points = search_frame(frame, w, h, mask_points, pattern_points, keep_per_frames, workspace, used);
+    if (detected_points != 20) {
+      cout << "warm-up: " << detected_points << " points detected" << endl;
+      return -1;
+    }
+    warmup += used;
+  }
+  cout << "warm-up frame\tworkspace " << warmup << endl;
+
+  long released_allocations = 0;
+  for (int f = 1; f < frames; f++) {
+    long used;
+    int detected_points = search_frame(frame, w, h, mask_points, pattern_points, keep_per_frames, workspace, used);
+    if (detected_points != 20) {
+      cout << "frame " << f << ": " << detected_points << " points detected" << endl;
+      return -1;
+    }
+    points_2f.assign(workspace.points_2f.begin(), workspace.points_2f.end());
+    long baseline = opencv_allocations(points_2f);
+
+    vector<PatternPoint> points = pattern_points;
+    long start = allocations;
+    {
+      Mat frame_gray, thresh;
+      PatternDetection detection;
+      cvtColor(frame, frame_gray, CV_BGR2GRAY);
+      threshold_frame(frame_gray, thresh, w, h, SEGMENTATION_FUSED);
+      detect_pattern_points(frame_gray, w, h, mask_points, points, keep_per_frames, Point(0, 0), detection);
+    }
+    long released = allocations - start;
+    released_allocations += released;
+
+    cout << "frame " << f << "\tpoints " << detected_points << "\tworkspace " << used
+         << "\topencv " << baseline << "\twithout workspace " << released << endl;
+    // After the warm-up everything that is still allocated comes from the opencv calls
+    if (used - baseline != 0) {
+      cout << "frame " << f << ": " << used - baseline << " allocations after the warm-up" << endl;
+      return -1;
+    }
+  }
+  cout << "steady state allocations per frame without workspace " << released_allocations / (frames - 1) << endl;
+  return 0;
+}
@@ -0,0 +1,468 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include "../SyntheticBoard.h"
+#include "../deltille/deltille/findSaddlesPoints.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Throughput and accuracy of every stage of the ring and deltille detectors over a corpus
+ * of frames with ground truth (see SyntheticCorpus.cpp), or over frames rendered in memory.
+ * Build with the deltille directory in the include path (-I deltille).
+ *
+ * Usage: detector_benchmark <label> <output_prefix> [rings_corpus|synthetic] [deltille_corpus|synthetic] [n_frames]
+ *
+ * Every run appends its rows to <output_prefix>.csv, use the commit hash as label to
+ * compare commits, and writes the same results to <output_prefix>_<label>.json
+ */
+
+/* Distance to the ground truth point of the same index over which a point is misordered,
+ * the neighbours of the grid are much further than the detection error */
+#define MISORDERED_DISTANCE 5.0
+
+static atomic<long> allocations(0);
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+/**
+ * @details Times and allocations of one stage over all the frames
+ */
+struct StageStats {
+  string name;
+  vector<double> ms;
+  long allocations;
+};
+
+/**
+ * @details Stages, detection rate and error of one pipeline
+ */
+struct PipelineStats {
+  string name;
+  vector<StageStats> stages;
+  int frames;
+  int detected;
+  int misordered;                       // Frames found but not in the order of the ground truth
+  double squared_error;
+  int matched_points;
+
+  PipelineStats(const string &name) : name(name), frames(0), detected(0), misordered(0), squared_error(0), matched_points(0) {}
+
+  StageStats &stage(const string &stage_name) {
+    for (int s = 0; s < stages.size(); s++) {
+      if (stages[s].name == stage_name) {
+        return stages[s];
+      }
+    }
+    StageStats stats;
+    stats.name = stage_name;
+    stats.allocations = 0;
+    stages.push_back(stats);
+    return stages.back();
+  }
+
+  double detection_rate() const {
+    return frames ? (double)detected / frames : 0;
+  }
+
+  double rms() const {
+    return matched_points ? sqrt(squared_error / matched_points) : 0;
+  }
+};
+
+/**
+ * @details Scoped measure of a stage, the time comes from the deltille Timer
+ */
+struct StageMeasure {
+  StageStats &stats;
+  Timer timer;
+  long start;
+
+  StageMeasure(StageStats &stats) : stats(stats), start(allocations.load()) {
+    timer.start();
+  }
+
+  ~StageMeasure() {
+    stats.ms.push_back(timer.elapsedMilliseconds());
+    stats.allocations += allocations.load() - start;
+  }
+};
+
+/**
+ * @details Frames of a corpus with the ground truth of every control point
+ */
+struct Corpus {
+  vector<Mat> frames;
+  vector<vector<Point2f> > points;
+};
+
+/**
+ * @details Load a corpus written by SyntheticCorpus, frames without points are skipped
+ *
+ * @param dir Corpus directory
+ * @param max_frames Maximum number of frames to load
+ * @param corpus Frames and ground truth output
+ * @return false if the corpus can not be read
+ */
+bool load_corpus(const string &dir, int max_frames, Corpus &corpus) {
+  ifstream csv((dir + "/points.csv").c_str());
+  if (!csv.is_open()) {
+    return false;
+  }
+  string line;
+  getline(csv, line);
+  vector<vector<Point2f> > points;
+  int f, p;
+  float x, y;
+  while (getline(csv, line)) {
+    if (sscanf(line.c_str(), "%d,%d,%f,%f", &f, &p, &x, &y) == 4) {
+      if (f >= points.size()) {
+        points.resize(f + 1);
+      }
+      points[f].push_back(Point2f(x, y));
+    }
+  }
+  for (f = 0; f < points.size() && corpus.frames.size() < max_frames; f++) {
+    if (points[f].empty()) {
+      continue;
+    }
+    char name[32];
+    sprintf(name, "/frame_%05d.png", f);
+    Mat frame = imread(dir + name);
+    if (frame.empty()) {
+      continue;
+    }
+    corpus.frames.push_back(frame);
+    corpus.points.push_back(points[f]);
+  }
+  return !corpus.frames.empty();
+}
+
+/**
+ * @details Render a corpus in memory with the camera of SyntheticCorpus
+ *
+ * @param board Board geometry
+ * @param n_frames Number of frames
+ * @param corpus Frames and ground truth output
+ */
+void render_corpus(const SyntheticBoard &board, int n_frames, Corpus &corpus) {
+  int w = 720;
+  int h = 1280;
+  SyntheticView view;
+  view.camera_matrix = (Mat_<double>(3, 3) << 0.9 * h, 0, h / 2.0, 0, 0.9 * h, w / 2.0, 0, 0, 1);
+  view.dist_coeffs = (Mat_<double>(1, 5) << -0.25, 0.08, 0.0005, -0.0005, -0.01);
+  view.blur_sigma = 0.8;
+  view.noise_sigma = 3;
+  RNG rng(12345);
+  for (int f = 0; f < n_frames; f++) {
+    if (!random_pose(board, view, w, h, rng)) {
+      continue;
+    }
+    Mat frame;
+    vector<Point2f> points;
+    render_board(board, view, w, h, f, frame);
+    project_board_points(board, view, points);
+    corpus.frames.push_back(frame);
+    corpus.points.push_back(points);
+  }
+}
+
+/**
+ * @details Compare the points found with the ground truth in order, point i must be the
+ * control point i. A frame with a point missing or misordered counts as a failure and its
+ * error is not added
+ *
+ * @return true if the frame was detected in the right order
+ */
+bool add_error(PipelineStats &stats, const vector<Point2f> &found, const vector<Point2f> &truth) {
+  if (found.size() != truth.size()) {
+    stats.misordered++;
+    return false;
+  }
+  double squared_error = 0;
+  for (int p = 0; p < found.size(); p++) {
+    double dx = found[p].x - truth[p].x;
+    double dy = found[p].y - truth[p].y;
+    if (dx * dx + dy * dy > MISORDERED_DISTANCE * MISORDERED_DISTANCE) {
+      stats.misordered++;
+      return false;
+    }
+    squared_error += dx * dx + dy * dy;
+  }
+  stats.squared_error += squared_error;
+  stats.matched_points += found.size();
+  stats.detected++;
+  return true;
+}
+
+/**
+ * @details Ring pipeline split in stages: segmentation, ring candidates by labeling and
+ * by contours with the ellipse fit, the whole point detection from the segmented frame
+ * and the grid ordering. Every frame is detected from scratch, without tracking
+ */
+void benchmark_rings(const Corpus &corpus, PipelineStats &stats) {
+  DetectionWorkspace workspace;
+  Point mask_points[1][4];
+  vector<PatternPoint> pattern_points;
+  vector<PatternPoint> ordered;
+  vector<Point2f> found;
+  PatternDetection detection;
+  GridOrderBuffers buffers;
+  Mat binary, copy;
+  const char *names[] = {"gray_threshold", "label_regions", "contours_ellipse_fit", "find_pattern_points", "order_points", "total"};
+  for (int s = 0; s < 6; s++) {
+    stats.stage(names[s]);
+  }
+  for (int f = 0; f < corpus.frames.size(); f++) {
+    const Mat &frame = corpus.frames[f];
+    int w = frame.rows;
+    int h = frame.cols;
+    {
+      StageMeasure measure(stats.stage("gray_threshold"));
+      cvtColor(frame, workspace.frame_gray, CV_BGR2GRAY);
+      workspace.region(w, h);
+      threshold_frame(workspace.frame_gray, workspace.thresh, w, h, SEGMENTATION_FUSED, workspace.integral);
+    }
+    workspace.frame_gray.copyTo(binary);
+
+    binary.copyTo(copy);
+    workspace.detection.clear();
+    {
+      StageMeasure measure(stats.stage("label_regions"));
+      label_regions(copy, Point(0, 0), workspace.labels);
+      ring_candidates(workspace.labels, workspace.detection.candidates, workspace.detection.fathers,
+                      workspace.detection.sons, workspace.detection.singles);
+    }
+
+    binary.copyTo(copy);
+    workspace.detection.clear();
+    {
+      StageMeasure measure(stats.stage("contours_ellipse_fit"));
+      contour_candidates(copy, Point(0, 0), workspace);
+    }
+
+    binary.copyTo(copy);
+    pattern_points.clear();
+    int keep_per_frames = 0;
+    int detected_points;
+    {
+      StageMeasure measure(stats.stage("find_pattern_points"));
+      detected_points = detect_pattern_points(copy, w, h, mask_points, pattern_points, keep_per_frames, Point(0, 0), workspace);
+    }
+
+    ordered.clear();
+    {
+      StageMeasure measure(stats.stage("order_points"));
+      order_points(ordered, workspace.detection.points, detection, buffers);
+    }
+
+    stats.stage("total").ms.push_back(stats.stage("gray_threshold").ms.back() + stats.stage("find_pattern_points").ms.back());
+
+    stats.frames++;
+    if (detected_points == 20 && pattern_points.size() == 20) {
+      found.clear();
+      for (int p = 0; p < pattern_points.size(); p++) {
+        found.push_back(pattern_points[p].center());
+      }
+      add_error(stats, found, corpus.points[f]);
+    }
+  }
+  StageStats &total = stats.stage("total");
+  total.allocations = stats.stage("gray_threshold").allocations + stats.stage("find_pattern_points").allocations;
+}
+
+/**
+ * @details Deltille pipeline split in stages: the saddle detection alone and the whole
+ * findSaddleCenters with the filtering and the ordering of the points
+ */
+void benchmark_deltille(const Corpus &corpus, PipelineStats &stats) {
+  Mat gray;
+  vector<MonkeySaddlePointSpherical> saddles;
+  vector<Point2f> found;
+  const char *names[] = {"gray", "find_saddles", "find_saddle_centers", "total"};
+  for (int s = 0; s < 4; s++) {
+    stats.stage(names[s]);
+  }
+  for (int f = 0; f < corpus.frames.size(); f++) {
+    const Mat &frame = corpus.frames[f];
+    {
+      StageMeasure measure(stats.stage("gray"));
+      cvtColor(frame, gray, CV_BGR2GRAY);
+    }
+    {
+      StageMeasure measure(stats.stage("find_saddles"));
+      PolynomialSaddleDetectorContext<MonkeySaddlePointSpherical, uint16_t, double> detector(gray);
+      saddles.clear();
+      detector.findSaddles(saddles);
+    }
+    bool ok;
+    {
+      StageMeasure measure(stats.stage("find_saddle_centers"));
+      ok = findSaddlesPoints::findSaddleCenters(gray, found, frame);
+    }
+
+    stats.stage("total").ms.push_back(stats.stage("gray").ms.back() + stats.stage("find_saddle_centers").ms.back());
+
+    stats.frames++;
+    if (ok) {
+      add_error(stats, found, corpus.points[f]);
+    }
+  }
+  StageStats &total = stats.stage("total");
+  total.allocations = stats.stage("gray").allocations + stats.stage("find_saddle_centers").allocations;
+}
+
+/**
+ * @details Percentile of the stage times, nearest rank
+ */
+double percentile(vector<double> ms, double p) {
+  if (ms.empty()) {
+    return 0;
+  }
+  sort(ms.begin(), ms.end());
+  int rank = min((int)ms.size() - 1, max(0, (int)ceil(p / 100 * ms.size()) - 1));
+  return ms[rank];
+}
+
+double mean(const vector<double> &ms) {
+  double sum = 0;
+  for (int i = 0; i < ms.size(); i++) {
+    sum += ms[i];
+  }
+  return ms.empty() ? 0 : sum / ms.size();
+}
+
+/**
+ * @details Append the results to a CSV file, the header is written only in a new file
+ */
+void write_csv(const string &path, const string &label, const vector<PipelineStats> &pipelines) {
+  bool exists = ifstream(path.c_str()).good();
+  ofstream csv(path.c_str(), ios::app);
+  if (!exists) {
+    csv << "label,pipeline,stage,frames,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,allocations_per_frame,detection_rate,rms_px" << endl;
+  }
+  csv << std::fixed << std::setprecision(4);
+  for (int i = 0; i < pipelines.size(); i++) {
+    const PipelineStats &pipeline = pipelines[i];
+    for (int s = 0; s < pipeline.stages.size(); s++) {
+      const StageStats &stage = pipeline.stages[s];
+      csv << label << "," << pipeline.name << "," << stage.name << "," << stage.ms.size() << ","
+          << mean(stage.ms) << "," << percentile(stage.ms, 50) << "," << percentile(stage.ms, 90) << ","
+          << percentile(stage.ms, 99) << "," << percentile(stage.ms, 100) << ","
+          << (double)stage.allocations / max(1, pipeline.frames) << ","
+          << pipeline.detection_rate() << "," << pipeline.rms() << endl;
+    }
+  }
+}
+
+void write_json(const string &path, const string &label, const vector<PipelineStats> &pipelines) {
+  ofstream json(path.c_str());
+  json << std::fixed << std::setprecision(4);
+  json << "{\n  \"label\": \"" << label << "\",\n  \"pipelines\": [";
+  for (int i = 0; i < pipelines.size(); i++) {
+    const PipelineStats &pipeline = pipelines[i];
+    json << (i ? "," : "") << "\n    {\n      \"name\": \"" << pipeline.name << "\",\n"
+         << "      \"frames\": " << pipeline.frames << ",\n"
+         << "      \"detection_rate\": " << pipeline.detection_rate() << ",\n"
+         << "      \"misordered\": " << pipeline.misordered << ",\n"
+         << "      \"rms_px\": " << pipeline.rms() << ",\n"
+         << "      \"stages\": [";
+    for (int s = 0; s < pipeline.stages.size(); s++) {
+      const StageStats &stage = pipeline.stages[s];
+      json << (s ? "," : "") << "\n        {\"name\": \"" << stage.name << "\""
+           << ", \"mean_ms\": " << mean(stage.ms)
+           << ", \"p50_ms\": " << percentile(stage.ms, 50)
+           << ", \"p90_ms\": " << percentile(stage.ms, 90)
+           << ", \"p99_ms\": " << percentile(stage.ms, 99)
+           << ", \"max_ms\": " << percentile(stage.ms, 100)
+           << ", \"allocations_per_frame\": " << (double)stage.allocations / max(1, pipeline.frames) << "}";
+    }
+    json << "\n      ]\n    }";
+  }
+  json << "\n  ]\n}" << endl;
+}
+
+void print_pipeline(const PipelineStats &pipeline) {
+  cout << pipeline.name << ": " << pipeline.detected << "/" << pipeline.frames << " frames detected, "
+       << pipeline.misordered << " misordered, rms "
+       << std::fixed << std::setprecision(3) << pipeline.rms() << "px" << endl;
+  cout << "  stage\t\t\tp50\t\tp90\t\tp99\t\tallocs/frame" << endl;
+  for (int s = 0; s < pipeline.stages.size(); s++) {
+    const StageStats &stage = pipeline.stages[s];
+    cout << "  " << left << setw(24) << stage.name << right
+         << percentile(stage.ms, 50) << "ms\t" << percentile(stage.ms, 90) << "ms\t"
+         << percentile(stage.ms, 99) << "ms\t" << (double)stage.allocations / max(1, pipeline.frames) << endl;
+  }
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  if (argc < 3) {
+    cout << "Usage: " << argv[0] << " <label> <output_prefix> [rings_corpus|synthetic] [deltille_corpus|synthetic] [n_frames]" << endl;
+    return -1;
+  }
+  string label = argv[1];
+  string prefix = argv[2];
+  string rings_dir = argc > 3 ? argv[3] : "synthetic";
+  string deltille_dir = argc > 4 ? argv[4] : "synthetic";
+  int n_frames = argc > 5 ? atoi(argv[5]) : 50;
+
+  vector<PipelineStats> pipelines;
+  Corpus rings;
+  if (rings_dir == "synthetic") {
+    render_corpus(ring_board(), n_frames, rings);
+  } else if (!load_corpus(rings_dir, n_frames, rings)) {
+    cout << "Can not read the corpus " << rings_dir << endl;
+    return -1;
+  }
+  pipelines.push_back(PipelineStats("rings"));
+  benchmark_rings(rings, pipelines.back());
+  rings.frames.clear();
+
+  Corpus deltille;
+  if (deltille_dir == "synthetic") {
+    render_corpus(deltille_board(8, 5), n_frames, deltille);
+  } else if (!load_corpus(deltille_dir, n_frames, deltille)) {
+    cout << "Can not read the corpus " << deltille_dir << endl;
+    return -1;
+  }
+  pipelines.push_back(PipelineStats("deltille"));
+  benchmark_deltille(deltille, pipelines.back());
+
+  for (int i = 0; i < pipelines.size(); i++) {
+    print_pipeline(pipelines[i]);
+  }
+  write_csv(prefix + ".csv", label, pipelines);
+  write_json(prefix + "_" + label + ".json", label, pipelines);
+  // The frames rendered here are clean, a pipeline without frames in order compares the
+  // points with the wrong ground truth
+  bool synthetic[] = {rings_dir == "synthetic", deltille_dir == "synthetic"};
+  for (int i = 0; i < pipelines.size(); i++) {
+    if (synthetic[i] && pipelines[i].detected == 0) {
+      cout << pipelines[i].name << ": no synthetic frame detected in order" << endl;
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../EllipseFit.h"
+#include <iostream>
+#include <iomanip>
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Build ring like contours (rotated ellipses sampled on the pixel grid) plus
+ * clutter contours that are not rings: half of them noisy straight strokes (edges) and
+ * half of them closed outlines of thin bars (text and cables), both far below
+ * ELLIPSE_MIN_AXIS_RATIO
+ *
+ * @param n_rings Number of ellipse contours
+ * @param n_clutter Number of clutter contours
+ * @param rng Random generator
+ * @param contours Contours output
+ * @param truth Ellipse used to build every contour, size 0 for the clutter
+ */
+void synthetic_contours(int n_rings, int n_clutter, RNG &rng, vector<vector<Point> > &contours, vector<RotatedRect> &truth) {
+  for (int r = 0; r < n_rings; r++) {
+    Point2f center(rng.uniform(50.0f, 1870.0f), rng.uniform(50.0f, 1030.0f));
+    float a = rng.uniform(6.0f, 40.0f);
+    float b = a * rng.uniform(0.4f, 1.0f);
+    float angle = rng.uniform(0.0f, 180.0f);
+    vector<Point> contour;
+    int n = max(8, (int)(a * 4));
+    for (int i = 0; i < n; i++) {
+      double t = 2 * CV_PI * i / n;
+      double c = cos(angle * CV_PI / 180), s = sin(angle * CV_PI / 180);
+      double x = a * cos(t), y = b * sin(t);
+      contour.push_back(Point(cvRound(center.x + x * c - y * s), cvRound(center.y + x * s + y * c)));
+    }
+    contours.push_back(contour);
+    truth.push_back(RotatedRect(center, Size2f(2 * a, 2 * b), angle));
+  }
+  for (int r = 0; r < n_clutter; r++) {
+    double angle = rng.uniform(0.0, CV_PI);
+    Point2d dir(cos(angle), sin(angle));
+    Point2d normal(-dir.y, dir.x);
+    Point2d p(rng.uniform(0.0, 1920.0), rng.uniform(0.0, 1080.0));
+    vector<Point> contour;
+    if (r % 2 == 0) {
+      for (int i = 0; i < 30; i++) {
+        p += dir * rng.uniform(1.0, 4.0);
+        Point2d q = p + normal * rng.uniform(-1.0, 1.0);
+        contour.push_back(Point(cvRound(q.x), cvRound(q.y)));
+      }
+    } else {
+      double length = rng.uniform(60.0, 200.0);
+      double thickness = rng.uniform(1.0, 3.0);
+      int n = (int)(length / 2);
+      for (int side = -1; side <= 1; side += 2) {
+        for (int i = 0; i < n; i++) {
+          Point2d q = p + dir * (side * (length * i / n - length / 2)) + normal * (side * thickness / 2);
+          contour.push_back(Point(cvRound(q.x), cvRound(q.y)));
+        }
+      }
+    }
+    contours.push_back(contour);
+    truth.push_back(RotatedRect(p, Size2f(0, 0), 0));
+  }
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int rings[3] = {40, 200, 1000};
+  int repetitions = 20;
+  RNG rng(12345);
+  EllipseBatch batch;
+
+  cout << "contours\tfitEllipse\tbatch\t\tspeedup\tmax center error\taccepted clutter" << endl;
+  for (int s = 0; s < 3; s++) {
+    vector<vector<Point> > contours;
+    vector<RotatedRect> truth;
+    synthetic_contours(rings[s], rings[s] / 2, rng, contours, truth);
+    vector<RotatedRect> reference(contours.size());
+
+    double t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      for (int c = 0; c < contours.size(); c++) {
+        reference[c] = fitEllipse(Mat(contours[c]));
+      }
+    }
+    double t_reference = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      batch.clear();
+      for (int c = 0; c < contours.size(); c++) {
+        batch.add(contours[c]);
+      }
+      fit_ellipses(batch);
+    }
+    double t_batch = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    float max_error = 0;
+    int rejected_rings = 0;
+    int accepted_clutter = 0;
+    for (int c = 0; c < contours.size(); c++) {
+      if (truth[c].size.width == 0) {
+        accepted_clutter += batch.valid[c];
+      } else if (!batch.valid[c]) {
+        rejected_rings++;
+      } else {
+        max_error = max(max_error, (float)cv::norm(batch.ellipses[c].center - truth[c].center));
+      }
+    }
+    cout << contours.size() << "\t\t"
+         << std::fixed << std::setprecision(3) << t_reference << "ms\t"
+         << t_batch << "ms\t"
+         << std::setprecision(2) << t_reference / t_batch << "x\t"
+         << std::setprecision(3) << max_error << "px\t\t"
+         << accepted_clutter << "/" << rings[s] / 2 << endl;
+    // The rings have to be kept with the centers within the pixel quantization, and no
+    // clutter contour may reach the father/son pairing as an ellipse
+    if (rejected_rings > 0 || max_error > 1 || accepted_clutter > 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
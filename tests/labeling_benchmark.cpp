@@ -0,0 +1,98 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include <iostream>
+#include <iomanip>
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Build a segmented frame with the 5x4 ring pattern (dark rings over a light
+ * board) and dark noise
+ *
+ * @param w image width (rows)
+ * @param h image height (cols)
+ * @return Binary frame
+ */
+Mat synthetic_binary(int w, int h) {
+  Mat frame(w, h, CV_8UC1, Scalar(0));
+  rectangle(frame, Point(h * 0.1, w * 0.1), Point(h * 0.9, w * 0.9), Scalar(255), -1);
+  float radio = h / 40.0;
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 5; x++) {
+      Point center(h * (0.25 + x * 0.12), w * (0.25 + y * 0.16));
+      circle(frame, center, radio * 1.6, Scalar(0), -1);
+      circle(frame, center, radio, Scalar(255), -1);
+    }
+  }
+  Mat noise(w, h, CV_8UC1);
+  randu(noise, Scalar(0), Scalar(255));
+  frame.setTo(Scalar(0), noise > 250);
+  return frame;
+}
+
+/**
+ * @details Check that every ring of the contour search has a ring of the labeling
+ * search within one pixel
+ */
+bool same_rings(const vector<PatternPoint> &contours, const vector<PatternPoint> &labels) {
+  for (int i = 0; i < contours.size(); i++) {
+    bool found = false;
+    for (int j = 0; j < labels.size() && !found; j++) {
+      found = contours[i].distance(labels[j]) < 1;
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return contours.size() == labels.size();
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int sizes[3][2] = {{720, 1280}, {1080, 1920}, {2160, 3840}};
+  int repetitions = 20;
+  DetectionWorkspace workspace;
+
+  cout << "size\t\tcontours\tlabels\t\tspeedup" << endl;
+  for (int s = 0; s < 3; s++) {
+    int w = sizes[s][0];
+    int h = sizes[s][1];
+    Mat binary = synthetic_binary(w, h);
+    Mat copy;
+
+    double t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      // findContours can modify its input
+      binary.copyTo(copy);
+      workspace.detection.clear();
+      contour_candidates(copy, Point(0, 0), workspace);
+    }
+    double t_contours = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+    vector<PatternPoint> rings_contours = workspace.detection.candidates;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      binary.copyTo(copy);
+      workspace.detection.clear();
+      label_regions(copy, Point(0, 0), workspace.labels);
+      ring_candidates(workspace.labels, workspace.detection.candidates, workspace.detection.fathers,
+                      workspace.detection.sons, workspace.detection.singles);
+    }
+    double t_labels = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+    vector<PatternPoint> rings_labels = workspace.detection.candidates;
+
+    bool same = same_rings(rings_contours, rings_labels);
+    cout << h << "x" << w << "\t"
+         << std::fixed << std::setprecision(3) << t_contours << "ms\t"
+         << t_labels << "ms\t"
+         << std::setprecision(2) << t_contours / t_labels << "x\t"
+         << rings_labels.size() << " rings " << (same ? "same" : "DIFFERENT") << endl;
+    if (!same) {
+      return -1;
+    }
+  }
+  return 0;
+}
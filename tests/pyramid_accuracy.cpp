@@ -0,0 +1,111 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include <iostream>
+#include <iomanip>
+
+using namespace cv;
+using namespace std;
+
+/* Extra error allowed to the pyramid search over the full resolution search (pixels) */
+#define PYRAMID_TOLERANCE 0.25
+
+/**
+ * @details Build a high resolution frame with the 5x4 ring pattern at subpixel centers,
+ * the rings are drawn with 4 bits of subpixel precision and antialiasing, plus noise
+ *
+ * @param w image width (rows)
+ * @param h image height (cols)
+ * @param rng Random generator of the shift and the noise
+ * @param centers Ground truth centers, bottom row first and every row left to right as the
+ * detection orders them
+ * @return BGR frame
+ */
+Mat synthetic_frame(int w, int h, RNG &rng, vector<Point2f> &centers) {
+  Mat frame(w, h, CV_8UC3, Scalar(40, 40, 40));
+  rectangle(frame, Point(h * 0.12, w * 0.12), Point(h * 0.88, w * 0.88), Scalar(210, 210, 210), -1);
+  float radio = h / 40.0;
+  Point2f shift(rng.uniform(-20.0f, 20.0f), rng.uniform(-20.0f, 20.0f));
+  centers.clear();
+  for (int y = 3; y >= 0; y--) {
+    for (int x = 0; x < 5; x++) {
+      Point2f center = Point2f(h * (0.25 + x * 0.12), w * (0.25 + y * 0.16)) + shift;
+      Point fixed(cvRound(center.x * 16), cvRound(center.y * 16));
+      centers.push_back(Point2f(fixed.x / 16.0, fixed.y / 16.0));
+      circle(frame, fixed, cvRound(radio * 1.6 * 16), Scalar(20, 20, 20), -1, CV_AA, 4);
+      circle(frame, fixed, cvRound(radio * 16), Scalar(210, 210, 210), -1, CV_AA, 4);
+    }
+  }
+  Mat noise(w, h, CV_8UC3);
+  rng.fill(noise, RNG::NORMAL, 0, 4);
+  add(frame, noise, frame);
+  return frame;
+}
+
+/**
+ * @details Distance from every point found to the ground truth center of the same index,
+ * a misordered grid gives a large error
+ *
+ * @param points Points found
+ * @param centers Ground truth
+ * @param mean Mean error output
+ * @return Max error
+ */
+float center_error(const vector<PatternPoint> &points, const vector<Point2f> &centers, float &mean) {
+  float max_error = 0;
+  mean = 0;
+  if (points.size() != centers.size()) {
+    return FLT_MAX;
+  }
+  for (int p = 0; p < points.size(); p++) {
+    float error = cv::norm(points[p].center() - centers[p]);
+    max_error = max(max_error, error);
+    mean += error / points.size();
+  }
+  return max_error;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int w = 3000;
+  int h = 4000;
+  int frames = 5;
+  DetectionWorkspace workspace;
+  vector<PatternPoint> points;
+  vector<Point2f> centers;
+
+  cout << "levels\ttime\t\tmean error\tmax error\tfound" << endl;
+  float full_error = 0;
+  for (int levels = 0; levels <= 2; levels++) {
+    double time = 0;
+    float mean_error = 0;
+    float max_error = 0;
+    int found = 0;
+    // same seed for every level, all the levels search the same frames
+    RNG rng(12345);
+    for (int f = 0; f < frames; f++) {
+      Mat frame = synthetic_frame(w, h, rng, centers);
+      double t0 = getTickCount();
+      bool ok = detect_pattern_in_frame_pyramid(frame, w, h, points, SEGMENTATION_FUSED, levels, workspace);
+      time += (getTickCount() - t0) / getTickFrequency() * 1000 / frames;
+      if (ok) {
+        float mean;
+        max_error = max(max_error, center_error(points, centers, mean));
+        mean_error += mean;
+        found++;
+      }
+    }
+    mean_error /= max(found, 1);
+    if (levels == 0) {
+      full_error = max_error;
+    }
+    cout << levels << "\t" << std::fixed << std::setprecision(3) << time << "ms\t"
+         << mean_error << "px\t\t" << max_error << "px\t\t" << found << "/" << frames << endl;
+    // An error of a ring radius is a point matched with another ring, the grid is misordered
+    if (found != frames || max_error > h / 40.0 || max_error > full_error + PYRAMID_TOLERANCE) {
+      return -1;
+    }
+  }
+  return 0;
+}
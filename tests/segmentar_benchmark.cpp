@@ -0,0 +1,72 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../ImagePreprocessing.h"
+#include <iostream>
+#include <iomanip>
+
+using namespace cv;
+using namespace std;
+
+/**
+ * @details Build a synthetic ring pattern frame with noise to feed the segmentation
+ *
+ * @param w image width (rows)
+ * @param h image height (cols)
+ * @return Grayscale frame
+ */
+Mat synthetic_frame(int w, int h) {
+  Mat frame(w, h, CV_8UC1, Scalar(200));
+  float radio = h / 40.0;
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 5; x++) {
+      Point center(h * (0.25 + x * 0.12), w * (0.25 + y * 0.16));
+      circle(frame, center, radio * 1.6, Scalar(20), -1);
+      circle(frame, center, radio, Scalar(200), -1);
+    }
+  }
+  Mat noise(w, h, CV_8UC1);
+  randu(noise, Scalar(0), Scalar(40));
+  add(frame, noise, frame);
+  return frame;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int sizes[3][2] = {{480, 640}, {720, 1280}, {1080, 1920}};
+  int repetitions = 50;
+  vector<uint32_t> integral;
+
+  for (int s = 0; s < 3; s++) {
+    int w = sizes[s][0];
+    int h = sizes[s][1];
+    Mat gray = synthetic_frame(w, h);
+    Mat thresh, out_reference, out_fast;
+    adaptiveThreshold(gray, thresh, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 2 * SEGMENTATION_BORDER_RADIUS + 1, SEGMENTATION_BORDER_C);
+
+    double t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      out_reference = gray.clone();
+      segmentar_reference(out_reference, out_reference, thresh, w, h);
+    }
+    double t_reference = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    t0 = getTickCount();
+    for (int r = 0; r < repetitions; r++) {
+      out_fast = gray.clone();
+      segmentar(out_fast, out_fast, thresh, w, h, integral);
+    }
+    double t_fast = (getTickCount() - t0) / getTickFrequency() * 1000 / repetitions;
+
+    int different = countNonZero(out_reference != out_fast);
+    cout << h << "x" << w << "\t"
+         << std::fixed << std::setprecision(3) << t_reference << "ms\t"
+         << t_fast << "ms\t"
+         << std::setprecision(2) << t_reference / t_fast << "x\t"
+         << (different == 0 ? "identical" : "DIFFERENT") << endl;
+    if (different != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "../PatternSearch.h"
+#include "../SyntheticBoard.h"
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+using namespace cv;
+using namespace std;
+
+/*
+ * Lock losses of the ring tracking over a synthetic hand-held motion: the board moves on
+ * two sinusoids with a slow roll, the rings have an outer radius of 12 px and the center
+ * reaches 15 px per frame on each axis. The same frames are tracked with the alpha-beta
+ * PatternTracker and with the association against the previous frame (a tracker without
+ * motion model, alpha 1 and beta 0), every lock loss is a grid ordered from scratch again.
+ *
+ * Usage: tracker_benchmark [n_frames]
+ */
+
+/* Outer radius of the rings in the frame (pixels) */
+#define TRACKER_RING_RADIUS 12.0
+/* Peak speed of the board center on each axis (pixels per frame) */
+#define TRACKER_PEAK_SPEED 15.0
+
+/**
+ * @details Pose of the board in frame f, the board y axis points up in the image as in
+ * random_pose, so the control points are in the order of the detection
+ *
+ * @param board Board geometry
+ * @param view Camera of the view, the pose is written in it
+ * @param w Frame width (rows)
+ * @param h Frame height (cols)
+ * @param f Frame
+ */
+void moving_pose(const SyntheticBoard &board, SyntheticView &view, int w, int h, int f) {
+  SyntheticCamera camera(view.camera_matrix, view.dist_coeffs);
+  Point2f center = (board.area_max + board.area_min) * 0.5;
+  double z = camera.fx * board.outer / TRACKER_RING_RADIUS;
+  /* Amplitudes and periods with the peak speed of the center in x and in y */
+  double ax = 0.2 * h;
+  double ay = 0.15 * w;
+  double tx = 2 * CV_PI * ax / TRACKER_PEAK_SPEED;
+  double ty = 2 * CV_PI * ay / TRACKER_PEAK_SPEED;
+  Point2d target(h / 2.0 + ax * sin(2 * CV_PI * f / tx), w / 2.0 + ay * sin(2 * CV_PI * f / ty + 1));
+  double roll = 15 * CV_PI / 180 * sin(2 * CV_PI * f / 150.0);
+
+  Matx33d rz(cos(roll), -sin(roll), 0, sin(roll), cos(roll), 0, 0, 0, 1);
+  Matx33d flip(1, 0, 0, 0, -1, 0, 0, 0, -1);
+  Matx33d rotation = rz * flip;
+  Vec3d ray((target.x - camera.cx) / camera.fx, (target.y - camera.cy) / camera.fy, 1);
+  view.tvec = ray * z - rotation * Vec3d(center.x, center.y, 0);
+  Rodrigues(Mat(rotation), view.rvec);
+}
+
+/**
+ * @details Track the frames as the live calibration loop does: predict, mask and search
+ * inside the region of the prediction
+ *
+ * @param frames Rendered frames
+ * @param truth Control points of every frame
+ * @param tracker Tracker, cleared before the run
+ * @param mistracked Frames with the 20 points where a point is not its control point
+ * @return Frames with the 20 points
+ */
+int track_frames(const vector<Mat> &frames, const vector<vector<Point2f> > &truth, PatternTracker &tracker, int &mistracked) {
+  DetectionWorkspace workspace;
+  vector<PatternPoint> pattern_points;
+  Point mask_points[1][4];
+  Mat frame_gray;
+  int keep_per_frames = 2;
+  int w = frames[0].rows;
+  int h = frames[0].cols;
+  mask_points[0][0] = Point(0, 0);
+  mask_points[0][1] = Point(h, 0);
+  mask_points[0][2] = Point(h, w);
+  mask_points[0][3] = Point(0, w);
+  tracker.clear();
+  mistracked = 0;
+  int found = 0;
+  for (int f = 0; f < frames.size(); f++) {
+    cvtColor(frames[f], frame_gray, CV_BGR2GRAY);
+    tracker.predict(pattern_points, w, h, mask_points);
+    clean_using_mask(frame_gray, mask_points);
+    int detected_points = detect_pattern_points_tracked(frame_gray, w, h, mask_points, pattern_points, keep_per_frames, SEGMENTATION_FUSED, tracker, workspace);
+    if (detected_points != 20 || pattern_points.size() != 20) {
+      continue;
+    }
+    found++;
+    for (int p = 0; p < 20; p++) {
+      if (cv::norm(pattern_points[p].to_point2f() - truth[f][p]) > TRACKER_RING_RADIUS) {
+        mistracked++;
+        break;
+      }
+    }
+  }
+  return found;
+}
+
+/** @function main */
+int main( int argc, char** argv )
+{
+  int w = 480;
+  int h = 640;
+  int n_frames = argc > 1 ? atoi(argv[1]) : 300;
+  SyntheticBoard board = ring_board();
+  SyntheticView view;
+  view.camera_matrix = (Mat_<double>(3, 3) << 0.9 * h, 0, h / 2.0, 0, 0.9 * h, w / 2.0, 0, 0, 1);
+  view.dist_coeffs = Mat::zeros(1, 5, CV_64F);
+  view.blur_sigma = 0.8;
+  view.noise_sigma = 3;
+
+  vector<Mat> frames(n_frames);
+  vector<vector<Point2f> > truth(n_frames);
+  WorkStealingPool pool;
+  pool.run(n_frames, [&](int f, int worker) {
+    SyntheticView frame_view = view;
+    moving_pose(board, frame_view, w, h, f);
+    render_board(board, frame_view, w, h, f, frames[f]);
+    project_board_points(board, frame_view, truth[f]);
+  });
+
+  PatternTracker motion_model;
+  PatternTracker previous_frame;
+  previous_frame.alpha = 1;
+  previous_frame.beta = 0;
+  const char *names[] = {"alpha-beta", "previous frame"};
+  PatternTracker *trackers[] = {&motion_model, &previous_frame};
+  int lost[2];
+  cout << "tracking\t\tfound\tlock lost\tmistracked" << endl;
+  for (int t = 0; t < 2; t++) {
+    int mistracked;
+    int found = track_frames(frames, truth, *trackers[t], mistracked);
+    // the first acquisition is not a loss
+    lost[t] = max(0, trackers[t]->reacquisitions - 1);
+    cout << left << setw(16) << names[t] << right << "\t" << found << "/" << n_frames << "\t"
+         << lost[t] << "\t\t" << mistracked << endl;
+    if (found == 0) {
+      return -1;
+    }
+  }
+  return lost[0] <= lost[1] ? 0 : -1;
+}